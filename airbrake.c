@@ -22,15 +22,215 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <zlib.h>
 #include <curl/curl.h>
 #include <libxml/parser.h>
 
 #include "airbrake.h"
 
+/*
+ * Static tracepoints, compiled in with the AIRBRAKE_USDT build option.
+ * Each one is a single nop until a tracer attaches to it.  Provider
+ * "airbrake":
+ *
+ *   build__start(notice)                   build__done(notice, bytes, err)
+ *   transfer__start(handle, bytes)         transfer__done(handle, http_status, err)
+ *   parse__start(handle, bytes)            parse__done(handle, http_status, err)
+ *   queue__enqueue(seq, bytes, queued)     queue__dequeue(seq, bytes, queued)
+ *   queue__drop(seq, bytes)
+ *   stage__enqueue(job, stage, depth)      stage__dequeue(job, stage, depth)
+ *
+ * notice is the notice or pipeline record being built, handle the curl
+ * handle (0 for the unix transport), seq the position of a notice in the
+ * client's queue (0 when it was dropped before being queued) and job a
+ * pipeline job moving between stages.
+ */
+#ifdef AIRBRAKE_USDT
+#include <sys/sdt.h>
+#define AIRBRAKE_PROBE1(name, a) DTRACE_PROBE1(airbrake, name, a)
+#define AIRBRAKE_PROBE2(name, a, b) DTRACE_PROBE2(airbrake, name, a, b)
+#define AIRBRAKE_PROBE3(name, a, b, c) DTRACE_PROBE3(airbrake, name, a, b, c)
+#else
+#define AIRBRAKE_PROBE1(name, a) do { } while (0)
+#define AIRBRAKE_PROBE2(name, a, b) do { } while (0)
+#define AIRBRAKE_PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+typedef struct airbrake_client_buffer_t {
+    airbrake_string_t buf;
+    size_t window_peak;
+    size_t last_window_peak;
+    unsigned int window_uses;
+} airbrake_client_buffer_t;
+
+typedef enum airbrake_transport_t {
+    AIRBRAKE_TRANSPORT_CURL = 0,
+    AIRBRAKE_TRANSPORT_UNIX = 1
+} airbrake_transport_t;
+
+typedef struct airbrake_transfer_t airbrake_transfer_t;
+typedef struct airbrake_batch_entry_t airbrake_batch_entry_t;
+
+/* writes into either a section of the XML output or, for the record encoder, a scratch table */
+struct airbrake_var_writer_t {
+    airbrake_string_t *buf;
+    const char *tagname;
+    int opened;
+    airbrake_string_table_t *table;
+};
+
+typedef struct airbrake_curl_writer_t {
+    airbrake_string_t *buf;
+} airbrake_curl_writer_t;
+
+struct airbrake_transfer_t {
+    airbrake_transfer_t *next;
+    airbrake_transfer_t *prev;
+    CURL *curl;
+    airbrake_client_buffer_t request_buf;
+    airbrake_client_buffer_t response_buf;
+    airbrake_curl_writer_t writer;
+    airbrake_notice_result_t result;
+    airbrake_completion_func_t completion_func;
+    void *completion_ctx;
+    airbrake_client_t *client;
+    size_t endpoint;
+    unsigned int endpoints_tried;
+    long started_ms;
+    size_t queued_bytes;
+    unsigned long seq;
+    /* set for a batch sent through the event loop; the transfer owns these entries */
+    airbrake_batch_entry_t *batch_entries;
+    size_t batch_n;
+};
+
+typedef struct airbrake_endpoint_t {
+    airbrake_string_t url;
+    unsigned long requests;
+    unsigned long failures;
+    unsigned long consecutive_failures;
+    double latency_ms;
+    double error_rate;
+    int healthy;
+} airbrake_endpoint_t;
+
+struct airbrake_batch_entry_t {
+    airbrake_completion_func_t completion_func;
+    void *completion_ctx;
+    size_t bytes;
+    unsigned long seq;
+};
+
+typedef struct airbrake_batch_t {
+    airbrake_string_t endpoint;
+    size_t max_notices;
+    size_t max_bytes;
+    long max_delay_ms;
+    long first_enqueued_ms;
+    airbrake_string_t body;
+    airbrake_string_t compressed;
+    airbrake_batch_entry_t *entries;
+    size_t n;
+    size_t cap;
+    struct curl_slist *headers;
+} airbrake_batch_t;
+
 struct airbrake_client_opaque_t {
     CURL *curl;
+    CURLM *multi;
+    airbrake_socket_func_t socket_func;
+    airbrake_timer_func_t timer_func;
+    void *event_loop_ctx;
+    airbrake_transfer_t *transfers;
+    airbrake_transfer_t *idle_transfers;
+    size_t transfers_in_flight;
+    size_t idle_transfers_count;
+    int fire_and_forget;
+    airbrake_client_stats_t stats;
+    /* pipeline workers count notices and charge the queue from other threads */
+    pthread_mutex_t stats_mutex;
+    airbrake_batch_t batch;
+    airbrake_endpoint_t endpoints[AIRBRAKE_ENDPOINT_MAX];
+    size_t endpoints_count;
+    long submit_budget_ms;
+    long probe_interval_ms;
+    pthread_mutex_t endpoints_mutex;
+    pthread_cond_t prober_cond;
+    pthread_t prober_thread;
+    int prober_running;
+    int prober_stopping;
+    size_t queued_bytes;
+    size_t queue_limit;
+    unsigned long queue_seq;
+    airbrake_backpressure_t backpressure;
+    long block_timeout_ms;
+    airbrake_drop_func_t drop_func;
+    void *drop_ctx;
+    airbrake_string_t spill_path;
+    int spill_fd;
+    struct pollfd *watches;
+    size_t watches_count;
+    size_t watches_cap;
+    long multi_timeout_at;
+    int in_socket_action;
+    int detach_pending;
+    airbrake_transport_t transport;
+    int unix_fd;
+    int unix_connecting;
+    airbrake_string_t unix_path;
+    airbrake_string_t unix_pending;
+    airbrake_client_buffer_t request_buf;
+    airbrake_client_buffer_t response_buf;
+    size_t buffer_limit;
+    airbrake_intern_table_t *intern_table;
+    pthread_mutex_t notice_pool_mutex;
+    airbrake_notice_slot_t *notice_pool;
+    size_t notice_pool_size;
+};
+
+struct airbrake_interned_string_t {
+    airbrake_interned_string_t *hash_next;
+    airbrake_interned_string_t *lru_next;
+    airbrake_interned_string_t *lru_prev;
+    airbrake_intern_table_t *table;
+    unsigned int hash;
+    size_t refcount;
+    airbrake_string_t value;
+    airbrake_string_t escaped;
+};
+
+struct airbrake_intern_table_t {
+    pthread_mutex_t mutex;
+    airbrake_interned_string_t **buckets;
+    size_t nbuckets;
+    size_t count;
+    size_t bytes;
+    size_t max_bytes;
+    size_t referenced;
+    int orphaned;
+    airbrake_interned_string_t *lru_first;
+    airbrake_interned_string_t *lru_last;
 };
 
+static void airbrake_notice_slot_fini(airbrake_notice_slot_t *slot);
+static void airbrake_client_detach_event_loop_priv(airbrake_client_opaque_t *priv);
+static void airbrake_client_stop_prober(airbrake_client_opaque_t *priv);
+static airbrake_error_t airbrake_client_admit(airbrake_client_t *client, const airbrake_string_t *xml);
+static void airbrake_endpoint_init(airbrake_endpoint_t *endpoint, airbrake_string_t url);
+
 airbrake_client_info_t airbrake_default_client_info = {
     "libairbrake",
     AIRBRAKE_VERSION_STRING,
@@ -39,11 +239,229 @@ airbrake_client_info_t airbrake_default_client_info = {
 
 airbrake_string_t airbrake_default_notice_endpoint_url = AIRBRAKE_STRING_STATIC("http://airbrake.io/notifier_api/v2/notices");
 
-airbrake_string_t airbrake_string_null = { 0, 0, 0 };
+airbrake_string_t airbrake_string_null = { 0, 0, 0, 0, 0, 0 };
 
-typedef struct airbrake_curl_writer_t {
-    airbrake_string_t *buf;
-} airbrake_curl_writer_t;
+#ifdef AIRBRAKE_STATIC_ALLOCATION
+#if AIRBRAKE_STATIC_MAX_BLOCK & (AIRBRAKE_STATIC_MAX_BLOCK - 1)
+#error AIRBRAKE_STATIC_MAX_BLOCK must be a power of two
+#endif
+#if AIRBRAKE_STATIC_MAX_BLOCK < 16 || AIRBRAKE_STATIC_POOL_SIZE < 16
+#error AIRBRAKE_STATIC_MAX_BLOCK and AIRBRAKE_STATIC_POOL_SIZE must be at least 16
+#endif
+
+/*
+ * Fixed-capacity storage.  The static arena is managed as a buddy system:
+ * blocks are power-of-two multiples of AIRBRAKE_STATIC_MIN_BLOCK, which is
+ * how strings grow anyway, an allocation splits the smallest free block
+ * that fits, and a freed block merges with its buddy whenever that is free
+ * too, so memory released by one size of notice is available to any other.
+ * Strings, tables, backtraces, notice slots, the intern table, transfers,
+ * batches and pipeline jobs all come from here; what is left on the heap
+ * is allocated once at setup (the client, a ring handle, a pipeline and
+ * its workers) or by libcurl, libxml2 and zlib.
+ *
+ * Block sizes live in a side table of one byte per minimum block rather
+ * than in a header, so that a power-of-two request takes a block of
+ * exactly that size.
+ *
+ * Pointers that did not come from the arena, such as a backtrace the
+ * application allocated and handed to an exception, are passed on to the
+ * heap functions.
+ */
+#define AIRBRAKE_STATIC_MIN_BLOCK 16
+#define AIRBRAKE_STATIC_UNITS (AIRBRAKE_STATIC_POOL_SIZE / AIRBRAKE_STATIC_MIN_BLOCK)
+#define AIRBRAKE_STATIC_CLASSES (sizeof(size_t) * 8)
+/* tags of the first unit of each block; other units are 0 */
+#define AIRBRAKE_STATIC_TAG_FREE 0x80
+#define AIRBRAKE_STATIC_TAG_ORDER(tag) (((tag) & 0x7f) - 1)
+
+typedef struct airbrake_static_free_block_t {
+    struct airbrake_static_free_block_t *next;
+    struct airbrake_static_free_block_t *prev;
+} airbrake_static_free_block_t;
+
+static union {
+    max_align_t align;
+    unsigned char bytes[AIRBRAKE_STATIC_UNITS * AIRBRAKE_STATIC_MIN_BLOCK];
+} airbrake_static_arena;
+static unsigned char airbrake_static_tags[AIRBRAKE_STATIC_UNITS];
+static airbrake_static_free_block_t *airbrake_static_free_lists[AIRBRAKE_STATIC_CLASSES];
+static size_t airbrake_static_max_order;
+static int airbrake_static_initialized;
+static airbrake_static_stats_t airbrake_static_stats = { AIRBRAKE_STATIC_UNITS * AIRBRAKE_STATIC_MIN_BLOCK, 0, 0, 0, 0 };
+static pthread_mutex_t airbrake_static_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int airbrake_static_owns(const void *p)
+{
+    return (const unsigned char *)p >= airbrake_static_arena.bytes && (const unsigned char *)p < airbrake_static_arena.bytes + sizeof(airbrake_static_arena.bytes);
+}
+
+static void airbrake_static_push(size_t unit, size_t order)
+{
+    airbrake_static_free_block_t *block = (airbrake_static_free_block_t *)(airbrake_static_arena.bytes + unit * AIRBRAKE_STATIC_MIN_BLOCK);
+    airbrake_static_tags[unit] = AIRBRAKE_STATIC_TAG_FREE | (unsigned char)(order + 1);
+    block->prev = 0;
+    block->next = airbrake_static_free_lists[order];
+    if (block->next)
+        block->next->prev = block;
+    airbrake_static_free_lists[order] = block;
+}
+
+static void airbrake_static_unlink(airbrake_static_free_block_t *block, size_t order)
+{
+    if (block->prev)
+        block->prev->next = block->next;
+    else
+        airbrake_static_free_lists[order] = block->next;
+    if (block->next)
+        block->next->prev = block->prev;
+}
+
+/* the arena is laid out as the largest aligned blocks that fit, so a pool
+ * that is not a multiple of the largest block still gets used in full */
+static void airbrake_static_init(void)
+{
+    size_t unit = AIRBRAKE_STATIC_UNITS, order;
+
+    while (((size_t)AIRBRAKE_STATIC_MIN_BLOCK << (airbrake_static_max_order + 1)) <= AIRBRAKE_STATIC_MAX_BLOCK)
+        airbrake_static_max_order++;
+    /* pushed from the top down so that the bottom of the arena is used first */
+    while (unit > 0) {
+        order = airbrake_static_max_order;
+        while ((unit & (((size_t)1 << order) - 1)) || ((size_t)1 << order) > unit)
+            order--;
+        unit -= (size_t)1 << order;
+        airbrake_static_push(unit, order);
+    }
+    airbrake_static_initialized = 1;
+}
+
+static void *airbrake_static_alloc(size_t size)
+{
+    size_t order = 0, split, unit;
+    airbrake_static_free_block_t *block = 0;
+
+    pthread_mutex_lock(&airbrake_static_mutex);
+    if (!airbrake_static_initialized)
+        airbrake_static_init();
+    while (((size_t)AIRBRAKE_STATIC_MIN_BLOCK << order) < size && order <= airbrake_static_max_order)
+        order++;
+    for (split = order; split <= airbrake_static_max_order; split++) {
+        block = airbrake_static_free_lists[split];
+        if (block)
+            break;
+    }
+    if (!block) {
+        airbrake_static_stats.failures++;
+        pthread_mutex_unlock(&airbrake_static_mutex);
+        return 0;
+    }
+    airbrake_static_unlink(block, split);
+    unit = ((unsigned char *)block - airbrake_static_arena.bytes) / AIRBRAKE_STATIC_MIN_BLOCK;
+    /* hand the upper halves back until the block is the size asked for */
+    while (split > order) {
+        split--;
+        airbrake_static_push(unit + ((size_t)1 << split), split);
+    }
+    airbrake_static_tags[unit] = (unsigned char)(order + 1);
+
+    airbrake_static_stats.in_use += (size_t)AIRBRAKE_STATIC_MIN_BLOCK << order;
+    if (airbrake_static_stats.in_use > airbrake_static_stats.high_water)
+        airbrake_static_stats.high_water = airbrake_static_stats.in_use;
+    if ((unit + ((size_t)1 << order)) * AIRBRAKE_STATIC_MIN_BLOCK > airbrake_static_stats.carved)
+        airbrake_static_stats.carved = (unit + ((size_t)1 << order)) * AIRBRAKE_STATIC_MIN_BLOCK;
+    pthread_mutex_unlock(&airbrake_static_mutex);
+    return block;
+}
+
+static void airbrake_static_free(void *p)
+{
+    size_t unit, order, buddy;
+
+    if (!p)
+        return;
+    if (!airbrake_static_owns(p)) {
+        free(p);
+        return;
+    }
+    pthread_mutex_lock(&airbrake_static_mutex);
+    unit = ((unsigned char *)p - airbrake_static_arena.bytes) / AIRBRAKE_STATIC_MIN_BLOCK;
+    order = AIRBRAKE_STATIC_TAG_ORDER(airbrake_static_tags[unit]);
+    airbrake_static_stats.in_use -= (size_t)AIRBRAKE_STATIC_MIN_BLOCK << order;
+    while (order < airbrake_static_max_order) {
+        buddy = unit ^ ((size_t)1 << order);
+        if (buddy + ((size_t)1 << order) > AIRBRAKE_STATIC_UNITS || airbrake_static_tags[buddy] != (AIRBRAKE_STATIC_TAG_FREE | (unsigned char)(order + 1)))
+            break;
+        airbrake_static_unlink((airbrake_static_free_block_t *)(airbrake_static_arena.bytes + buddy * AIRBRAKE_STATIC_MIN_BLOCK), order);
+        airbrake_static_tags[unit] = 0;
+        airbrake_static_tags[buddy] = 0;
+        unit &= ~((size_t)1 << order);
+        order++;
+    }
+    airbrake_static_push(unit, order);
+    pthread_mutex_unlock(&airbrake_static_mutex);
+}
+
+static void *airbrake_static_calloc(size_t nmemb, size_t size)
+{
+    void *p;
+
+    if (size && nmemb > (size_t)-1 / size)
+        return 0;
+    p = airbrake_static_alloc(nmemb * size);
+    if (p)
+        memset(p, 0, nmemb * size);
+    return p;
+}
+
+static void *airbrake_static_realloc(void *p, size_t size)
+{
+    size_t block;
+    void *new_p;
+
+    if (!p)
+        return airbrake_static_alloc(size);
+    if (!airbrake_static_owns(p))
+        return realloc(p, size);
+    block = (size_t)AIRBRAKE_STATIC_MIN_BLOCK << AIRBRAKE_STATIC_TAG_ORDER(airbrake_static_tags[((unsigned char *)p - airbrake_static_arena.bytes) / AIRBRAKE_STATIC_MIN_BLOCK]);
+    if (size <= block)
+        return p;
+    new_p = airbrake_static_alloc(size);
+    if (!new_p)
+        return 0;
+    memcpy(new_p, p, block);
+    airbrake_static_free(p);
+    return new_p;
+}
+
+void airbrake_static_get_stats(airbrake_static_stats_t *stats)
+{
+    pthread_mutex_lock(&airbrake_static_mutex);
+    *stats = airbrake_static_stats;
+    pthread_mutex_unlock(&airbrake_static_mutex);
+}
+
+/* whether more than 1/share of the arena is in use */
+static int airbrake_static_pressure(size_t share)
+{
+    int retval;
+    pthread_mutex_lock(&airbrake_static_mutex);
+    retval = airbrake_static_stats.in_use > airbrake_static_stats.pool_size / share;
+    pthread_mutex_unlock(&airbrake_static_mutex);
+    return retval;
+}
+
+#define airbrake_malloc(size) airbrake_static_alloc(size)
+#define airbrake_calloc(nmemb, size) airbrake_static_calloc(nmemb, size)
+#define airbrake_realloc(p, size) airbrake_static_realloc(p, size)
+#define airbrake_free(p) airbrake_static_free(p)
+#else
+#define airbrake_malloc(size) malloc(size)
+#define airbrake_calloc(nmemb, size) calloc(nmemb, size)
+#define airbrake_realloc(p, size) realloc(p, size)
+#define airbrake_free(p) free(p)
+#define airbrake_static_pressure(share) 0
+#endif
 
 static size_t airbrake_curl_writer_func(char *ptr, size_t size, size_t nmemb, airbrake_curl_writer_t *writer)
 {
@@ -54,6 +472,54 @@ static size_t airbrake_curl_writer_func(char *ptr, size_t size, size_t nmemb, ai
     return nbytes;
 }
 
+static size_t airbrake_curl_discard_func(char *ptr, size_t size, size_t nmemb, void *unused)
+{
+    return size * nmemb;
+}
+
+static size_t airbrake_string_xml_escaped_length_scan(const char *p, size_t l)
+{
+    const char *e = p + l;
+    size_t n = l;
+
+    for (; p < e; p++) {
+        switch (*p) {
+        case '<':
+        case '>':
+            n += 3;
+            break;
+        case '&':
+            n += 4;
+            break;
+        case '"':
+            n += 5;
+            break;
+        }
+    }
+    return n;
+}
+
+/*
+ * Strings set through airbrake_string_init() and airbrake_string_assign()
+ * remember their escaped length, so that those serialized over and over
+ * (the API key, the environment, repeated request fields) are scanned once
+ * and copied in one piece when there is nothing to escape.  The cache is
+ * only ever read here; a const string is never written to.
+ */
+static size_t airbrake_string_xml_escaped_length(const airbrake_string_t *src)
+{
+    if (src->xl && src->xp == src->p && src->xn == src->l)
+        return src->xl - 1;
+    return airbrake_string_xml_escaped_length_scan(src->p, src->l);
+}
+
+static void airbrake_string_cache_xml_escaped_length(airbrake_string_t *string)
+{
+    string->xl = airbrake_string_xml_escaped_length_scan(string->p, string->l) + 1;
+    string->xp = string->p;
+    string->xn = string->l;
+}
+
 airbrake_error_t airbrake_string_init(airbrake_string_t *string, const char *str, size_t str_len)
 {
     char *p;
@@ -61,16 +527,18 @@ airbrake_error_t airbrake_string_init(airbrake_string_t *string, const char *str
         string->p = 0;
         string->l = 0;
         string->al = 0;
+        string->xl = 0;
         return AIRBRAKE_OK;
     }
-    p = malloc(str_len + 1);
+    p = airbrake_malloc(str_len + 1);
     if (!p)
         return AIRBRAKE_ERROR_MEM;
     memmove(p, str, str_len);
     p[str_len] = 0;
     string->p = p;
     string->l = str_len;
-    string->al = str_len;
+    string->al = str_len + 1;
+    airbrake_string_cache_xml_escaped_length(string);
     return AIRBRAKE_OK;
 }
 
@@ -86,6 +554,8 @@ inline airbrake_error_t airbrake_string_grow(airbrake_string_t *string, size_t n
 
     if (requested_al == 0)
         return AIRBRAKE_ERROR_MEM;
+    if (string->al & AIRBRAKE_STRING_FIXED)
+        return requested_al <= (string->al & ~AIRBRAKE_STRING_FIXED) ? AIRBRAKE_OK: AIRBRAKE_ERROR_TRUNCATED;
     if (string->al >= requested_al)
         return AIRBRAKE_OK;
     new_al = 1;
@@ -94,7 +564,7 @@ inline airbrake_error_t airbrake_string_grow(airbrake_string_t *string, size_t n
         if (new_al == 0)
             return AIRBRAKE_ERROR_MEM;
     }
-    new_p = realloc(string->p, new_al);
+    new_p = airbrake_realloc(string->p, new_al);
     if (!new_p)
         return AIRBRAKE_ERROR_MEM;
     string->p = new_p;
@@ -110,16 +580,50 @@ airbrake_error_t airbrake_string_append(airbrake_string_t *string, airbrake_stri
     memmove(string->p + string->l, other.p, other.l);
     string->l += other.l;
     string->p[string->l] = 0;
+    string->xl = 0;
     return AIRBRAKE_OK;
 }
 
-void airbrake_string_fini(airbrake_string_t *string)
+airbrake_error_t airbrake_string_assign(airbrake_string_t *string, airbrake_string_t other)
+{
+    airbrake_error_t err;
+    if (!other.p) {
+        airbrake_string_fini(string);
+        string->l = 0;
+        string->al = 0;
+        return AIRBRAKE_OK;
+    }
+    if (string->al == 0)
+        string->p = 0;
+    string->l = 0;
+    string->xl = 0;
+    err = airbrake_string_grow(string, other.l);
+    if (err)
+        return err;
+    memmove(string->p, other.p, other.l);
+    string->l = other.l;
+    string->p[string->l] = 0;
+    airbrake_string_cache_xml_escaped_length(string);
+    return AIRBRAKE_OK;
+}
+
+static void airbrake_string_clear(airbrake_string_t *string)
 {
     if (string->al > 0) {
+        string->l = 0;
+        string->p[0] = 0;
+    }
+    string->xl = 0;
+}
+
+void airbrake_string_fini(airbrake_string_t *string)
+{
+    if (string->al > 0 && !(string->al & AIRBRAKE_STRING_FIXED)) {
         if (string->p)
-            free(string->p);
+            airbrake_free(string->p);
     }
     string->p = 0;
+    string->xl = 0;
 }
 
 static airbrake_error_t airbrake_string_table_entry_init(airbrake_string_table_entry_t *entry, const airbrake_string_t *key, const airbrake_string_t *value)
@@ -146,27 +650,56 @@ static void airbrake_string_table_entry_fini(airbrake_string_table_entry_t *entr
 airbrake_error_t airbrake_string_table_init(airbrake_string_table_t *table)
 {
     table->first = table->last = 0;
+    table->spare = 0;
     return AIRBRAKE_OK;
 }
 
 void airbrake_string_table_fini(airbrake_string_table_t *table)
 {
     airbrake_string_table_entry_t *i, *next;
-    for (i = table->first; i; i = next) {
+    airbrake_string_table_reset(table);
+    for (i = table->spare; i; i = next) {
         next = i->next;
         airbrake_string_table_entry_fini(i);
-        free(i);
+        airbrake_free(i);
     }
+    table->spare = 0;
+}
+
+void airbrake_string_table_reset(airbrake_string_table_t *table)
+{
+    if (!table->first)
+        return;
+    table->last->next = table->spare;
+    table->spare = table->first;
     table->first = table->last = 0;
 }
 
 airbrake_error_t airbrake_string_table_add(airbrake_string_table_t *table, airbrake_string_t key, airbrake_string_t value)
 {
-    airbrake_string_table_entry_t *new_entry = malloc(sizeof(airbrake_string_table_entry_t));
-    if (!new_entry)
-        return AIRBRAKE_ERROR_MEM;
-    airbrake_string_table_entry_init(new_entry, &key, &value);
+    airbrake_error_t err;
+    airbrake_string_table_entry_t *new_entry = table->spare;
 
+    if (new_entry) {
+        err = airbrake_string_assign(&new_entry->key, key);
+        if (err)
+            return err;
+        err = airbrake_string_assign(&new_entry->value, value);
+        if (err)
+            return err;
+        table->spare = new_entry->next;
+    } else {
+        new_entry = airbrake_malloc(sizeof(airbrake_string_table_entry_t));
+        if (!new_entry)
+            return AIRBRAKE_ERROR_MEM;
+        err = airbrake_string_table_entry_init(new_entry, &key, &value);
+        if (err) {
+            airbrake_free(new_entry);
+            return err;
+        }
+    }
+
+    new_entry->next = 0;
     if (table->last) {
         table->last->next = new_entry;
     } else {
@@ -186,6 +719,9 @@ airbrake_error_t airbrake_request_info_init(airbrake_request_info_t *request_inf
     request_info->params.first = 0;
     request_info->session.first = 0;
     request_info->cgi_data.first = 0;
+    request_info->params_provider.func = 0;
+    request_info->session_provider.func = 0;
+    request_info->cgi_data_provider.func = 0;
     err = airbrake_string_init_c(&request_info->url, &url);
     if (err)
         goto fail;
@@ -215,6 +751,51 @@ fail:
     return err;
 }
 
+airbrake_error_t airbrake_request_info_reset(airbrake_request_info_t *request_info, airbrake_string_t url, airbrake_string_t component, airbrake_string_t action)
+{
+    airbrake_error_t err;
+    airbrake_string_table_reset(&request_info->params);
+    airbrake_string_table_reset(&request_info->session);
+    airbrake_string_table_reset(&request_info->cgi_data);
+    request_info->params_provider.func = 0;
+    request_info->session_provider.func = 0;
+    request_info->cgi_data_provider.func = 0;
+    err = airbrake_string_assign(&request_info->url, url);
+    if (err)
+        return err;
+    err = airbrake_string_assign(&request_info->component, component);
+    if (err)
+        return err;
+    return airbrake_string_assign(&request_info->action, action);
+}
+
+/*
+ * A provider is called only when a serializer writes its section, after the
+ * entries of the corresponding table, and writes its variables straight into
+ * the output through airbrake_var_writer_write().  Whatever it refers to has
+ * to stay alive until the notice has been serialized.
+ */
+void airbrake_request_info_set_provider(airbrake_request_info_t *request_info, airbrake_request_section_t section, airbrake_provider_func_t func, void *ctx)
+{
+    airbrake_provider_t *provider;
+
+    switch (section) {
+    case AIRBRAKE_REQUEST_PARAMS:
+        provider = &request_info->params_provider;
+        break;
+    case AIRBRAKE_REQUEST_SESSION:
+        provider = &request_info->session_provider;
+        break;
+    case AIRBRAKE_REQUEST_CGI_DATA:
+        provider = &request_info->cgi_data_provider;
+        break;
+    default:
+        return;
+    }
+    provider->func = func;
+    provider->ctx = ctx;
+}
+
 void airbrake_request_info_fini(airbrake_request_info_t *request_info)
 {
     airbrake_string_fini(&request_info->url);
@@ -252,6 +833,18 @@ fail:
     return err; 
 }
 
+airbrake_error_t airbrake_environment_info_reset(airbrake_environment_info_t *environment_info, airbrake_string_t project_root, airbrake_string_t environment_name, airbrake_string_t app_version)
+{
+    airbrake_error_t err;
+    err = airbrake_string_assign(&environment_info->project_root, project_root);
+    if (err)
+        return err;
+    err = airbrake_string_assign(&environment_info->environment_name, environment_name);
+    if (err)
+        return err;
+    return airbrake_string_assign(&environment_info->app_version, app_version);
+}
+
 void airbrake_environment_info_fini(airbrake_environment_info_t *environment_info)
 {
     airbrake_string_fini(&environment_info->project_root);
@@ -266,6 +859,8 @@ static airbrake_error_t airbrake_backtrace_entry_init(airbrake_backtrace_entry_t
     entry->method.p = 0;
     entry->file.p = 0;
     entry->line = line;
+    entry->interned_method = 0;
+    entry->interned_file = 0;
     err = airbrake_string_init_c(&entry->method, method);
     if (err)
         goto fail;
@@ -276,10 +871,45 @@ static airbrake_error_t airbrake_backtrace_entry_init(airbrake_backtrace_entry_t
 fail:
     airbrake_string_fini(&entry->method);
     airbrake_string_fini(&entry->file);
+    return err;
+}
+
+/* an interned name displaces the private buffer; a private copy reuses
+ * whatever buffer a spare entry still has */
+static airbrake_error_t airbrake_backtrace_entry_assign_name(airbrake_string_t *name, airbrake_interned_string_t **interned, airbrake_intern_table_t *table, const airbrake_string_t *value)
+{
+    /* the table refuses new strings once it is full of referenced ones;
+     * fall back to a private copy in that case */
+    if (airbrake_intern_table_get(table, interned, *value) == AIRBRAKE_OK) {
+        airbrake_string_fini(name);
+        *name = airbrake_interned_string_value(*interned);
+        return AIRBRAKE_OK;
+    }
+    *interned = 0;
+    return airbrake_string_assign(name, *value);
+}
+
+static airbrake_error_t airbrake_backtrace_entry_assign_interned(airbrake_backtrace_entry_t *entry, airbrake_intern_table_t *table, const airbrake_string_t *method, const airbrake_string_t *file, int line)
+{
+    airbrake_error_t err;
+    entry->next = entry->prev = 0;
+    entry->line = line;
+    err = airbrake_backtrace_entry_assign_name(&entry->method, &entry->interned_method, table, method);
+    if (err)
+        return err;
+    return airbrake_backtrace_entry_assign_name(&entry->file, &entry->interned_file, table, file);
 }
 
 static void airbrake_backtrace_entry_fini(airbrake_backtrace_entry_t *entry)
 {
+    if (entry->interned_method) {
+        airbrake_interned_string_release(entry->interned_method);
+        entry->interned_method = 0;
+    }
+    if (entry->interned_file) {
+        airbrake_interned_string_release(entry->interned_file);
+        entry->interned_file = 0;
+    }
     airbrake_string_fini(&entry->method);
     airbrake_string_fini(&entry->file);
 }
@@ -287,27 +917,51 @@ static void airbrake_backtrace_entry_fini(airbrake_backtrace_entry_t *entry)
 airbrake_error_t airbrake_backtrace_init(airbrake_backtrace_t *backtrace)
 {
     backtrace->first = backtrace->last = 0;
+    backtrace->spare = 0;
     return AIRBRAKE_OK;
 }
 
 void airbrake_backtrace_fini(airbrake_backtrace_t *backtrace)
 {
     airbrake_backtrace_entry_t *i, *next;
-    for (i = backtrace->first; i; i = next) {
+    airbrake_backtrace_reset(backtrace);
+    for (i = backtrace->spare; i; i = next) {
         next = i->next;
         airbrake_backtrace_entry_fini(i);
-        free(i);
+        airbrake_free(i);
     }
-    backtrace->first = backtrace->last = 0;
+    backtrace->spare = 0;
 }
 
-airbrake_error_t airbrake_backtrace_add_entry(airbrake_backtrace_t *backtrace, airbrake_string_t method, airbrake_string_t file, int line)
+void airbrake_backtrace_reset(airbrake_backtrace_t *backtrace)
 {
-    airbrake_backtrace_entry_t *new_entry = malloc(sizeof(airbrake_backtrace_entry_t));
-    if (!new_entry)
-        return AIRBRAKE_ERROR_MEM;
-    airbrake_backtrace_entry_init(new_entry, &method, &file, line);
+    airbrake_backtrace_entry_t *i;
+    if (!backtrace->first)
+        return;
+    for (i = backtrace->first; i; i = i->next) {
+        /* interned names are views into the intern table; drop them so
+         * that only privately owned buffers are kept for reuse */
+        if (i->interned_method) {
+            airbrake_interned_string_release(i->interned_method);
+            i->interned_method = 0;
+            i->method.p = 0;
+            i->method.al = 0;
+        }
+        if (i->interned_file) {
+            airbrake_interned_string_release(i->interned_file);
+            i->interned_file = 0;
+            i->file.p = 0;
+            i->file.al = 0;
+        }
+    }
+    backtrace->last->next = backtrace->spare;
+    backtrace->spare = backtrace->first;
+    backtrace->first = backtrace->last = 0;
+}
 
+static void airbrake_backtrace_link_entry(airbrake_backtrace_t *backtrace, airbrake_backtrace_entry_t *new_entry)
+{
+    new_entry->next = 0;
     if (backtrace->last) {
         backtrace->last->next = new_entry;
     } else {
@@ -315,644 +969,4383 @@ airbrake_error_t airbrake_backtrace_add_entry(airbrake_backtrace_t *backtrace, a
     }
     new_entry->prev = backtrace->last;
     backtrace->last = new_entry;
+}
+
+airbrake_error_t airbrake_backtrace_add_entry(airbrake_backtrace_t *backtrace, airbrake_string_t method, airbrake_string_t file, int line)
+{
+    airbrake_error_t err;
+    airbrake_backtrace_entry_t *new_entry = backtrace->spare;
+
+    if (new_entry) {
+        err = airbrake_string_assign(&new_entry->method, method);
+        if (err)
+            return err;
+        err = airbrake_string_assign(&new_entry->file, file);
+        if (err)
+            return err;
+        new_entry->line = line;
+        backtrace->spare = new_entry->next;
+    } else {
+        new_entry = airbrake_malloc(sizeof(airbrake_backtrace_entry_t));
+        if (!new_entry)
+            return AIRBRAKE_ERROR_MEM;
+        err = airbrake_backtrace_entry_init(new_entry, &method, &file, line);
+        if (err) {
+            airbrake_free(new_entry);
+            return err;
+        }
+    }
+
+    airbrake_backtrace_link_entry(backtrace, new_entry);
     return AIRBRAKE_OK;
 }
 
-airbrake_error_t airbrake_exception_init(airbrake_exception_t *exception, airbrake_string_t klass, airbrake_string_t message)
+airbrake_error_t airbrake_backtrace_add_entry_interned(airbrake_backtrace_t *backtrace, airbrake_intern_table_t *table, airbrake_string_t method, airbrake_string_t file, int line)
 {
-    airbrake_error_t err = AIRBRAKE_OK;
-    exception->backtrace = 0;
-    exception->klass.p = 0;
-    exception->message.p = 0;
+    airbrake_error_t err;
+    airbrake_backtrace_entry_t *new_entry = backtrace->spare;
 
-    err = airbrake_string_init_c(&exception->klass, &klass);
-    if (err)
-        goto fail;
-    err = airbrake_string_init_c(&exception->message, &message);
-    if (err)
-        goto fail;
+    if (new_entry) {
+        backtrace->spare = new_entry->next;
+    } else {
+        new_entry = airbrake_malloc(sizeof(airbrake_backtrace_entry_t));
+        if (!new_entry)
+            return AIRBRAKE_ERROR_MEM;
+        new_entry->method = airbrake_string_null;
+        new_entry->file = airbrake_string_null;
+    }
+    new_entry->interned_method = 0;
+    new_entry->interned_file = 0;
+    err = airbrake_backtrace_entry_assign_interned(new_entry, table, &method, &file, line);
+    if (err) {
+        airbrake_backtrace_entry_fini(new_entry);
+        airbrake_free(new_entry);
+        return err;
+    }
 
+    airbrake_backtrace_link_entry(backtrace, new_entry);
     return AIRBRAKE_OK;
-fail:
-    airbrake_string_fini(&exception->klass);
-    airbrake_string_fini(&exception->message);
-    return err;
 }
 
-void airbrake_exception_fini(airbrake_exception_t *exception)
+static unsigned int airbrake_intern_hash(const airbrake_string_t *str)
 {
-    airbrake_string_fini(&exception->klass);
-    airbrake_string_fini(&exception->message);
-    if (exception->backtrace) {
-        airbrake_backtrace_fini(exception->backtrace);
-        free(exception->backtrace);
-        exception->backtrace = 0;
+    unsigned int h = 2166136261u;
+    const unsigned char *p = (const unsigned char *)str->p, *e = p + str->l;
+    for (; p < e; p++) {
+        h ^= *p;
+        h *= 16777619u;
     }
+    return h;
 }
 
-airbrake_error_t airbrake_notice_init(airbrake_notice_t *notice)
+static size_t airbrake_interned_string_footprint(const airbrake_interned_string_t *interned)
 {
-    notice->exception = 0;
-    notice->request = 0;
-    notice->environment = 0;
-    return AIRBRAKE_OK;
+    return sizeof(airbrake_interned_string_t) + interned->value.al + interned->escaped.al;
 }
 
-void airbrake_notice_fini(airbrake_notice_t *notice)
+static void airbrake_intern_table_lru_unlink(airbrake_intern_table_t *table, airbrake_interned_string_t *interned)
 {
+    if (interned->lru_prev)
+        interned->lru_prev->lru_next = interned->lru_next;
+    else
+        table->lru_first = interned->lru_next;
+    if (interned->lru_next)
+        interned->lru_next->lru_prev = interned->lru_prev;
+    else
+        table->lru_last = interned->lru_prev;
+    interned->lru_next = interned->lru_prev = 0;
 }
 
-airbrake_error_t airbrake_notice_result_init(airbrake_notice_result_t *notice_result, airbrake_string_t error_id, airbrake_string_t url, airbrake_string_t id)
+static void airbrake_intern_table_lru_append(airbrake_intern_table_t *table, airbrake_interned_string_t *interned)
 {
-    airbrake_error_t err;
+    interned->lru_next = 0;
+    interned->lru_prev = table->lru_last;
+    if (table->lru_last)
+        table->lru_last->lru_next = interned;
+    else
+        table->lru_first = interned;
+    table->lru_last = interned;
+}
 
-    err = airbrake_string_init_c(&notice_result->error_id, &error_id);
-    if (err)
-        return err;
-    err = airbrake_string_init_c(&notice_result->url, &url);
-    if (err)
-        return err;
-    err = airbrake_string_init_c(&notice_result->id, &id);
-    if (err)
-        return err;
+static void airbrake_intern_table_evict(airbrake_intern_table_t *table, airbrake_interned_string_t *interned)
+{
+    airbrake_interned_string_t **pp = &table->buckets[interned->hash & (table->nbuckets - 1)];
+    while (*pp != interned)
+        pp = &(*pp)->hash_next;
+    *pp = interned->hash_next;
+    airbrake_intern_table_lru_unlink(table, interned);
+    table->bytes -= airbrake_interned_string_footprint(interned);
+    table->count--;
+    airbrake_string_fini(&interned->value);
+    airbrake_string_fini(&interned->escaped);
+    airbrake_free(interned);
+}
 
-    return AIRBRAKE_OK;
-fail:
-    airbrake_string_fini(&notice_result->error_id);
-    airbrake_string_fini(&notice_result->url);
-    airbrake_string_fini(&notice_result->id);
-    return err;
+static void airbrake_intern_table_make_room(airbrake_intern_table_t *table, size_t needed)
+{
+    while (table->lru_first && table->bytes + needed > table->max_bytes)
+        airbrake_intern_table_evict(table, table->lru_first);
 }
 
-void airbrake_notice_result_fini(airbrake_notice_result_t *notice_result)
+static void airbrake_intern_table_rehash(airbrake_intern_table_t *table)
 {
-    airbrake_string_fini(&notice_result->error_id);
-    airbrake_string_fini(&notice_result->url);
-    airbrake_string_fini(&notice_result->id);
-}
+    size_t new_nbuckets = table->nbuckets << 1, i;
+    airbrake_interned_string_t **new_buckets;
 
+    if (new_nbuckets == 0)
+        return;
+    new_buckets = airbrake_calloc(new_nbuckets, sizeof(airbrake_interned_string_t *));
+    if (!new_buckets)
+        return;
+    for (i = 0; i < table->nbuckets; i++) {
+        airbrake_interned_string_t *j, *next;
+        for (j = table->buckets[i]; j; j = next) {
+            airbrake_interned_string_t **bucket = &new_buckets[j->hash & (new_nbuckets - 1)];
+            next = j->hash_next;
+            j->hash_next = *bucket;
+            *bucket = j;
+        }
+    }
+    airbrake_free(table->buckets);
+    table->buckets = new_buckets;
+    table->nbuckets = new_nbuckets;
+}
 
-airbrake_error_t airbrake_client_opaque_init(airbrake_client_opaque_t **data)
+airbrake_error_t airbrake_intern_table_init(airbrake_intern_table_t **table, size_t max_bytes)
 {
-    airbrake_client_opaque_t *_data = malloc(sizeof(airbrake_client_opaque_t));
-    if (!_data)
+    airbrake_intern_table_t *_table = airbrake_malloc(sizeof(airbrake_intern_table_t));
+    if (!_table)
         return AIRBRAKE_ERROR_MEM;
-    _data->curl = curl_easy_init();
-    if (!_data) {
-        free(_data);
+    _table->nbuckets = 64;
+    _table->buckets = airbrake_calloc(_table->nbuckets, sizeof(airbrake_interned_string_t *));
+    if (!_table->buckets) {
+        airbrake_free(_table);
+        return AIRBRAKE_ERROR_MEM;
+    }
+    if (pthread_mutex_init(&_table->mutex, 0)) {
+        airbrake_free(_table->buckets);
+        airbrake_free(_table);
         return AIRBRAKE_ERROR_UNKNOWN;
     }
-    *data = _data;
+    _table->count = 0;
+    _table->bytes = 0;
+    _table->max_bytes = max_bytes;
+    _table->referenced = 0;
+    _table->orphaned = 0;
+    _table->lru_first = _table->lru_last = 0;
+    *table = _table;
     return AIRBRAKE_OK;
 }
 
-void airbrake_client_opaque_fini(airbrake_client_opaque_t **data)
+static void airbrake_intern_table_destroy(airbrake_intern_table_t *table)
 {
-    curl_easy_cleanup((*data)->curl);
-    free(*data);
-    *data = 0;
+    size_t i;
+    for (i = 0; i < table->nbuckets; i++) {
+        airbrake_interned_string_t *j, *next;
+        for (j = table->buckets[i]; j; j = next) {
+            next = j->hash_next;
+            airbrake_string_fini(&j->value);
+            airbrake_string_fini(&j->escaped);
+            airbrake_free(j);
+        }
+    }
+    pthread_mutex_destroy(&table->mutex);
+    airbrake_free(table->buckets);
+    airbrake_free(table);
 }
 
-airbrake_error_t airbrake_client_init(airbrake_client_t *client, const airbrake_client_info_t *info, airbrake_string_t notice_endpoint, airbrake_string_t api_key)
+/*
+ * Strings still referenced, say from a backtrace that outlives its client,
+ * keep the table alive; the last of them to be released frees it.
+ */
+void airbrake_intern_table_fini(airbrake_intern_table_t **table)
 {
-    airbrake_error_t err;
-    client->info = info ? info: &airbrake_default_client_info;
-    err = airbrake_client_opaque_init(&client->priv);
-    if (err)
-        return err;
-    err = airbrake_string_init_c(&client->notice_endpoint, &notice_endpoint);
-    if (err) {
-        airbrake_client_opaque_fini(&client->priv);
-        return err;
+    airbrake_intern_table_t *_table = *table;
+    int referenced;
+
+    *table = 0;
+    pthread_mutex_lock(&_table->mutex);
+    _table->orphaned = 1;
+    while (_table->lru_first)
+        airbrake_intern_table_evict(_table, _table->lru_first);
+    referenced = _table->referenced > 0;
+    pthread_mutex_unlock(&_table->mutex);
+    if (!referenced)
+        airbrake_intern_table_destroy(_table);
+}
+
+airbrake_error_t airbrake_intern_table_get(airbrake_intern_table_t *table, airbrake_interned_string_t **retval, airbrake_string_t str)
+{
+    airbrake_error_t err = AIRBRAKE_OK;
+    unsigned int hash = airbrake_intern_hash(&str);
+    airbrake_interned_string_t *i;
+
+    pthread_mutex_lock(&table->mutex);
+    for (i = table->buckets[hash & (table->nbuckets - 1)]; i; i = i->hash_next) {
+        if (i->hash == hash && i->value.l == str.l && memcmp(i->value.p, str.p, str.l) == 0) {
+            if (i->refcount++ == 0) {
+                airbrake_intern_table_lru_unlink(table, i);
+                table->referenced++;
+            }
+            *retval = i;
+            goto out;
+        }
     }
-    err = airbrake_string_init_c(&client->api_key, &api_key);
+
+    airbrake_intern_table_make_room(table, sizeof(airbrake_interned_string_t) + str.l + 1);
+    if (table->bytes + sizeof(airbrake_interned_string_t) + str.l + 1 > table->max_bytes) {
+        err = AIRBRAKE_ERROR_MEM;
+        goto out;
+    }
+
+    i = airbrake_malloc(sizeof(airbrake_interned_string_t));
+    if (!i) {
+        err = AIRBRAKE_ERROR_MEM;
+        goto out;
+    }
+    err = airbrake_string_init(&i->value, str.p ? str.p: "", str.l);
     if (err) {
-        airbrake_string_fini(&client->notice_endpoint);
-        airbrake_client_opaque_fini(&client->priv);
-        return err;
+        airbrake_free(i);
+        goto out;
     }
-    return AIRBRAKE_OK;
+    i->escaped = airbrake_string_null;
+    i->table = table;
+    i->hash = hash;
+    i->refcount = 1;
+    i->lru_next = i->lru_prev = 0;
+    i->hash_next = table->buckets[hash & (table->nbuckets - 1)];
+    table->buckets[hash & (table->nbuckets - 1)] = i;
+    table->bytes += airbrake_interned_string_footprint(i);
+    table->referenced++;
+    if (++table->count > table->nbuckets)
+        airbrake_intern_table_rehash(table);
+    *retval = i;
+out:
+    pthread_mutex_unlock(&table->mutex);
+    return err;
 }
 
-static airbrake_error_t airbrake_string_append_xml_escape(airbrake_string_t *string, const airbrake_string_t *src)
+size_t airbrake_intern_table_size(airbrake_intern_table_t *table)
 {
-    airbrake_error_t err;
-    size_t o = string->l;
-    const char *p = src->p, *e = src->p + src->l;
+    size_t retval;
+    pthread_mutex_lock(&table->mutex);
+    retval = table->bytes;
+    pthread_mutex_unlock(&table->mutex);
+    return retval;
+}
 
-    err = airbrake_string_grow(string, string->l + src->l);
-    if (err)
-        return err;
+airbrake_string_t airbrake_interned_string_value(const airbrake_interned_string_t *interned)
+{
+    return airbrake_string_static(interned->value.p, interned->value.l);
+}
 
-    for (; p < e; p++) {
-        if (*p == '<') {
-            err = airbrake_string_grow(string, o + 4);
-            if (err)
-                return err;
-            memmove(&string->p[o], "&lt;", 4);
-            o += 4;
-        } else if (*p == '>') {
-            err = airbrake_string_grow(string, o + 4);
-            if (err)
-                return err;
-            memmove(&string->p[o], "&gt;", 4);
-            o += 4;
-        } else if (*p == '&') {
-            err = airbrake_string_grow(string, o + 5);
-            if (err)
-                return err;
-            memmove(&string->p[o], "&amp;", 5);
-            o += 5;
-        } else if (*p == '"') {
-            err = airbrake_string_grow(string, o + 6);
-            if (err)
-                return err;
-            memmove(&string->p[o], "&quot;", 6);
-            o += 6;
-        } else {
-            err = airbrake_string_grow(string, o + 1);
-            if (err)
-                return err;
-            string->p[o] = *p;
-            o++;
+airbrake_error_t airbrake_interned_string_escaped(airbrake_interned_string_t *interned, airbrake_string_t *retval)
+{
+    airbrake_error_t err = AIRBRAKE_OK;
+    airbrake_intern_table_t *table = interned->table;
+
+    pthread_mutex_lock(&table->mutex);
+    if (!interned->escaped.p) {
+        airbrake_string_t escaped = airbrake_string_null;
+
+        /* the escaped form never changes once computed, so it can be handed
+         * out without the lock for as long as the caller holds a reference */
+        err = airbrake_string_append_xml_escape(&escaped, &interned->value);
+        if (err) {
+            airbrake_string_fini(&escaped);
+            goto out;
         }
+        /* charged like a new entry; the caller's reference keeps this one off the LRU */
+        airbrake_intern_table_make_room(table, escaped.al);
+        if (table->bytes + escaped.al > table->max_bytes) {
+            airbrake_string_fini(&escaped);
+            err = AIRBRAKE_ERROR_MEM;
+            goto out;
+        }
+        interned->escaped = escaped;
+        table->bytes += escaped.al;
     }
-    string->p[o] = 0;
-    string->l = o;
-    return AIRBRAKE_OK;
+    *retval = airbrake_string_static(interned->escaped.p, interned->escaped.l);
+out:
+    pthread_mutex_unlock(&table->mutex);
+    return err;
 }
 
-static airbrake_error_t airbrake_client_build_notice_xml_notifier(const airbrake_client_info_t *info, airbrake_string_t *buf)
+void airbrake_interned_string_release(airbrake_interned_string_t *interned)
 {
-    airbrake_error_t err;
+    airbrake_intern_table_t *table = interned->table;
+    int last = 0;
 
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-          "<notifier>"
-            "<name>"));
-    if (err)
-        return err;
-    {
-        airbrake_string_t tmp = airbrake_string_static_z(info->name);
-        err = airbrake_string_append_xml_escape(buf, &tmp);
-        if (err)
-            return err;
+    pthread_mutex_lock(&table->mutex);
+    if (--interned->refcount == 0) {
+        table->referenced--;
+        airbrake_intern_table_lru_append(table, interned);
+        if (table->orphaned) {
+            airbrake_intern_table_evict(table, interned);
+            last = table->referenced == 0;
+        } else {
+            airbrake_intern_table_make_room(table, 0);
+        }
     }
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-            "</name>"
-            "<version>"));
+    pthread_mutex_unlock(&table->mutex);
+    if (last)
+        airbrake_intern_table_destroy(table);
+}
+
+airbrake_error_t airbrake_exception_init(airbrake_exception_t *exception, airbrake_string_t klass, airbrake_string_t message)
+{
+    airbrake_error_t err = AIRBRAKE_OK;
+    exception->backtrace = 0;
+    exception->klass.p = 0;
+    exception->message.p = 0;
+
+    err = airbrake_string_init_c(&exception->klass, &klass);
     if (err)
-        return err;
-    {
-        airbrake_string_t tmp = airbrake_string_static_z(info->version);
-        err = airbrake_string_append_xml_escape(buf, &tmp);
-        if (err)
-            return err;
-    }
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-            "</version>"
-            "<url>"));
+        goto fail;
+    err = airbrake_string_init_c(&exception->message, &message);
     if (err)
-        return err;
-    {
-        airbrake_string_t tmp = airbrake_string_static_z(info->url);
-        err = airbrake_string_append_xml_escape(buf, &tmp);
-        if (err)
-            return err;
-    }
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-            "</url>"
-          "</notifier>"));
+        goto fail;
+
+    return AIRBRAKE_OK;
+fail:
+    airbrake_string_fini(&exception->klass);
+    airbrake_string_fini(&exception->message);
     return err;
 }
 
-static airbrake_error_t airbrake_client_build_notice_xml_backtrace(const airbrake_backtrace_t *backtrace, airbrake_string_t *buf)
+airbrake_error_t airbrake_exception_reset(airbrake_exception_t *exception, airbrake_string_t klass, airbrake_string_t message)
 {
     airbrake_error_t err;
-    airbrake_backtrace_entry_t *i;
-
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-          "<backtrace>"));
+    if (exception->backtrace)
+        airbrake_backtrace_reset(exception->backtrace);
+    err = airbrake_string_assign(&exception->klass, klass);
     if (err)
         return err;
+    return airbrake_string_assign(&exception->message, message);
+}
 
-    for (i = backtrace->first; i; i = i->next) {
-        err = airbrake_string_append(buf, airbrake_string_static_z(
-              "<line method=\""));
-        if (err)
-            return err;
-        err = airbrake_string_append_xml_escape(buf, &i->method);
-        if (err)
-            return err;
-        err = airbrake_string_append(buf, airbrake_string_static_z(
-              "\" file=\""));
-        if (err)
-            return err;
-        err = airbrake_string_append_xml_escape(buf, &i->file);
-        if (err)
-            return err;
-        err = airbrake_string_append(buf, airbrake_string_static_z(
-              "\" number=\""));
-        if (err)
-            return err;
-        {
-            char tmp[128];
-            snprintf(tmp, sizeof(tmp), "%d", i->line);
-            err = airbrake_string_append(buf, airbrake_string_static_z(tmp));
-            if (err)
-                return err;
-        }
-        err = airbrake_string_append(buf, airbrake_string_static_z(
-              "\" />"));
-        if (err)
-            return err;
+void airbrake_exception_fini(airbrake_exception_t *exception)
+{
+    airbrake_string_fini(&exception->klass);
+    airbrake_string_fini(&exception->message);
+    if (exception->backtrace) {
+        airbrake_backtrace_fini(exception->backtrace);
+        airbrake_free(exception->backtrace);
+        exception->backtrace = 0;
     }
+}
 
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-          "</backtrace>"));
-    return err;
+airbrake_error_t airbrake_notice_init(airbrake_notice_t *notice)
+{
+    notice->exception = 0;
+    notice->request = 0;
+    notice->environment = 0;
+    return AIRBRAKE_OK;
 }
 
-static airbrake_error_t airbrake_client_build_notice_xml_error(const airbrake_exception_t *exception, airbrake_string_t *buf)
+void airbrake_notice_fini(airbrake_notice_t *notice)
+{
+}
+
+static airbrake_error_t airbrake_notice_slot_init(airbrake_notice_slot_t *slot)
 {
     airbrake_error_t err;
+    airbrake_backtrace_t *backtrace;
 
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-          "<error>"
-            "<class>"));
-    if (err)
+    slot->next = 0;
+    backtrace = airbrake_malloc(sizeof(airbrake_backtrace_t));
+    if (!backtrace)
+        return AIRBRAKE_ERROR_MEM;
+    airbrake_backtrace_init(backtrace);
+    err = airbrake_exception_init(&slot->exception, airbrake_string_null, airbrake_string_null);
+    if (err) {
+        airbrake_free(backtrace);
         return err;
-    err = airbrake_string_append_xml_escape(buf, &exception->klass);
-    if (err)
+    }
+    slot->exception.backtrace = backtrace;
+    err = airbrake_request_info_init(&slot->request, airbrake_string_null, airbrake_string_null, airbrake_string_null);
+    if (err) {
+        airbrake_exception_fini(&slot->exception);
         return err;
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-            "</class>"
-            "<message>"));
-    err = airbrake_string_append_xml_escape(buf, &exception->message);
-    if (err)
+    }
+    err = airbrake_environment_info_init(&slot->environment, airbrake_string_null, airbrake_string_null, airbrake_string_null);
+    if (err) {
+        airbrake_request_info_fini(&slot->request);
+        airbrake_exception_fini(&slot->exception);
         return err;
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-            "</message>"));
-    if (exception->backtrace) {
-        err = airbrake_client_build_notice_xml_backtrace(exception->backtrace, buf);
-        if (err)
-            return err;
     }
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-          "</error>"));
-    return err;
+    airbrake_notice_init(&slot->notice);
+    slot->notice.exception = &slot->exception;
+    slot->notice.request = &slot->request;
+    slot->notice.environment = &slot->environment;
+    return AIRBRAKE_OK;
 }
 
-static airbrake_error_t airbrake_client_build_notice_xml_params(const airbrake_string_table_t *table, const char *tagname, airbrake_string_t *buf)
+static void airbrake_notice_slot_fini(airbrake_notice_slot_t *slot)
 {
-    airbrake_error_t err;
+    airbrake_notice_fini(&slot->notice);
+    airbrake_exception_fini(&slot->exception);
+    airbrake_request_info_fini(&slot->request);
+    airbrake_environment_info_fini(&slot->environment);
+}
 
-    if (!table->first)
-        return AIRBRAKE_OK;
+static void airbrake_notice_slot_clear(airbrake_notice_slot_t *slot)
+{
+    airbrake_backtrace_reset(slot->exception.backtrace);
+    airbrake_string_clear(&slot->exception.klass);
+    airbrake_string_clear(&slot->exception.message);
+    airbrake_string_table_reset(&slot->request.params);
+    airbrake_string_table_reset(&slot->request.session);
+    airbrake_string_table_reset(&slot->request.cgi_data);
+    slot->request.params_provider.func = 0;
+    slot->request.session_provider.func = 0;
+    slot->request.cgi_data_provider.func = 0;
+    airbrake_string_clear(&slot->request.url);
+    airbrake_string_clear(&slot->request.component);
+    airbrake_string_clear(&slot->request.action);
+    airbrake_string_clear(&slot->environment.project_root);
+    airbrake_string_clear(&slot->environment.environment_name);
+    airbrake_string_clear(&slot->environment.app_version);
+    slot->notice.exception = &slot->exception;
+    slot->notice.request = &slot->request;
+    slot->notice.environment = &slot->environment;
+}
 
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-            "<"));
-    if (err)
-        return err;
-    err = airbrake_string_append(buf, airbrake_string_static_z(tagname));
-    if (err)
-        return err;
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-            ">"));
+airbrake_error_t airbrake_notice_result_init(airbrake_notice_result_t *notice_result, airbrake_string_t error_id, airbrake_string_t url, airbrake_string_t id)
+{
+    airbrake_error_t err;
+
+    err = airbrake_string_init_c(&notice_result->error_id, &error_id);
     if (err)
         return err;
-    {
-        airbrake_string_table_entry_t *i;
-        for (i = table->first; i; i = i->next) {
-            err = airbrake_string_append(buf, airbrake_string_static_z("<var key=\""));
-            if (err)
-                return err;
-            err = airbrake_string_append_xml_escape(buf, &i->key);
-            if (err)
-                return err;
-            err = airbrake_string_append(buf, airbrake_string_static_z("\">"));
-            if (err)
-                return err;
-            err = airbrake_string_append_xml_escape(buf, &i->value);
-            if (err)
-                return err;
-            err = airbrake_string_append(buf, airbrake_string_static_z("</var>"));
-            if (err)
-                return err;
-        }
-    }
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-            "</"));
+    err = airbrake_string_init_c(&notice_result->url, &url);
     if (err)
         return err;
-    err = airbrake_string_append(buf, airbrake_string_static_z(tagname));
+    err = airbrake_string_init_c(&notice_result->id, &id);
     if (err)
         return err;
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-            ">"));
-    return err;
-}
 
-static airbrake_error_t airbrake_client_build_notice_xml_request(const airbrake_request_info_t *request, airbrake_string_t *buf)
+    return AIRBRAKE_OK;
+fail:
+    airbrake_string_fini(&notice_result->error_id);
+    airbrake_string_fini(&notice_result->url);
+    airbrake_string_fini(&notice_result->id);
+    return err;
+}
+
+void airbrake_notice_result_fini(airbrake_notice_result_t *notice_result)
+{
+    airbrake_string_fini(&notice_result->error_id);
+    airbrake_string_fini(&notice_result->url);
+    airbrake_string_fini(&notice_result->id);
+}
+
+
+static void airbrake_client_buffer_init(airbrake_client_buffer_t *buffer)
+{
+    buffer->buf = airbrake_string_null;
+    buffer->window_peak = 0;
+    buffer->last_window_peak = 0;
+    buffer->window_uses = 0;
+}
+
+static void airbrake_client_buffer_fini(airbrake_client_buffer_t *buffer)
+{
+    airbrake_string_fini(&buffer->buf);
+    buffer->buf.l = 0;
+    buffer->buf.al = 0;
+}
+
+static airbrake_string_t *airbrake_client_buffer_acquire(airbrake_client_buffer_t *buffer)
+{
+    airbrake_string_clear(&buffer->buf);
+    return &buffer->buf;
+}
+
+/*
+ * Keeps the buffer for the next call, but never lets one oversized notice
+ * pin memory: anything beyond the limit is dropped immediately, and at the
+ * end of every window the capacity is cut back to what the last two
+ * windows actually needed.
+ */
+static void airbrake_client_buffer_release(airbrake_client_buffer_t *buffer, size_t limit)
+{
+    size_t needed;
+
+    if (buffer->buf.l + 1 > buffer->window_peak)
+        buffer->window_peak = buffer->buf.l + 1;
+
+    if (buffer->buf.al > limit) {
+        airbrake_client_buffer_fini(buffer);
+        return;
+    }
+
+    if (++buffer->window_uses < AIRBRAKE_CLIENT_BUFFER_WINDOW)
+        return;
+
+    needed = buffer->window_peak > buffer->last_window_peak ? buffer->window_peak: buffer->last_window_peak;
+    buffer->last_window_peak = buffer->window_peak;
+    buffer->window_peak = 0;
+    buffer->window_uses = 0;
+
+    if (buffer->buf.al > needed * 2) {
+        char *new_p;
+        size_t new_al = 1;
+        while (new_al < needed)
+            new_al <<= 1;
+        new_p = airbrake_realloc(buffer->buf.p, new_al);
+        if (new_p) {
+            buffer->buf.p = new_p;
+            buffer->buf.al = new_al;
+            buffer->buf.l = 0;
+            buffer->buf.p[0] = 0;
+        }
+    }
+}
+
+airbrake_error_t airbrake_client_opaque_init(airbrake_client_opaque_t **data)
+{
+    airbrake_error_t err;
+    airbrake_client_opaque_t *_data = malloc(sizeof(airbrake_client_opaque_t));
+    if (!_data)
+        return AIRBRAKE_ERROR_MEM;
+    _data->curl = curl_easy_init();
+    if (!_data->curl) {
+        free(_data);
+        return AIRBRAKE_ERROR_UNKNOWN;
+    }
+    /* the endpoint prober and pipeline workers run transfers on other threads */
+    curl_easy_setopt(_data->curl, CURLOPT_NOSIGNAL, 1L);
+    err = airbrake_intern_table_init(&_data->intern_table, AIRBRAKE_INTERN_TABLE_DEFAULT_MAX_BYTES);
+    if (err) {
+        curl_easy_cleanup(_data->curl);
+        free(_data);
+        return err;
+    }
+    if (pthread_mutex_init(&_data->notice_pool_mutex, 0)) {
+        airbrake_intern_table_fini(&_data->intern_table);
+        curl_easy_cleanup(_data->curl);
+        free(_data);
+        return AIRBRAKE_ERROR_UNKNOWN;
+    }
+    if (pthread_mutex_init(&_data->stats_mutex, 0)) {
+        pthread_mutex_destroy(&_data->notice_pool_mutex);
+        airbrake_intern_table_fini(&_data->intern_table);
+        curl_easy_cleanup(_data->curl);
+        free(_data);
+        return AIRBRAKE_ERROR_UNKNOWN;
+    }
+    {
+        pthread_condattr_t attr;
+        int failed = pthread_condattr_init(&attr);
+        if (!failed) {
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            failed = pthread_cond_init(&_data->prober_cond, &attr);
+            pthread_condattr_destroy(&attr);
+        }
+        if (!failed && pthread_mutex_init(&_data->endpoints_mutex, 0)) {
+            pthread_cond_destroy(&_data->prober_cond);
+            failed = 1;
+        }
+        if (failed) {
+            pthread_mutex_destroy(&_data->stats_mutex);
+            pthread_mutex_destroy(&_data->notice_pool_mutex);
+            airbrake_intern_table_fini(&_data->intern_table);
+            curl_easy_cleanup(_data->curl);
+            free(_data);
+            return AIRBRAKE_ERROR_UNKNOWN;
+        }
+    }
+    _data->endpoints_count = 0;
+    _data->submit_budget_ms = 0;
+    _data->probe_interval_ms = AIRBRAKE_ENDPOINT_PROBE_INTERVAL_MS;
+    _data->prober_running = 0;
+    _data->prober_stopping = 0;
+    _data->queued_bytes = 0;
+    _data->queue_limit = 0;
+    _data->queue_seq = 0;
+    _data->backpressure = AIRBRAKE_BACKPRESSURE_DROP_NEWEST;
+    _data->block_timeout_ms = 0;
+    _data->drop_func = 0;
+    _data->drop_ctx = 0;
+    _data->spill_path = airbrake_string_null;
+    _data->spill_fd = -1;
+    _data->watches = 0;
+    _data->watches_count = 0;
+    _data->watches_cap = 0;
+    _data->multi_timeout_at = -1;
+    _data->in_socket_action = 0;
+    _data->detach_pending = 0;
+    _data->notice_pool = 0;
+    _data->notice_pool_size = 0;
+    airbrake_client_buffer_init(&_data->request_buf);
+    airbrake_client_buffer_init(&_data->response_buf);
+    _data->buffer_limit = AIRBRAKE_CLIENT_BUFFER_DEFAULT_LIMIT;
+    _data->transport = AIRBRAKE_TRANSPORT_CURL;
+    _data->multi = 0;
+    _data->socket_func = 0;
+    _data->timer_func = 0;
+    _data->event_loop_ctx = 0;
+    _data->transfers = 0;
+    _data->idle_transfers = 0;
+    _data->transfers_in_flight = 0;
+    _data->idle_transfers_count = 0;
+    _data->fire_and_forget = 0;
+    memset(&_data->stats, 0, sizeof(_data->stats));
+    memset(&_data->batch, 0, sizeof(_data->batch));
+    _data->unix_fd = -1;
+    _data->unix_connecting = 0;
+    _data->unix_path = airbrake_string_null;
+    _data->unix_pending = airbrake_string_null;
+    *data = _data;
+    return AIRBRAKE_OK;
+}
+
+void airbrake_client_opaque_fini(airbrake_client_opaque_t **data)
+{
+    airbrake_notice_slot_t *i, *next;
+    size_t j;
+
+    airbrake_client_detach_event_loop_priv(*data);
+    airbrake_client_stop_prober(*data);
+    for (j = 0; j < (*data)->endpoints_count; j++)
+        airbrake_string_fini(&(*data)->endpoints[j].url);
+    pthread_cond_destroy(&(*data)->prober_cond);
+    pthread_mutex_destroy(&(*data)->endpoints_mutex);
+    airbrake_free((*data)->batch.entries);
+    curl_slist_free_all((*data)->batch.headers);
+    airbrake_string_fini(&(*data)->batch.endpoint);
+    airbrake_string_fini(&(*data)->batch.body);
+    airbrake_string_fini(&(*data)->batch.compressed);
+    if ((*data)->spill_fd >= 0)
+        close((*data)->spill_fd);
+    airbrake_string_fini(&(*data)->spill_path);
+    for (i = (*data)->notice_pool; i; i = next) {
+        next = i->next;
+        airbrake_notice_slot_fini(i);
+        airbrake_free(i);
+    }
+    pthread_mutex_destroy(&(*data)->notice_pool_mutex);
+    pthread_mutex_destroy(&(*data)->stats_mutex);
+    airbrake_client_buffer_fini(&(*data)->request_buf);
+    airbrake_client_buffer_fini(&(*data)->response_buf);
+    if ((*data)->unix_fd >= 0)
+        close((*data)->unix_fd);
+    airbrake_string_fini(&(*data)->unix_path);
+    airbrake_string_fini(&(*data)->unix_pending);
+    curl_easy_cleanup((*data)->curl);
+    airbrake_intern_table_fini(&(*data)->intern_table);
+    free(*data);
+    *data = 0;
+}
+
+airbrake_error_t airbrake_client_init(airbrake_client_t *client, const airbrake_client_info_t *info, airbrake_string_t notice_endpoint, airbrake_string_t api_key)
+{
+    airbrake_error_t err;
+    client->info = info ? info: &airbrake_default_client_info;
+    err = airbrake_client_opaque_init(&client->priv);
+    if (err)
+        return err;
+    err = airbrake_string_init_c(&client->notice_endpoint, &notice_endpoint);
+    if (err) {
+        airbrake_client_opaque_fini(&client->priv);
+        return err;
+    }
+    err = airbrake_string_init_c(&client->api_key, &api_key);
+    if (err) {
+        airbrake_string_fini(&client->notice_endpoint);
+        airbrake_client_opaque_fini(&client->priv);
+        return err;
+    }
+    if (notice_endpoint.l > 5 && memcmp(notice_endpoint.p, "unix:", 5) == 0) {
+        /* unix:///path/to/socket or unix:/path/to/socket */
+        const char *path = notice_endpoint.p + 5;
+        size_t path_len = notice_endpoint.l - 5;
+        if (path_len > 2 && path[0] == '/' && path[1] == '/') {
+            path += 2;
+            path_len -= 2;
+        }
+        client->priv->transport = AIRBRAKE_TRANSPORT_UNIX;
+        err = airbrake_string_init(&client->priv->unix_path, path, path_len);
+        if (err) {
+            airbrake_client_fini(client);
+            return err;
+        }
+    }
+    airbrake_endpoint_init(&client->priv->endpoints[0], airbrake_string_static(client->notice_endpoint.p, client->notice_endpoint.l));
+    client->priv->endpoints_count = 1;
+    return AIRBRAKE_OK;
+}
+
+static long airbrake_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/*
+ * Endpoint health.  Latency and error rate are exponentially weighted
+ * moving averages; an endpoint that fails AIRBRAKE_ENDPOINT_FAILURE_THRESHOLD
+ * times in a row is taken out of rotation until the prober thread sees it
+ * answer again.  All of this is guarded by endpoints_mutex because the
+ * prober runs concurrently with submits.
+ */
+#define AIRBRAKE_ENDPOINT_EWMA_WEIGHT 0.2
+
+static void airbrake_endpoint_init(airbrake_endpoint_t *endpoint, airbrake_string_t url)
+{
+    endpoint->url = url;
+    endpoint->requests = 0;
+    endpoint->failures = 0;
+    endpoint->consecutive_failures = 0;
+    endpoint->latency_ms = 0.;
+    endpoint->error_rate = 0.;
+    endpoint->healthy = 1;
+}
+
+/*
+ * Errors that say something about the endpoint rather than about the notice
+ * or the credentials.  Every 5xx maps to AIRBRAKE_ERROR_UNEXPECTED.
+ */
+static int airbrake_endpoint_failover_error(airbrake_error_t err)
+{
+    switch (err) {
+    case AIRBRAKE_ERROR_NETWORK_FAILURE:
+    case AIRBRAKE_ERROR_INVALID_RESPONSE:
+    case AIRBRAKE_ERROR_UNEXPECTED:
+    case AIRBRAKE_ERROR_THROTTLED:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static double airbrake_endpoint_score(const airbrake_endpoint_t *endpoint)
+{
+    return endpoint->latency_ms * (1. + 10. * endpoint->error_rate);
+}
+
+/* returns AIRBRAKE_ENDPOINT_MAX when every endpoint has been tried */
+static size_t airbrake_client_select_endpoint(airbrake_client_opaque_t *priv, unsigned int tried)
+{
+    size_t i, best = AIRBRAKE_ENDPOINT_MAX, fallback = AIRBRAKE_ENDPOINT_MAX;
+
+    if (priv->endpoints_count == 1)
+        return tried & 1 ? AIRBRAKE_ENDPOINT_MAX: 0;
+
+    pthread_mutex_lock(&priv->endpoints_mutex);
+    for (i = 0; i < priv->endpoints_count; i++) {
+        const airbrake_endpoint_t *endpoint = &priv->endpoints[i];
+        if (tried & (1U << i))
+            continue;
+        if (!endpoint->healthy) {
+            /* only used when nothing healthy is left */
+            if (fallback == AIRBRAKE_ENDPOINT_MAX || endpoint->error_rate < priv->endpoints[fallback].error_rate)
+                fallback = i;
+            continue;
+        }
+        if (best == AIRBRAKE_ENDPOINT_MAX || airbrake_endpoint_score(endpoint) < airbrake_endpoint_score(&priv->endpoints[best]))
+            best = i;
+    }
+    pthread_mutex_unlock(&priv->endpoints_mutex);
+    return best != AIRBRAKE_ENDPOINT_MAX ? best: fallback;
+}
+
+static void *airbrake_client_prober_main(void *arg);
+
+static void airbrake_client_record_endpoint(airbrake_client_opaque_t *priv, size_t index, airbrake_error_t err, CURL *curl)
+{
+    airbrake_endpoint_t *endpoint = &priv->endpoints[index];
+    double total_time = 0.;
+    int failed = airbrake_endpoint_failover_error(err);
+
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total_time);
+    pthread_mutex_lock(&priv->endpoints_mutex);
+    if (endpoint->requests == 0)
+        endpoint->latency_ms = total_time * 1000.;
+    else
+        endpoint->latency_ms += AIRBRAKE_ENDPOINT_EWMA_WEIGHT * (total_time * 1000. - endpoint->latency_ms);
+    endpoint->error_rate += AIRBRAKE_ENDPOINT_EWMA_WEIGHT * ((failed ? 1.: 0.) - endpoint->error_rate);
+    endpoint->requests++;
+    if (failed) {
+        endpoint->failures++;
+        endpoint->consecutive_failures++;
+        if (endpoint->consecutive_failures >= AIRBRAKE_ENDPOINT_FAILURE_THRESHOLD && priv->endpoints_count > 1) {
+            endpoint->healthy = 0;
+            if (!priv->prober_running && !pthread_create(&priv->prober_thread, 0, airbrake_client_prober_main, priv))
+                priv->prober_running = 1;
+        }
+    } else {
+        endpoint->consecutive_failures = 0;
+    }
+    pthread_mutex_unlock(&priv->endpoints_mutex);
+}
+
+/*
+ * Background health checks.  Any HTTP answer short of a server error is
+ * taken as a sign of life; the endpoint then has to earn its place back
+ * through the regular moving averages.
+ */
+static void *airbrake_client_prober_main(void *arg)
+{
+    airbrake_client_opaque_t *priv = arg;
+    CURL *curl = curl_easy_init();
+
+    pthread_mutex_lock(&priv->endpoints_mutex);
+    while (!priv->prober_stopping) {
+        struct timespec deadline;
+        size_t i;
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += priv->probe_interval_ms / 1000;
+        deadline.tv_nsec += (priv->probe_interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!priv->prober_stopping && pthread_cond_timedwait(&priv->prober_cond, &priv->endpoints_mutex, &deadline) != ETIMEDOUT);
+
+        for (i = 0; curl && !priv->prober_stopping && i < priv->endpoints_count; i++) {
+            /* the url storage is never moved once the endpoint has been added */
+            const char *url = priv->endpoints[i].url.p;
+            long http_status_code = 0;
+            CURLcode code;
+
+            if (priv->endpoints[i].healthy)
+                continue;
+            pthread_mutex_unlock(&priv->endpoints_mutex);
+            curl_easy_setopt(curl, CURLOPT_URL, url);
+            curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+            curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+            curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, priv->probe_interval_ms);
+            code = curl_easy_perform(curl);
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status_code);
+            pthread_mutex_lock(&priv->endpoints_mutex);
+            if (code == CURLE_OK && http_status_code > 0 && http_status_code < 500) {
+                priv->endpoints[i].healthy = 1;
+                priv->endpoints[i].consecutive_failures = 0;
+            }
+        }
+    }
+    pthread_mutex_unlock(&priv->endpoints_mutex);
+    if (curl)
+        curl_easy_cleanup(curl);
+    return 0;
+}
+
+static void airbrake_client_stop_prober(airbrake_client_opaque_t *priv)
+{
+    int running;
+
+    pthread_mutex_lock(&priv->endpoints_mutex);
+    priv->prober_stopping = 1;
+    running = priv->prober_running;
+    pthread_cond_signal(&priv->prober_cond);
+    pthread_mutex_unlock(&priv->endpoints_mutex);
+    if (running)
+        pthread_join(priv->prober_thread, 0);
+    priv->prober_running = 0;
+}
+
+airbrake_error_t airbrake_client_add_endpoint(airbrake_client_t *client, airbrake_string_t url)
+{
+    airbrake_error_t err;
+    airbrake_client_opaque_t *priv = client->priv;
+    airbrake_string_t copy;
+
+    if (priv->transport != AIRBRAKE_TRANSPORT_CURL || priv->endpoints_count == AIRBRAKE_ENDPOINT_MAX)
+        return AIRBRAKE_ERROR_UNKNOWN;
+    err = airbrake_string_init_c(&copy, &url);
+    if (err)
+        return err;
+    pthread_mutex_lock(&priv->endpoints_mutex);
+    airbrake_endpoint_init(&priv->endpoints[priv->endpoints_count], copy);
+    priv->endpoints_count++;
+    pthread_mutex_unlock(&priv->endpoints_mutex);
+    return AIRBRAKE_OK;
+}
+
+size_t airbrake_client_endpoint_count(airbrake_client_t *client)
+{
+    return client->priv->endpoints_count;
+}
+
+airbrake_error_t airbrake_client_get_endpoint_stats(airbrake_client_t *client, size_t index, airbrake_endpoint_stats_t *stats)
+{
+    airbrake_client_opaque_t *priv = client->priv;
+    const airbrake_endpoint_t *endpoint;
+
+    pthread_mutex_lock(&priv->endpoints_mutex);
+    if (index >= priv->endpoints_count) {
+        pthread_mutex_unlock(&priv->endpoints_mutex);
+        return AIRBRAKE_ERROR_UNKNOWN;
+    }
+    endpoint = &priv->endpoints[index];
+    stats->url = endpoint->url.p;
+    stats->requests = endpoint->requests;
+    stats->failures = endpoint->failures;
+    stats->latency_ms = endpoint->latency_ms;
+    stats->error_rate = endpoint->error_rate;
+    stats->healthy = endpoint->healthy;
+    pthread_mutex_unlock(&priv->endpoints_mutex);
+    return AIRBRAKE_OK;
+}
+
+void airbrake_client_set_submit_budget(airbrake_client_t *client, long budget_ms)
+{
+    client->priv->submit_budget_ms = budget_ms > 0 ? budget_ms: 0;
+}
+
+void airbrake_client_set_probe_interval(airbrake_client_t *client, long interval_ms)
+{
+    airbrake_client_opaque_t *priv = client->priv;
+    pthread_mutex_lock(&priv->endpoints_mutex);
+    priv->probe_interval_ms = interval_ms > 0 ? interval_ms: AIRBRAKE_ENDPOINT_PROBE_INTERVAL_MS;
+    pthread_mutex_unlock(&priv->endpoints_mutex);
+}
+
+/* whatever is left of the submit budget, 0 for no limit and -1 once it is used up */
+static long airbrake_client_remaining_budget(airbrake_client_opaque_t *priv, long started_ms)
+{
+    long remaining;
+
+    if (!priv->submit_budget_ms)
+        return 0;
+    remaining = priv->submit_budget_ms - (airbrake_now_ms() - started_ms);
+    return remaining > 0 ? remaining: -1;
+}
+
+static void airbrake_client_unix_disconnect(airbrake_client_opaque_t *priv)
+{
+    close(priv->unix_fd);
+    priv->unix_fd = -1;
+    priv->unix_connecting = 0;
+    priv->unix_pending.l = 0;
+}
+
+/*
+ * Connects without ever blocking the caller: an agent with a full accept
+ * backlog makes this return AIRBRAKE_ERROR_WOULD_BLOCK, and a connection
+ * that is still being set up is checked on again by the next call.
+ */
+static airbrake_error_t airbrake_client_unix_connect(airbrake_client_opaque_t *priv)
+{
+    struct sockaddr_un addr;
+    struct pollfd pfd;
+    int fd, so_error = 0;
+    socklen_t so_error_len = sizeof(so_error);
+
+    if (priv->unix_fd < 0) {
+        if (priv->unix_path.l >= sizeof(addr.sun_path))
+            return AIRBRAKE_ERROR_NETWORK_FAILURE;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, priv->unix_path.p, priv->unix_path.l);
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0)
+            return AIRBRAKE_ERROR_NETWORK_FAILURE;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+            if (errno != EINPROGRESS && errno != EINTR) {
+                airbrake_error_t err = errno == EAGAIN ? AIRBRAKE_ERROR_WOULD_BLOCK: AIRBRAKE_ERROR_NETWORK_FAILURE;
+                close(fd);
+                return err;
+            }
+            priv->unix_connecting = 1;
+        }
+        priv->unix_fd = fd;
+        priv->unix_pending.l = 0;
+    }
+    if (!priv->unix_connecting)
+        return AIRBRAKE_OK;
+
+    pfd.fd = priv->unix_fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) == 0)
+        return AIRBRAKE_ERROR_WOULD_BLOCK;
+    if (getsockopt(priv->unix_fd, SOL_SOCKET, SO_ERROR, &so_error, &so_error_len) || so_error) {
+        airbrake_client_unix_disconnect(priv);
+        return AIRBRAKE_ERROR_NETWORK_FAILURE;
+    }
+    priv->unix_connecting = 0;
+    return AIRBRAKE_OK;
+}
+
+/*
+ * Writes whatever is left of a previously interrupted frame.  Returns
+ * AIRBRAKE_ERROR_WOULD_BLOCK while the agent is not keeping up, in which
+ * case no new frame may be started or the stream would lose its framing.
+ */
+static airbrake_error_t airbrake_client_unix_flush(airbrake_client_opaque_t *priv)
+{
+    while (priv->unix_pending.l > 0) {
+        ssize_t n = send(priv->unix_fd, priv->unix_pending.p, priv->unix_pending.l, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return AIRBRAKE_ERROR_WOULD_BLOCK;
+            airbrake_client_unix_disconnect(priv);
+            return AIRBRAKE_ERROR_NETWORK_FAILURE;
+        }
+        memmove(priv->unix_pending.p, priv->unix_pending.p + n, priv->unix_pending.l - n);
+        priv->unix_pending.l -= n;
+    }
+    return AIRBRAKE_OK;
+}
+
+static airbrake_error_t airbrake_client_post_unix(airbrake_client_t *client, const airbrake_string_t *buf)
+{
+    airbrake_error_t err;
+    airbrake_client_opaque_t *priv = client->priv;
+    unsigned char header[4];
+    struct iovec iov[2];
+    struct msghdr msg;
+    size_t total = sizeof(header) + buf->l, written;
+    ssize_t n;
+
+    if (buf->l > 0xffffffffUL)
+        return AIRBRAKE_ERROR_UNKNOWN;
+
+    err = airbrake_client_unix_connect(priv);
+    if (err)
+        return err;
+    err = airbrake_client_unix_flush(priv);
+    if (err)
+        return err;
+
+    header[0] = (unsigned char)(buf->l >> 24);
+    header[1] = (unsigned char)(buf->l >> 16);
+    header[2] = (unsigned char)(buf->l >> 8);
+    header[3] = (unsigned char)buf->l;
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = buf->p;
+    iov[1].iov_len = buf->l;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    do {
+        n = sendmsg(priv->unix_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return AIRBRAKE_ERROR_WOULD_BLOCK;
+        airbrake_client_unix_disconnect(priv);
+        return AIRBRAKE_ERROR_NETWORK_FAILURE;
+    }
+
+    written = n;
+    if (written < total) {
+        /* the frame has been started; keep the rest so that it is
+         * completed before anything else is written */
+        priv->unix_pending.l = 0;
+        if (written < sizeof(header)) {
+            err = airbrake_string_append(&priv->unix_pending, airbrake_string_static((char *)header + written, sizeof(header) - written));
+            if (!err)
+                err = airbrake_string_append(&priv->unix_pending, *buf);
+        } else {
+            err = airbrake_string_append(&priv->unix_pending, airbrake_string_static(buf->p + (written - sizeof(header)), total - written));
+        }
+        if (err) {
+            airbrake_client_unix_disconnect(priv);
+            return err;
+        }
+    }
+    return AIRBRAKE_OK;
+}
+
+airbrake_error_t airbrake_string_append_xml_escape(airbrake_string_t *string, const airbrake_string_t *src)
+{
+    airbrake_error_t err;
+    size_t escaped_len = airbrake_string_xml_escaped_length(src);
+    const char *p = src->p, *e = src->p + src->l;
+    char *q;
+
+    err = airbrake_string_grow(string, string->l + escaped_len);
+    if (err)
+        return err;
+
+    q = string->p + string->l;
+    if (escaped_len == src->l) {
+        memcpy(q, p, src->l);
+        q += src->l;
+    } else {
+        for (; p < e; p++) {
+            switch (*p) {
+            case '<':
+                memcpy(q, "&lt;", 4);
+                q += 4;
+                break;
+            case '>':
+                memcpy(q, "&gt;", 4);
+                q += 4;
+                break;
+            case '&':
+                memcpy(q, "&amp;", 5);
+                q += 5;
+                break;
+            case '"':
+                memcpy(q, "&quot;", 6);
+                q += 6;
+                break;
+            default:
+                *q++ = *p;
+            }
+        }
+    }
+    *q = 0;
+    string->l = q - string->p;
+    string->xl = 0;
+    return AIRBRAKE_OK;
+}
+
+static airbrake_error_t airbrake_client_build_notice_xml_notifier(const airbrake_client_info_t *info, airbrake_string_t *buf)
+{
+    airbrake_error_t err;
+
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+          "<notifier>"
+            "<name>"));
+    if (err)
+        return err;
+    {
+        airbrake_string_t tmp = airbrake_string_static_z(info->name);
+        err = airbrake_string_append_xml_escape(buf, &tmp);
+        if (err)
+            return err;
+    }
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+            "</name>"
+            "<version>"));
+    if (err)
+        return err;
+    {
+        airbrake_string_t tmp = airbrake_string_static_z(info->version);
+        err = airbrake_string_append_xml_escape(buf, &tmp);
+        if (err)
+            return err;
+    }
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+            "</version>"
+            "<url>"));
+    if (err)
+        return err;
+    {
+        airbrake_string_t tmp = airbrake_string_static_z(info->url);
+        err = airbrake_string_append_xml_escape(buf, &tmp);
+        if (err)
+            return err;
+    }
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+            "</url>"
+          "</notifier>"));
+    return err;
+}
+
+static airbrake_error_t airbrake_client_build_notice_xml_backtrace_string(const airbrake_string_t *string, airbrake_interned_string_t *interned, airbrake_string_t *buf)
+{
+    if (interned) {
+        airbrake_string_t escaped;
+        if (airbrake_interned_string_escaped(interned, &escaped) == AIRBRAKE_OK)
+            return airbrake_string_append(buf, escaped);
+    }
+    return airbrake_string_append_xml_escape(buf, string);
+}
+
+static airbrake_error_t airbrake_client_build_notice_xml_line(const airbrake_string_t *method, airbrake_interned_string_t *interned_method, const airbrake_string_t *file, airbrake_interned_string_t *interned_file, int line, airbrake_string_t *buf)
+{
+    airbrake_error_t err;
+
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+          "<line method=\""));
+    if (err)
+        return err;
+    err = airbrake_client_build_notice_xml_backtrace_string(method, interned_method, buf);
+    if (err)
+        return err;
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+          "\" file=\""));
+    if (err)
+        return err;
+    err = airbrake_client_build_notice_xml_backtrace_string(file, interned_file, buf);
+    if (err)
+        return err;
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+          "\" number=\""));
+    if (err)
+        return err;
+    {
+        char tmp[128];
+        snprintf(tmp, sizeof(tmp), "%d", line);
+        err = airbrake_string_append(buf, airbrake_string_static_z(tmp));
+        if (err)
+            return err;
+    }
+    return airbrake_string_append(buf, airbrake_string_static_z(
+          "\" />"));
+}
+
+static airbrake_error_t airbrake_client_build_notice_xml_backtrace(const airbrake_backtrace_t *backtrace, airbrake_string_t *buf)
+{
+    airbrake_error_t err;
+    airbrake_backtrace_entry_t *i;
+
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+          "<backtrace>"));
+    if (err)
+        return err;
+
+    for (i = backtrace->first; i; i = i->next) {
+        err = airbrake_client_build_notice_xml_line(&i->method, i->interned_method, &i->file, i->interned_file, i->line, buf);
+        if (err)
+            return err;
+    }
+
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+          "</backtrace>"));
+    return err;
+}
+
+static airbrake_error_t airbrake_client_build_notice_xml_error_open(const airbrake_string_t *klass, const airbrake_string_t *message, airbrake_string_t *buf)
+{
+    airbrake_error_t err;
+
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+          "<error>"
+            "<class>"));
+    if (err)
+        return err;
+    err = airbrake_string_append_xml_escape(buf, klass);
+    if (err)
+        return err;
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+            "</class>"
+            "<message>"));
+    if (err)
+        return err;
+    err = airbrake_string_append_xml_escape(buf, message);
+    if (err)
+        return err;
+    return airbrake_string_append(buf, airbrake_string_static_z(
+            "</message>"));
+}
+
+static airbrake_error_t airbrake_client_build_notice_xml_error(const airbrake_exception_t *exception, airbrake_string_t *buf)
+{
+    airbrake_error_t err;
+
+    err = airbrake_client_build_notice_xml_error_open(&exception->klass, &exception->message, buf);
+    if (err)
+        return err;
+    if (exception->backtrace) {
+        err = airbrake_client_build_notice_xml_backtrace(exception->backtrace, buf);
+        if (err)
+            return err;
+    }
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+          "</error>"));
+    return err;
+}
+
+static airbrake_error_t airbrake_client_build_notice_xml_tag(const char *open, const char *tagname, airbrake_string_t *buf)
+{
+    airbrake_error_t err;
+
+    err = airbrake_string_append(buf, airbrake_string_static_z(open));
+    if (err)
+        return err;
+    err = airbrake_string_append(buf, airbrake_string_static_z(tagname));
+    if (err)
+        return err;
+    return airbrake_string_append(buf, airbrake_string_static_z(
+            ">"));
+}
+
+static airbrake_error_t airbrake_client_build_notice_xml_var(const airbrake_string_t *key, const airbrake_string_t *value, airbrake_string_t *buf)
+{
+    airbrake_error_t err;
+
+    err = airbrake_string_append(buf, airbrake_string_static_z("<var key=\""));
+    if (err)
+        return err;
+    err = airbrake_string_append_xml_escape(buf, key);
+    if (err)
+        return err;
+    err = airbrake_string_append(buf, airbrake_string_static_z("\">"));
+    if (err)
+        return err;
+    err = airbrake_string_append_xml_escape(buf, value);
+    if (err)
+        return err;
+    return airbrake_string_append(buf, airbrake_string_static_z("</var>"));
+}
+
+airbrake_error_t airbrake_var_writer_write(airbrake_var_writer_t *writer, airbrake_string_t key, airbrake_string_t value)
+{
+    airbrake_error_t err;
+
+    if (writer->table)
+        return airbrake_string_table_add(writer->table, key, value);
+    /* the section is opened on the first variable so that empty providers leave no trace */
+    if (!writer->opened) {
+        err = airbrake_client_build_notice_xml_tag("<", writer->tagname, writer->buf);
+        if (err)
+            return err;
+        writer->opened = 1;
+    }
+    return airbrake_client_build_notice_xml_var(&key, &value, writer->buf);
+}
+
+static airbrake_error_t airbrake_client_build_notice_xml_params(const airbrake_string_table_t *table, const airbrake_provider_t *provider, const char *tagname, airbrake_string_t *buf)
+{
+    airbrake_error_t err;
+    airbrake_var_writer_t writer = { buf, tagname, 0, 0 };
+
+    if (!table->first && !provider->func)
+        return AIRBRAKE_OK;
+
+    {
+        airbrake_string_table_entry_t *i;
+        for (i = table->first; i; i = i->next) {
+            err = airbrake_var_writer_write(&writer, i->key, i->value);
+            if (err)
+                return err;
+        }
+    }
+    if (provider->func) {
+        err = provider->func(provider->ctx, &writer);
+        if (err)
+            return err;
+    }
+    if (!writer.opened)
+        return AIRBRAKE_OK;
+    return airbrake_client_build_notice_xml_tag("</", tagname, buf);
+}
+
+static airbrake_error_t airbrake_client_build_notice_xml_request_open(const airbrake_string_t *url, const airbrake_string_t *component, const airbrake_string_t *action, airbrake_string_t *buf)
+{
+    airbrake_error_t err;
+
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+          "<request>"
+            "<url>"));
+    if (err)
+        return err;
+    err = airbrake_string_append_xml_escape(buf, url);
+    if (err)
+        return err;
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+            "</url>"
+            "<component>"));
+    if (err)
+        return err;
+    err = airbrake_string_append_xml_escape(buf, component);
+    if (err)
+        return err;
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+            "</component>"));
+    if (err)
+        return err;
+
+    if (action->l) {
+        err = airbrake_string_append(buf, airbrake_string_static_z(
+                "<action>"));
+        if (err)
+            return err;
+        err = airbrake_string_append_xml_escape(buf, action);
+        if (err)
+            return err;
+        err = airbrake_string_append(buf, airbrake_string_static_z(
+                "</action>"));
+        if (err)
+            return err;
+    }
+    return AIRBRAKE_OK;
+}
+
+static airbrake_error_t airbrake_client_build_notice_xml_request(const airbrake_request_info_t *request, airbrake_string_t *buf)
+{
+    airbrake_error_t err;
+
+    err = airbrake_client_build_notice_xml_request_open(&request->url, &request->component, &request->action, buf);
+    if (err)
+        return err;
+
+    err = airbrake_client_build_notice_xml_params(&request->params, &request->params_provider, "params", buf);
+    if (err)
+        return err;
+
+    err = airbrake_client_build_notice_xml_params(&request->session, &request->session_provider, "session", buf);
+    if (err)
+        return err;
+
+    err = airbrake_client_build_notice_xml_params(&request->cgi_data, &request->cgi_data_provider, "cgi-data", buf);
+    if (err)
+        return err;
+
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+          "</request>"));
+    return err;
+}
+
+static airbrake_error_t airbrake_client_build_notice_xml_server_environment(const airbrake_string_t *project_root, const airbrake_string_t *environment_name, const airbrake_string_t *app_version, airbrake_string_t *buf)
+{
+    airbrake_error_t err;
+
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+          "<server-environment>"));
+    if (err)
+        return err;
+    if (project_root->l) {
+        err = airbrake_string_append(buf, airbrake_string_static_z(
+                "<project-root>"));
+        if (err)
+            return err;
+        err = airbrake_string_append_xml_escape(buf, project_root);
+        if (err)
+            return err;
+        err = airbrake_string_append(buf, airbrake_string_static_z(
+                "</project-root>"));
+        if (err)
+            return err;
+    }
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+        "<environment-name>"));
+    if (err)
+        return err;
+    err = airbrake_string_append_xml_escape(buf, environment_name);
+    if (err)
+        return err;
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+            "</environment-name>"));
+    if (err)
+        return err;
+
+    if (app_version->l) {
+        err = airbrake_string_append(buf, airbrake_string_static_z(
+                "<app-version>"));
+        if (err)
+            return err;
+        err = airbrake_string_append_xml_escape(buf, app_version);
+        if (err)
+            return err;
+        err = airbrake_string_append(buf, airbrake_string_static_z(
+                "</app-version>"));
+        if (err)
+            return err;
+    }
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+          "</server-environment>"));
+    return err;
+}
+
+static airbrake_error_t airbrake_client_build_notice_xml_head(airbrake_client_t *client, airbrake_string_t *buf, int with_declaration)
+{
+    airbrake_error_t err;
+    if (with_declaration) {
+        err = airbrake_string_append(buf, airbrake_string_static_z(
+            "<?xml version=\"1.0\" ?>"));
+        if (err)
+            return err;
+    }
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+        "<notice version=\"2.0\">"
+          "<api-key>"));
+    if (err)
+        return err;
+    err = airbrake_string_append_xml_escape(buf, &client->api_key);
+    if (err)
+        return err;
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+          "</api-key>"));
+    if (err)
+        return err;
+    return airbrake_client_build_notice_xml_notifier(client->info, buf);
+}
+
+static airbrake_error_t airbrake_client_build_notice_xml_element(airbrake_client_t *client, airbrake_string_t *buf, const airbrake_notice_t *notice, int with_declaration)
+{
+    airbrake_error_t err;
+#ifdef AIRBRAKE_USDT
+    size_t start = buf->l;
+#endif
+
+    AIRBRAKE_PROBE1(build__start, notice);
+    err = airbrake_client_build_notice_xml_head(client, buf, with_declaration);
+    if (err)
+        goto out;
+
+    err = airbrake_client_build_notice_xml_error(notice->exception, buf);
+    if (err)
+        goto out;
+
+    if (notice->request) {
+        err = airbrake_client_build_notice_xml_request(notice->request, buf);
+        if (err)
+            goto out;
+    }
+
+    err = airbrake_client_build_notice_xml_server_environment(&notice->environment->project_root, &notice->environment->environment_name, &notice->environment->app_version, buf);
+    if (err)
+        goto out;
+
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+        "</notice>"));
+out:
+    AIRBRAKE_PROBE3(build__done, notice, buf->l - start, err);
+    return err;
+}
+
+airbrake_error_t airbrake_client_build_notice_xml(airbrake_client_t *client, airbrake_string_t *buf, const airbrake_notice_t *notice)
+{
+    return airbrake_client_build_notice_xml_element(client, buf, notice, 1);
+}
+
+static size_t airbrake_notice_encoded_string_size(const airbrake_string_t *string)
+{
+    return 4 + (string->p ? string->l + 1: 0);
+}
+
+static size_t airbrake_notice_encoded_table_size(const airbrake_string_table_t *table)
+{
+    size_t retval = 4;
+    airbrake_string_table_entry_t *i;
+    for (i = table->first; i; i = i->next)
+        retval += airbrake_notice_encoded_string_size(&i->key) + airbrake_notice_encoded_string_size(&i->value);
+    return retval;
+}
+
+size_t airbrake_notice_encoded_size(const airbrake_notice_t *notice)
+{
+    size_t retval = AIRBRAKE_NOTICE_RECORD_HEADER_SIZE;
+
+    if (notice->exception) {
+        const airbrake_exception_t *exception = notice->exception;
+        retval += airbrake_notice_encoded_string_size(&exception->klass);
+        retval += airbrake_notice_encoded_string_size(&exception->message);
+        if (exception->backtrace) {
+            airbrake_backtrace_entry_t *i;
+            retval += 4;
+            for (i = exception->backtrace->first; i; i = i->next)
+                retval += airbrake_notice_encoded_string_size(&i->method) + airbrake_notice_encoded_string_size(&i->file) + 4;
+        }
+    }
+    if (notice->request) {
+        const airbrake_request_info_t *request = notice->request;
+        retval += airbrake_notice_encoded_string_size(&request->url);
+        retval += airbrake_notice_encoded_string_size(&request->component);
+        retval += airbrake_notice_encoded_string_size(&request->action);
+        retval += airbrake_notice_encoded_table_size(&request->params);
+        retval += airbrake_notice_encoded_table_size(&request->session);
+        retval += airbrake_notice_encoded_table_size(&request->cgi_data);
+    }
+    if (notice->environment) {
+        const airbrake_environment_info_t *environment = notice->environment;
+        retval += airbrake_notice_encoded_string_size(&environment->project_root);
+        retval += airbrake_notice_encoded_string_size(&environment->environment_name);
+        retval += airbrake_notice_encoded_string_size(&environment->app_version);
+    }
+    return retval;
+}
+
+static char *airbrake_notice_encode_u32(char *p, unsigned long v)
+{
+    p[0] = (char)(v >> 24);
+    p[1] = (char)(v >> 16);
+    p[2] = (char)(v >> 8);
+    p[3] = (char)v;
+    return p + 4;
+}
+
+static unsigned long airbrake_notice_decode_u32(const char *p)
+{
+    const unsigned char *q = (const unsigned char *)p;
+    return ((unsigned long)q[0] << 24) | ((unsigned long)q[1] << 16) | ((unsigned long)q[2] << 8) | q[3];
+}
+
+static char *airbrake_notice_encode_string(char *p, const airbrake_string_t *string)
+{
+    if (!string->p)
+        return airbrake_notice_encode_u32(p, AIRBRAKE_NOTICE_RECORD_NULL);
+    p = airbrake_notice_encode_u32(p, string->l);
+    memcpy(p, string->p, string->l);
+    p[string->l] = 0;
+    return p + string->l + 1;
+}
+
+/* provided holds what the section's provider wrote, stored as a continuation of the table */
+static char *airbrake_notice_encode_table(char *p, const airbrake_string_table_t *table, const airbrake_string_table_t *provided)
+{
+    airbrake_string_table_entry_t *i;
+    unsigned long n = 0;
+    char *np = p;
+    p += 4;
+    for (i = table->first; i; i = i->next, n++) {
+        p = airbrake_notice_encode_string(p, &i->key);
+        p = airbrake_notice_encode_string(p, &i->value);
+    }
+    for (i = provided->first; i; i = i->next, n++) {
+        p = airbrake_notice_encode_string(p, &i->key);
+        p = airbrake_notice_encode_string(p, &i->value);
+    }
+    airbrake_notice_encode_u32(np, n);
+    return p;
+}
+
+/*
+ * A record has to be sized before it is written, so provider output is
+ * collected into scratch tables first.  Their count fields are not part of
+ * the record and are subtracted again.
+ */
+static airbrake_error_t airbrake_notice_run_providers(const airbrake_request_info_t *request, airbrake_string_table_t *provided, size_t *size)
+{
+    airbrake_error_t err;
+    const airbrake_provider_t *providers[3];
+    size_t i;
+
+    providers[0] = &request->params_provider;
+    providers[1] = &request->session_provider;
+    providers[2] = &request->cgi_data_provider;
+    for (i = 0; i < 3; i++) {
+        airbrake_var_writer_t writer = { 0, 0, 0, &provided[i] };
+        if (!providers[i]->func)
+            continue;
+        err = providers[i]->func(providers[i]->ctx, &writer);
+        if (err)
+            return err;
+        *size += airbrake_notice_encoded_table_size(&provided[i]) - 4;
+    }
+    return AIRBRAKE_OK;
+}
+
+airbrake_error_t airbrake_notice_encode(airbrake_string_t *buf, const airbrake_notice_t *notice)
+{
+    airbrake_error_t err;
+    size_t size = airbrake_notice_encoded_size(notice);
+    unsigned int flags = 0;
+    airbrake_string_table_t provided[3];
+    char *p;
+
+    airbrake_string_table_init(&provided[0]);
+    airbrake_string_table_init(&provided[1]);
+    airbrake_string_table_init(&provided[2]);
+    if (notice->request) {
+        err = airbrake_notice_run_providers(notice->request, provided, &size);
+        if (err)
+            goto out;
+    }
+
+    err = AIRBRAKE_ERROR_UNKNOWN;
+    if (size > 0xfffffffeUL)
+        goto out;
+    err = airbrake_string_grow(buf, buf->l + size);
+    if (err)
+        goto out;
+
+    if (notice->exception) {
+        flags |= AIRBRAKE_NOTICE_RECORD_EXCEPTION;
+        if (notice->exception->backtrace)
+            flags |= AIRBRAKE_NOTICE_RECORD_BACKTRACE;
+    }
+    if (notice->request)
+        flags |= AIRBRAKE_NOTICE_RECORD_REQUEST;
+    if (notice->environment)
+        flags |= AIRBRAKE_NOTICE_RECORD_ENVIRONMENT;
+
+    p = buf->p + buf->l;
+    memcpy(p, "ABN", 3);
+    p[3] = AIRBRAKE_NOTICE_RECORD_VERSION;
+    p = airbrake_notice_encode_u32(p + 4, size);
+    *p++ = (char)flags;
+
+    if (notice->exception) {
+        const airbrake_exception_t *exception = notice->exception;
+        p = airbrake_notice_encode_string(p, &exception->klass);
+        p = airbrake_notice_encode_string(p, &exception->message);
+        if (exception->backtrace) {
+            airbrake_backtrace_entry_t *i;
+            unsigned long n = 0;
+            char *np = p;
+            p += 4;
+            for (i = exception->backtrace->first; i; i = i->next, n++) {
+                p = airbrake_notice_encode_string(p, &i->method);
+                p = airbrake_notice_encode_string(p, &i->file);
+                p = airbrake_notice_encode_u32(p, (unsigned long)(unsigned int)i->line);
+            }
+            airbrake_notice_encode_u32(np, n);
+        }
+    }
+    if (notice->request) {
+        const airbrake_request_info_t *request = notice->request;
+        p = airbrake_notice_encode_string(p, &request->url);
+        p = airbrake_notice_encode_string(p, &request->component);
+        p = airbrake_notice_encode_string(p, &request->action);
+        p = airbrake_notice_encode_table(p, &request->params, &provided[0]);
+        p = airbrake_notice_encode_table(p, &request->session, &provided[1]);
+        p = airbrake_notice_encode_table(p, &request->cgi_data, &provided[2]);
+    }
+    if (notice->environment) {
+        const airbrake_environment_info_t *environment = notice->environment;
+        p = airbrake_notice_encode_string(p, &environment->project_root);
+        p = airbrake_notice_encode_string(p, &environment->environment_name);
+        p = airbrake_notice_encode_string(p, &environment->app_version);
+    }
+
+    buf->l += size;
+    buf->p[buf->l] = 0;
+out:
+    airbrake_string_table_fini(&provided[0]);
+    airbrake_string_table_fini(&provided[1]);
+    airbrake_string_table_fini(&provided[2]);
+    return err;
+}
+
+/*
+ * Decoding never copies: strings are handed out as views into the record,
+ * which is why each one is stored with its terminating NUL.
+ */
+static const char *airbrake_notice_decode_string(const char *p, const char *e, airbrake_string_t *retval)
+{
+    unsigned long l;
+    if (e - p < 4)
+        return 0;
+    l = airbrake_notice_decode_u32(p);
+    p += 4;
+    if (l == AIRBRAKE_NOTICE_RECORD_NULL) {
+        *retval = airbrake_string_null;
+        return p;
+    }
+    if ((unsigned long)(e - p) <= l || p[l] != 0)
+        return 0;
+    *retval = airbrake_string_static(p, l);
+    return p + l + 1;
+}
+
+static const char *airbrake_notice_decode_table(const char *p, const char *e, airbrake_notice_record_cursor_t *retval)
+{
+    unsigned long n, i;
+    airbrake_string_t tmp;
+    if (e - p < 4)
+        return 0;
+    n = airbrake_notice_decode_u32(p);
+    p += 4;
+    retval->p = p;
+    retval->n = n;
+    for (i = 0; i < n && p; i++) {
+        p = airbrake_notice_decode_string(p, e, &tmp);
+        if (p)
+            p = airbrake_notice_decode_string(p, e, &tmp);
+    }
+    return p;
+}
+
+void airbrake_notice_reader_init(airbrake_notice_reader_t *reader, const void *p, size_t l)
+{
+    reader->p = p;
+    reader->e = reader->p + l;
+}
+
+int airbrake_notice_reader_has_next(const airbrake_notice_reader_t *reader)
+{
+    return reader->p < reader->e;
+}
+
+airbrake_error_t airbrake_notice_reader_next(airbrake_notice_reader_t *reader, airbrake_notice_record_t *record)
+{
+    const char *p = reader->p, *e;
+    unsigned long size;
+    airbrake_notice_record_cursor_t empty = { 0, 0 };
+
+    if (reader->e - p < AIRBRAKE_NOTICE_RECORD_HEADER_SIZE || memcmp(p, "ABN", 3) != 0 || p[3] != AIRBRAKE_NOTICE_RECORD_VERSION)
+        return AIRBRAKE_ERROR_INVALID_RECORD;
+    size = airbrake_notice_decode_u32(p + 4);
+    if (size < AIRBRAKE_NOTICE_RECORD_HEADER_SIZE || size > (unsigned long)(reader->e - p))
+        return AIRBRAKE_ERROR_INVALID_RECORD;
+    e = p + size;
+
+    record->p = p;
+    record->l = size;
+    record->flags = (unsigned char)p[8];
+    p += AIRBRAKE_NOTICE_RECORD_HEADER_SIZE;
+
+    record->klass = record->message = airbrake_string_null;
+    record->backtrace = empty;
+    record->url = record->component = record->action = airbrake_string_null;
+    record->params = record->session = record->cgi_data = empty;
+    record->project_root = record->environment_name = record->app_version = airbrake_string_null;
+
+    if (record->flags & AIRBRAKE_NOTICE_RECORD_EXCEPTION) {
+        if (!(p = airbrake_notice_decode_string(p, e, &record->klass)))
+            return AIRBRAKE_ERROR_INVALID_RECORD;
+        if (!(p = airbrake_notice_decode_string(p, e, &record->message)))
+            return AIRBRAKE_ERROR_INVALID_RECORD;
+        if (record->flags & AIRBRAKE_NOTICE_RECORD_BACKTRACE) {
+            unsigned long i;
+            airbrake_string_t tmp;
+            if (e - p < 4)
+                return AIRBRAKE_ERROR_INVALID_RECORD;
+            record->backtrace.n = airbrake_notice_decode_u32(p);
+            record->backtrace.p = p += 4;
+            for (i = 0; i < record->backtrace.n; i++) {
+                if (!(p = airbrake_notice_decode_string(p, e, &tmp)))
+                    return AIRBRAKE_ERROR_INVALID_RECORD;
+                if (!(p = airbrake_notice_decode_string(p, e, &tmp)))
+                    return AIRBRAKE_ERROR_INVALID_RECORD;
+                if (e - p < 4)
+                    return AIRBRAKE_ERROR_INVALID_RECORD;
+                p += 4;
+            }
+        }
+    }
+    if (record->flags & AIRBRAKE_NOTICE_RECORD_REQUEST) {
+        if (!(p = airbrake_notice_decode_string(p, e, &record->url)))
+            return AIRBRAKE_ERROR_INVALID_RECORD;
+        if (!(p = airbrake_notice_decode_string(p, e, &record->component)))
+            return AIRBRAKE_ERROR_INVALID_RECORD;
+        if (!(p = airbrake_notice_decode_string(p, e, &record->action)))
+            return AIRBRAKE_ERROR_INVALID_RECORD;
+        if (!(p = airbrake_notice_decode_table(p, e, &record->params)))
+            return AIRBRAKE_ERROR_INVALID_RECORD;
+        if (!(p = airbrake_notice_decode_table(p, e, &record->session)))
+            return AIRBRAKE_ERROR_INVALID_RECORD;
+        if (!(p = airbrake_notice_decode_table(p, e, &record->cgi_data)))
+            return AIRBRAKE_ERROR_INVALID_RECORD;
+    }
+    if (record->flags & AIRBRAKE_NOTICE_RECORD_ENVIRONMENT) {
+        if (!(p = airbrake_notice_decode_string(p, e, &record->project_root)))
+            return AIRBRAKE_ERROR_INVALID_RECORD;
+        if (!(p = airbrake_notice_decode_string(p, e, &record->environment_name)))
+            return AIRBRAKE_ERROR_INVALID_RECORD;
+        if (!(p = airbrake_notice_decode_string(p, e, &record->app_version)))
+            return AIRBRAKE_ERROR_INVALID_RECORD;
+    }
+    if (p != e)
+        return AIRBRAKE_ERROR_INVALID_RECORD;
+
+    reader->p = e;
+    return AIRBRAKE_OK;
+}
+
+/* cursors are only handed out for records that airbrake_notice_reader_next() validated */
+static const char *airbrake_notice_decode_string_unchecked(const char *p, airbrake_string_t *retval)
+{
+    unsigned long l = airbrake_notice_decode_u32(p);
+    p += 4;
+    if (l == AIRBRAKE_NOTICE_RECORD_NULL) {
+        *retval = airbrake_string_null;
+        return p;
+    }
+    *retval = airbrake_string_static(p, l);
+    return p + l + 1;
+}
+
+int airbrake_notice_record_next_frame(airbrake_notice_record_cursor_t *cursor, airbrake_string_t *method, airbrake_string_t *file, int *line)
+{
+    if (cursor->n == 0)
+        return 0;
+    cursor->p = airbrake_notice_decode_string_unchecked(cursor->p, method);
+    cursor->p = airbrake_notice_decode_string_unchecked(cursor->p, file);
+    *line = (int)(unsigned int)airbrake_notice_decode_u32(cursor->p);
+    cursor->p += 4;
+    cursor->n--;
+    return 1;
+}
+
+int airbrake_notice_record_next_var(airbrake_notice_record_cursor_t *cursor, airbrake_string_t *key, airbrake_string_t *value)
+{
+    if (cursor->n == 0)
+        return 0;
+    cursor->p = airbrake_notice_decode_string_unchecked(cursor->p, key);
+    cursor->p = airbrake_notice_decode_string_unchecked(cursor->p, value);
+    cursor->n--;
+    return 1;
+}
+
+static airbrake_error_t airbrake_client_build_notice_xml_record_params(airbrake_notice_record_cursor_t cursor, const char *tagname, airbrake_string_t *buf)
+{
+    airbrake_error_t err;
+    airbrake_string_t key, value;
+
+    if (cursor.n == 0)
+        return AIRBRAKE_OK;
+
+    err = airbrake_client_build_notice_xml_tag("<", tagname, buf);
+    if (err)
+        return err;
+    while (airbrake_notice_record_next_var(&cursor, &key, &value)) {
+        err = airbrake_client_build_notice_xml_var(&key, &value, buf);
+        if (err)
+            return err;
+    }
+    return airbrake_client_build_notice_xml_tag("</", tagname, buf);
+}
+
+airbrake_error_t airbrake_client_build_notice_xml_record(airbrake_client_t *client, airbrake_string_t *buf, const airbrake_notice_record_t *record)
+{
+    airbrake_error_t err;
+#ifdef AIRBRAKE_USDT
+    size_t start = buf->l;
+#endif
+
+    AIRBRAKE_PROBE1(build__start, record);
+    err = airbrake_client_build_notice_xml_head(client, buf, 1);
+    if (err)
+        goto out;
+
+    err = airbrake_client_build_notice_xml_error_open(&record->klass, &record->message, buf);
+    if (err)
+        goto out;
+    if (record->flags & AIRBRAKE_NOTICE_RECORD_BACKTRACE) {
+        airbrake_notice_record_cursor_t cursor = record->backtrace;
+        airbrake_string_t method, file;
+        int line;
+
+        err = airbrake_string_append(buf, airbrake_string_static_z(
+              "<backtrace>"));
+        if (err)
+            goto out;
+        while (airbrake_notice_record_next_frame(&cursor, &method, &file, &line)) {
+            err = airbrake_client_build_notice_xml_line(&method, 0, &file, 0, line, buf);
+            if (err)
+                goto out;
+        }
+        err = airbrake_string_append(buf, airbrake_string_static_z(
+              "</backtrace>"));
+        if (err)
+            goto out;
+    }
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+          "</error>"));
+    if (err)
+        goto out;
+
+    if (record->flags & AIRBRAKE_NOTICE_RECORD_REQUEST) {
+        err = airbrake_client_build_notice_xml_request_open(&record->url, &record->component, &record->action, buf);
+        if (err)
+            goto out;
+        err = airbrake_client_build_notice_xml_record_params(record->params, "params", buf);
+        if (err)
+            goto out;
+        err = airbrake_client_build_notice_xml_record_params(record->session, "session", buf);
+        if (err)
+            goto out;
+        err = airbrake_client_build_notice_xml_record_params(record->cgi_data, "cgi-data", buf);
+        if (err)
+            goto out;
+        err = airbrake_string_append(buf, airbrake_string_static_z(
+              "</request>"));
+        if (err)
+            goto out;
+    }
+
+    err = airbrake_client_build_notice_xml_server_environment(&record->project_root, &record->environment_name, &record->app_version, buf);
+    if (err)
+        goto out;
+
+    err = airbrake_string_append(buf, airbrake_string_static_z(
+        "</notice>"));
+out:
+    AIRBRAKE_PROBE3(build__done, record, buf->l - start, err);
+    return err;
+}
+
+static void airbrake_client_setup_transfer(airbrake_client_t *client, CURL *curl, const char *url, const airbrake_string_t *buf, airbrake_curl_writer_t *writer)
+{
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, buf->p);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, buf->l);
+    curl_easy_setopt(curl, CURLOPT_POST, 1);
+    if (client->priv->fire_and_forget) {
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, airbrake_curl_discard_func);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)0);
+    } else {
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, airbrake_curl_writer_func);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, writer);
+    }
+}
+
+#ifdef AIRBRAKE_USDT
+/* only looked up for the probes; 0 when no response came back */
+static long airbrake_probe_http_status(CURL *curl)
+{
+    long http_status_code = 0;
+
+    if (curl)
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status_code);
+    return http_status_code;
+}
+#endif
+
+/* the one mapping from HTTP status to outcome, whether or not the body is read */
+static airbrake_error_t airbrake_client_status_error(long http_status_code)
+{
+    if (http_status_code >= 200 && http_status_code < 300)
+        return AIRBRAKE_OK;
+    switch (http_status_code) {
+    case 403:
+        return AIRBRAKE_ERROR_SSL_NOT_SUPPORTED;
+    case 422:
+        return AIRBRAKE_ERROR_API_KEY_INVALID;
+    case 429:
+        return AIRBRAKE_ERROR_THROTTLED;
+    }
+    return AIRBRAKE_ERROR_UNEXPECTED;
+}
+
+/* fire-and-forget counterpart of airbrake_client_handle_response(); the body is never looked at */
+static airbrake_error_t airbrake_client_handle_status(CURL *curl)
+{
+    long http_status_code = 0;
+
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status_code);
+    return airbrake_client_status_error(http_status_code);
+}
+
+static void airbrake_client_count(airbrake_client_opaque_t *priv, airbrake_error_t err)
+{
+    pthread_mutex_lock(&priv->stats_mutex);
+    priv->stats.submitted++;
+    if (err)
+        priv->stats.failed++;
+    else
+        priv->stats.succeeded++;
+    pthread_mutex_unlock(&priv->stats_mutex);
+}
+
+/* checks the content type and parses the response body; on success the caller owns *parser and *doc */
+static airbrake_error_t airbrake_client_parse_response(CURL *curl, const airbrake_string_t *out_buf, long *http_status_code, xmlParserCtxtPtr *parser, xmlDocPtr *doc)
+{
+    airbrake_error_t err = AIRBRAKE_OK;
+    const char *content_type_header_value;
+    airbrake_string_t content_type = { 0, 0, 0, 0, 0, 0 };
+    airbrake_string_t charset = { 0, 0, 0, 0, 0, 0 };
+
+    AIRBRAKE_PROBE2(parse__start, curl, out_buf->l);
+    *parser = 0;
+    *doc = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, http_status_code);
+    curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &content_type_header_value);
+    if (content_type_header_value) {
+        do {
+            const char *p = content_type_header_value, *q;
+            size_t l;
+
+            while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+            if (!*p)
+                break;
+            content_type.p = (char *)p;
+
+            while (*p && *p != ';' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') p++;
+            content_type.l = p - content_type.p;
+
+            while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+            if (*p != ';')
+                break;
+            p++;
+            while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+            if (!*p)
+                break;
+
+            l = strlen(p);
+            if (l <= 8 || memcmp(p, "charset", 7) != 0)
+                break;
+            p += 7;
+            while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+            if (*p != '=')
+                break;
+            p++;
+            while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+            if (*p)
+                break;
+            q = p;
+            while (*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') p++;
+            l = p - charset.p;
+            err = airbrake_string_init(&charset, q, l);
+            if (err)
+                goto out;
+        } while (0);
+    }
+
+    if (!(content_type.l == 8 && memcmp("text/xml", content_type.p, 8) == 0) &&
+        !(content_type.l == 9 && memcmp("application/xml", content_type.p, 15) == 0)) {
+        err = AIRBRAKE_ERROR_INVALID_RESPONSE;
+        goto out;
+    }
+
+    *parser = xmlNewParserCtxt();
+    if (!*parser) {
+        err = AIRBRAKE_ERROR_MEM;
+        goto out;
+    }
+
+    *doc = xmlCtxtReadDoc(*parser, out_buf->p, 0, charset.p, 0);
+    if (!*doc) {
+        err = AIRBRAKE_ERROR_INVALID_RESPONSE;
+        goto out;
+    }
+
+out:
+    airbrake_string_fini(&content_type);
+    airbrake_string_fini(&charset);
+    if (err && *parser) {
+        xmlFreeParserCtxt(*parser);
+        *parser = 0;
+    }
+    AIRBRAKE_PROBE3(parse__done, curl, *http_status_code, err);
+    return err;
+}
+
+static airbrake_error_t airbrake_client_read_notice_node(xmlNodePtr root_node, airbrake_notice_result_t *result)
+{
+    xmlNodePtr node;
+    if (!root_node || strcmp((const char *)root_node->name, "notice") != 0)
+        return AIRBRAKE_ERROR_INVALID_RESPONSE;
+    for (node = root_node->children; node; node = node->next) {
+        airbrake_string_t *field;
+        if (node->type != XML_ELEMENT_NODE)
+            continue;
+        if (strcmp((const char *)node->name, "error-id") == 0)
+            field = &result->error_id;
+        else if (strcmp((const char *)node->name, "url") == 0)
+            field = &result->url;
+        else if (strcmp((const char *)node->name, "id") == 0)
+            field = &result->id;
+        else
+            continue;
+        if (!node->children || node->children->type != XML_TEXT_NODE)
+            return AIRBRAKE_ERROR_INVALID_RESPONSE;
+        airbrake_string_fini(field);
+        if (airbrake_string_init(field, (const char *)node->children->content, strlen((const char *)node->children->content)))
+            return AIRBRAKE_ERROR_MEM;
+    }
+    return AIRBRAKE_OK;
+}
+
+/* interprets the outcome of a completed transfer; shared by the blocking and event-driven paths */
+static airbrake_error_t airbrake_client_handle_response(CURL *curl, const airbrake_string_t *out_buf, airbrake_notice_result_t *result)
+{
+    airbrake_error_t err;
+    xmlParserCtxtPtr parser;
+    xmlDocPtr doc;
+    long http_status_code = 0;
+
+    /* error pages from proxies and load balancers are rarely XML, so only a 200 is parsed */
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status_code);
+    if (http_status_code != 200) {
+        err = airbrake_client_status_error(http_status_code);
+    } else {
+        err = airbrake_client_parse_response(curl, out_buf, &http_status_code, &parser, &doc);
+        if (!err) {
+            err = airbrake_client_read_notice_node(xmlDocGetRootElement(doc), result);
+            xmlFreeDoc(doc);
+            xmlFreeParserCtxt(parser);
+        }
+    }
+    if (err)
+        airbrake_notice_result_fini(result);
+    return err;
+}
+
+/* runs a blocking POST on the given handle; out_buf receives the response body */
+static airbrake_error_t airbrake_client_perform(airbrake_client_t *client, CURL *curl, airbrake_string_t *out_buf, airbrake_notice_result_t *result, const airbrake_string_t *buf)
+{
+    airbrake_error_t err = AIRBRAKE_ERROR_NETWORK_FAILURE;
+    airbrake_client_opaque_t *priv = client->priv;
+    airbrake_curl_writer_t writer = { out_buf };
+    long started_ms = priv->submit_budget_ms ? airbrake_now_ms(): 0;
+    unsigned int tried = 0;
+    size_t index;
+
+    /* fail over to the next best endpoint until one answers or the budget runs out */
+    while ((index = airbrake_client_select_endpoint(priv, tried)) != AIRBRAKE_ENDPOINT_MAX) {
+        long remaining = airbrake_client_remaining_budget(priv, started_ms);
+        if (remaining < 0)
+            break;
+        tried |= 1U << index;
+        out_buf->l = 0;
+        airbrake_client_setup_transfer(client, curl, priv->endpoints[index].url.p, buf, &writer);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, remaining);
+        AIRBRAKE_PROBE2(transfer__start, curl, buf->l);
+        if (curl_easy_perform(curl))
+            err = AIRBRAKE_ERROR_NETWORK_FAILURE;
+        else if (priv->fire_and_forget)
+            err = airbrake_client_handle_status(curl);
+        else
+            err = airbrake_client_handle_response(curl, out_buf, result);
+        AIRBRAKE_PROBE3(transfer__done, curl, airbrake_probe_http_status(curl), err);
+        airbrake_client_record_endpoint(priv, index, err, curl);
+        if (!airbrake_endpoint_failover_error(err))
+            break;
+    }
+    return err;
+}
+
+static airbrake_error_t airbrake_client_post_curl(airbrake_client_t *client, airbrake_notice_result_t *result, const airbrake_string_t *buf)
+{
+    airbrake_error_t err;
+    airbrake_client_opaque_t *priv = client->priv;
+
+    err = airbrake_client_perform(client, priv->curl, airbrake_client_buffer_acquire(&priv->response_buf), result, buf);
+    airbrake_client_buffer_release(&priv->response_buf, priv->buffer_limit);
+    return err;
+}
+
+/* result may be null in fire-and-forget mode, where it is never filled in */
+static airbrake_error_t airbrake_client_post(airbrake_client_t *client, airbrake_notice_result_t *result, const airbrake_string_t *buf)
+{
+    airbrake_error_t err;
+
+    if (result) {
+        result->error_id.p = 0;
+        result->url.p = 0;
+        result->id.p = 0;
+    }
+
+    if (client->priv->transport == AIRBRAKE_TRANSPORT_UNIX) {
+        AIRBRAKE_PROBE2(transfer__start, 0, buf->l);
+        err = airbrake_client_post_unix(client, buf);
+        AIRBRAKE_PROBE3(transfer__done, 0, 0, err);
+    } else {
+        err = airbrake_client_post_curl(client, result, buf);
+    }
+    airbrake_client_count(client->priv, err);
+    return err;
+}
+
+airbrake_error_t airbrake_client_submit_notice_xml(airbrake_client_t *client, airbrake_notice_result_t *result, airbrake_string_t xml)
+{
+    return airbrake_client_post(client, result, &xml);
+}
+
+airbrake_error_t airbrake_client_submit_notice(airbrake_client_t *client, airbrake_notice_result_t *result, const airbrake_notice_t *notice)
+{
+    airbrake_error_t err = AIRBRAKE_OK;
+    airbrake_string_t *buf = airbrake_client_buffer_acquire(&client->priv->request_buf);
+
+    if (result) {
+        result->error_id.p = 0;
+        result->url.p = 0;
+        result->id.p = 0;
+    }
+
+    err = airbrake_client_build_notice_xml(client, buf, notice);
+    if (!err)
+        err = airbrake_client_post(client, result, buf);
+
+    airbrake_client_buffer_release(&client->priv->request_buf, client->priv->buffer_limit);
+    return err;
+}
+
+/*
+ * The library keeps its own copy of what libcurl asked the event loop to
+ * watch, so that a submit under the blocking backpressure policy can run
+ * the transfers itself while it waits for room.
+ */
+static void airbrake_client_watch(airbrake_client_opaque_t *priv, int fd, int events)
+{
+    size_t i;
+
+    for (i = 0; i < priv->watches_count; i++) {
+        if (priv->watches[i].fd != fd)
+            continue;
+        if (events & AIRBRAKE_POLL_REMOVE)
+            priv->watches[i] = priv->watches[--priv->watches_count];
+        else
+            priv->watches[i].events = (events & AIRBRAKE_POLL_IN ? POLLIN: 0) | (events & AIRBRAKE_POLL_OUT ? POLLOUT: 0);
+        return;
+    }
+    if (events & AIRBRAKE_POLL_REMOVE)
+        return;
+    if (priv->watches_count == priv->watches_cap) {
+        size_t new_cap = priv->watches_cap ? priv->watches_cap * 2: 8;
+        struct pollfd *new_watches = airbrake_realloc(priv->watches, sizeof(struct pollfd) * new_cap);
+        if (!new_watches)
+            return;
+        priv->watches = new_watches;
+        priv->watches_cap = new_cap;
+    }
+    priv->watches[priv->watches_count].fd = fd;
+    priv->watches[priv->watches_count].events = (events & AIRBRAKE_POLL_IN ? POLLIN: 0) | (events & AIRBRAKE_POLL_OUT ? POLLOUT: 0);
+    priv->watches[priv->watches_count].revents = 0;
+    priv->watches_count++;
+}
+
+static int airbrake_client_multi_socket_cb(CURL *easy, curl_socket_t fd, int what, void *userp, void *socketp)
+{
+    airbrake_client_opaque_t *priv = userp;
+    int events = 0;
+
+    switch (what) {
+    case CURL_POLL_IN:
+        events = AIRBRAKE_POLL_IN;
+        break;
+    case CURL_POLL_OUT:
+        events = AIRBRAKE_POLL_OUT;
+        break;
+    case CURL_POLL_INOUT:
+        events = AIRBRAKE_POLL_IN | AIRBRAKE_POLL_OUT;
+        break;
+    case CURL_POLL_REMOVE:
+        events = AIRBRAKE_POLL_REMOVE;
+        break;
+    }
+    airbrake_client_watch(priv, fd, events);
+    priv->socket_func(priv->event_loop_ctx, fd, events);
+    return 0;
+}
+
+static int airbrake_client_multi_timer_cb(CURLM *multi, long timeout_ms, void *userp)
+{
+    airbrake_client_opaque_t *priv = userp;
+    priv->multi_timeout_at = timeout_ms < 0 ? -1: airbrake_now_ms() + timeout_ms;
+    priv->timer_func(priv->event_loop_ctx, timeout_ms);
+    return 0;
+}
+
+static airbrake_error_t airbrake_transfer_new(airbrake_client_opaque_t *priv, airbrake_transfer_t **retval)
+{
+    airbrake_transfer_t *transfer = priv->idle_transfers;
+
+    if (transfer) {
+        priv->idle_transfers = transfer->next;
+        priv->idle_transfers_count--;
+    } else {
+        transfer = airbrake_malloc(sizeof(airbrake_transfer_t));
+        if (!transfer)
+            return AIRBRAKE_ERROR_MEM;
+        transfer->curl = curl_easy_init();
+        if (!transfer->curl) {
+            airbrake_free(transfer);
+            return AIRBRAKE_ERROR_UNKNOWN;
+        }
+        airbrake_client_buffer_init(&transfer->request_buf);
+        airbrake_client_buffer_init(&transfer->response_buf);
+    }
+    transfer->next = transfer->prev = 0;
+    transfer->result.error_id.p = 0;
+    transfer->result.url.p = 0;
+    transfer->result.id.p = 0;
+    transfer->completion_func = 0;
+    transfer->completion_ctx = 0;
+    transfer->endpoint = 0;
+    transfer->endpoints_tried = 0;
+    transfer->started_ms = 0;
+    transfer->queued_bytes = 0;
+    transfer->seq = 0;
+    transfer->batch_entries = 0;
+    transfer->batch_n = 0;
+    *retval = transfer;
+    return AIRBRAKE_OK;
+}
+
+static void airbrake_transfer_free(airbrake_client_opaque_t *priv, airbrake_transfer_t *transfer)
+{
+    if (transfer->queued_bytes) {
+        priv->queued_bytes -= transfer->queued_bytes;
+        AIRBRAKE_PROBE3(queue__dequeue, transfer->seq, transfer->queued_bytes, priv->queued_bytes);
+        transfer->queued_bytes = 0;
+    }
+    airbrake_client_buffer_release(&transfer->request_buf, priv->buffer_limit);
+    airbrake_client_buffer_release(&transfer->response_buf, priv->buffer_limit);
+    if (priv->idle_transfers_count < AIRBRAKE_TRANSFER_POOL_MAX) {
+        transfer->next = priv->idle_transfers;
+        priv->idle_transfers = transfer;
+        priv->idle_transfers_count++;
+        return;
+    }
+    curl_easy_cleanup(transfer->curl);
+    airbrake_client_buffer_fini(&transfer->request_buf);
+    airbrake_client_buffer_fini(&transfer->response_buf);
+    airbrake_free(transfer);
+}
+
+static void airbrake_transfer_unlink(airbrake_client_opaque_t *priv, airbrake_transfer_t *transfer)
+{
+    if (transfer->prev)
+        transfer->prev->next = transfer->next;
+    else
+        priv->transfers = transfer->next;
+    if (transfer->next)
+        transfer->next->prev = transfer->prev;
+    priv->transfers_in_flight--;
+}
+
+static void airbrake_transfer_complete_batch(airbrake_client_opaque_t *priv, airbrake_transfer_t *transfer, airbrake_error_t err);
+
+static void airbrake_transfer_complete(airbrake_client_opaque_t *priv, airbrake_transfer_t *transfer, airbrake_error_t err)
+{
+    if (transfer->batch_n) {
+        airbrake_transfer_complete_batch(priv, transfer, err);
+        return;
+    }
+    /* the result belongs to the library and is only valid during the callback */
+    airbrake_client_count(priv, err);
+    if (transfer->completion_func)
+        transfer->completion_func(transfer->completion_ctx, err, err || priv->fire_and_forget ? 0: &transfer->result);
+    if (!err)
+        airbrake_notice_result_fini(&transfer->result);
+    airbrake_transfer_free(priv, transfer);
+}
+
+airbrake_error_t airbrake_client_attach_event_loop(airbrake_client_t *client, airbrake_socket_func_t socket_func, airbrake_timer_func_t timer_func, void *ctx)
+{
+    airbrake_client_opaque_t *priv = client->priv;
+
+    if (priv->multi)
+        return AIRBRAKE_ERROR_UNKNOWN;
+    priv->multi = curl_multi_init();
+    if (!priv->multi)
+        return AIRBRAKE_ERROR_MEM;
+    priv->socket_func = socket_func;
+    priv->timer_func = timer_func;
+    priv->event_loop_ctx = ctx;
+    curl_multi_setopt(priv->multi, CURLMOPT_SOCKETFUNCTION, airbrake_client_multi_socket_cb);
+    curl_multi_setopt(priv->multi, CURLMOPT_SOCKETDATA, priv);
+    curl_multi_setopt(priv->multi, CURLMOPT_TIMERFUNCTION, airbrake_client_multi_timer_cb);
+    curl_multi_setopt(priv->multi, CURLMOPT_TIMERDATA, priv);
+    return AIRBRAKE_OK;
+}
+
+static void airbrake_client_detach_event_loop_priv(airbrake_client_opaque_t *priv)
+{
+    airbrake_transfer_t *i, *next;
+
+    if (!priv->multi)
+        return;
+    /* curl is still reading messages off the handle, so socket_action detaches once it is done */
+    if (priv->in_socket_action) {
+        priv->detach_pending = 1;
+        return;
+    }
+    priv->detach_pending = 0;
+    /* abandoned transfers are still reported so that callers can free their context */
+    for (i = priv->transfers; i; i = next) {
+        next = i->next;
+        curl_multi_remove_handle(priv->multi, i->curl);
+        airbrake_transfer_unlink(priv, i);
+        airbrake_transfer_complete(priv, i, AIRBRAKE_ERROR_NETWORK_FAILURE);
+    }
+    for (i = priv->idle_transfers; i; i = next) {
+        next = i->next;
+        curl_easy_cleanup(i->curl);
+        airbrake_client_buffer_fini(&i->request_buf);
+        airbrake_client_buffer_fini(&i->response_buf);
+        airbrake_free(i);
+    }
+    priv->idle_transfers = 0;
+    priv->idle_transfers_count = 0;
+    curl_multi_cleanup(priv->multi);
+    priv->multi = 0;
+    airbrake_free(priv->watches);
+    priv->watches = 0;
+    priv->watches_count = priv->watches_cap = 0;
+    priv->multi_timeout_at = -1;
+}
+
+void airbrake_client_detach_event_loop(airbrake_client_t *client)
+{
+    airbrake_client_detach_event_loop_priv(client->priv);
+}
+
+/* hands the transfer to the next untried endpoint; non-zero when there is none left or no budget */
+static int airbrake_transfer_start(airbrake_client_opaque_t *priv, airbrake_transfer_t *transfer)
+{
+    size_t index = airbrake_client_select_endpoint(priv, transfer->endpoints_tried);
+    long remaining = airbrake_client_remaining_budget(priv, transfer->started_ms);
+
+    if (index == AIRBRAKE_ENDPOINT_MAX || remaining < 0)
+        return 1;
+    transfer->endpoint = index;
+    transfer->endpoints_tried |= 1U << index;
+    transfer->writer.buf->l = 0;
+    airbrake_client_setup_transfer(transfer->client, transfer->curl, priv->endpoints[index].url.p, &transfer->request_buf.buf, &transfer->writer);
+    curl_easy_setopt(transfer->curl, CURLOPT_TIMEOUT_MS, remaining);
+    curl_easy_setopt(transfer->curl, CURLOPT_PRIVATE, transfer);
+    AIRBRAKE_PROBE2(transfer__start, transfer->curl, transfer->request_buf.buf.l);
+    return curl_multi_add_handle(priv->multi, transfer->curl) != CURLM_OK;
+}
+
+/* takes either a notice to serialize or a document that already is */
+static airbrake_error_t airbrake_client_submit_async(airbrake_client_t *client, const airbrake_notice_t *notice, const airbrake_string_t *xml, airbrake_completion_func_t completion_func, void *completion_ctx)
+{
+    airbrake_error_t err;
+    airbrake_client_opaque_t *priv = client->priv;
+    airbrake_transfer_t *transfer;
+
+    if (priv->transport == AIRBRAKE_TRANSPORT_UNIX) {
+        /* writes to the agent never block, so they complete immediately */
+        airbrake_notice_result_t result = { { 0, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0 } };
+        if (notice)
+            err = airbrake_client_submit_notice(client, &result, notice);
+        else
+            err = airbrake_client_submit_notice_xml(client, &result, *xml);
+        if (completion_func)
+            completion_func(completion_ctx, err, err ? 0: &result);
+        if (!err)
+            airbrake_notice_result_fini(&result);
+        return AIRBRAKE_OK;
+    }
+
+    if (!priv->multi || priv->detach_pending)
+        return AIRBRAKE_ERROR_UNKNOWN;
+
+    err = airbrake_transfer_new(priv, &transfer);
+    if (err)
+        return err;
+    if (notice) {
+        err = airbrake_client_build_notice_xml(client, airbrake_client_buffer_acquire(&transfer->request_buf), notice);
+    } else {
+        airbrake_string_t *buf = airbrake_client_buffer_acquire(&transfer->request_buf);
+        buf->l = 0;
+        err = airbrake_string_append(buf, *xml);
+    }
+    if (!err)
+        err = airbrake_client_admit(client, &transfer->request_buf.buf);
+    /* admission may have run completions, and one of them may have detached the loop */
+    if (!err && (!priv->multi || priv->detach_pending))
+        err = AIRBRAKE_ERROR_UNKNOWN;
+    if (err) {
+        airbrake_transfer_free(priv, transfer);
+        return err;
+    }
+    transfer->queued_bytes = transfer->request_buf.buf.l;
+    transfer->seq = ++priv->queue_seq;
+    priv->queued_bytes += transfer->queued_bytes;
+    AIRBRAKE_PROBE3(queue__enqueue, transfer->seq, transfer->queued_bytes, priv->queued_bytes);
+    transfer->writer.buf = airbrake_client_buffer_acquire(&transfer->response_buf);
+    transfer->completion_func = completion_func;
+    transfer->completion_ctx = completion_ctx;
+    transfer->started_ms = priv->submit_budget_ms ? airbrake_now_ms(): 0;
+    transfer->client = client;
+    if (airbrake_transfer_start(priv, transfer)) {
+        airbrake_transfer_free(priv, transfer);
+        return AIRBRAKE_ERROR_UNKNOWN;
+    }
+
+    transfer->next = priv->transfers;
+    if (priv->transfers)
+        priv->transfers->prev = transfer;
+    priv->transfers = transfer;
+    priv->transfers_in_flight++;
+    return AIRBRAKE_OK;
+}
+
+airbrake_error_t airbrake_client_submit_notice_async(airbrake_client_t *client, const airbrake_notice_t *notice, airbrake_completion_func_t completion_func, void *completion_ctx)
+{
+    return airbrake_client_submit_async(client, notice, 0, completion_func, completion_ctx);
+}
+
+airbrake_error_t airbrake_client_submit_notice_xml_async(airbrake_client_t *client, airbrake_string_t xml, airbrake_completion_func_t completion_func, void *completion_ctx)
+{
+    return airbrake_client_submit_async(client, 0, &xml, completion_func, completion_ctx);
+}
+
+airbrake_error_t airbrake_client_socket_action(airbrake_client_t *client, int fd, int events)
+{
+    airbrake_client_opaque_t *priv = client->priv;
+    airbrake_error_t err = AIRBRAKE_OK;
+    int running, pending, ev_bitmask = 0;
+    CURLMsg *msg;
+
+    /* curl does not allow it to be called again from within a completion */
+    if (!priv->multi || priv->in_socket_action)
+        return AIRBRAKE_ERROR_UNKNOWN;
+
+    if (events & AIRBRAKE_POLL_IN)
+        ev_bitmask |= CURL_CSELECT_IN;
+    if (events & AIRBRAKE_POLL_OUT)
+        ev_bitmask |= CURL_CSELECT_OUT;
+    if (events & AIRBRAKE_POLL_ERROR)
+        ev_bitmask |= CURL_CSELECT_ERR;
+    priv->in_socket_action = 1;
+    if (curl_multi_socket_action(priv->multi, fd == AIRBRAKE_SOCKET_TIMEOUT ? CURL_SOCKET_TIMEOUT: fd, ev_bitmask, &running) != CURLM_OK)
+        err = AIRBRAKE_ERROR_UNKNOWN;
+
+    while (!err && (msg = curl_multi_info_read(priv->multi, &pending))) {
+        airbrake_transfer_t *transfer;
+        airbrake_error_t transfer_err;
+
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&transfer);
+        if (transfer->batch_n) {
+            /* batches have a single endpoint of their own and are never failed over */
+            curl_multi_remove_handle(priv->multi, transfer->curl);
+            airbrake_transfer_unlink(priv, transfer);
+            airbrake_transfer_complete(priv, transfer, msg->data.result != CURLE_OK ? AIRBRAKE_ERROR_NETWORK_FAILURE: AIRBRAKE_OK);
+            continue;
+        }
+        if (msg->data.result != CURLE_OK)
+            transfer_err = AIRBRAKE_ERROR_NETWORK_FAILURE;
+        else if (priv->fire_and_forget)
+            transfer_err = airbrake_client_handle_status(transfer->curl);
+        else
+            transfer_err = airbrake_client_handle_response(transfer->curl, transfer->writer.buf, &transfer->result);
+        AIRBRAKE_PROBE3(transfer__done, transfer->curl, airbrake_probe_http_status(transfer->curl), transfer_err);
+        curl_multi_remove_handle(priv->multi, transfer->curl);
+        airbrake_client_record_endpoint(priv, transfer->endpoint, transfer_err, transfer->curl);
+        if (airbrake_endpoint_failover_error(transfer_err) && !priv->detach_pending && !airbrake_transfer_start(priv, transfer))
+            continue;
+        airbrake_transfer_unlink(priv, transfer);
+        airbrake_transfer_complete(priv, transfer, transfer_err);
+    }
+    priv->in_socket_action = 0;
+    if (priv->detach_pending)
+        airbrake_client_detach_event_loop_priv(priv);
+    return err;
+}
+
+size_t airbrake_client_transfers_in_flight(airbrake_client_t *client)
+{
+    return client->priv->transfers_in_flight;
+}
+
+static airbrake_error_t airbrake_gzip(airbrake_string_t *out, const airbrake_string_t *in)
+{
+    airbrake_error_t err;
+    z_stream z;
+    size_t bound;
+
+    memset(&z, 0, sizeof(z));
+    /* 16 added to the window bits selects the gzip wrapper */
+    if (deflateInit2(&z, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return AIRBRAKE_ERROR_MEM;
+    bound = deflateBound(&z, in->l) + 32;
+    out->l = 0;
+    err = airbrake_string_grow(out, bound);
+    if (err) {
+        deflateEnd(&z);
+        return err;
+    }
+    z.next_in = (Bytef *)in->p;
+    z.avail_in = in->l;
+    z.next_out = (Bytef *)out->p;
+    z.avail_out = bound;
+    if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&z);
+        return AIRBRAKE_ERROR_UNKNOWN;
+    }
+    out->l = z.total_out;
+    deflateEnd(&z);
+    return AIRBRAKE_OK;
+}
+
+airbrake_error_t airbrake_client_set_batch_endpoint(airbrake_client_t *client, airbrake_string_t endpoint, size_t max_notices, size_t max_bytes, long max_delay_ms)
+{
+    airbrake_error_t err;
+    airbrake_batch_t *batch = &client->priv->batch;
+
+    if (batch->n > 0) {
+        err = airbrake_client_flush_batch(client);
+        if (err)
+            return err;
+    }
+    err = airbrake_string_assign(&batch->endpoint, endpoint);
+    if (err)
+        return err;
+    if (!batch->headers) {
+        /* never replaced, since batches in flight on the event loop point at it */
+        struct curl_slist *tmp = curl_slist_append(0, "Content-Type: text/xml");
+        if (tmp)
+            batch->headers = curl_slist_append(tmp, "Content-Encoding: gzip");
+        if (!tmp || !batch->headers) {
+            curl_slist_free_all(tmp);
+            batch->headers = 0;
+            return AIRBRAKE_ERROR_MEM;
+        }
+    }
+    batch->max_notices = max_notices ? max_notices: AIRBRAKE_BATCH_DEFAULT_MAX_NOTICES;
+    batch->max_bytes = max_bytes ? max_bytes: AIRBRAKE_BATCH_DEFAULT_MAX_BYTES;
+#ifdef AIRBRAKE_STATIC_ALLOCATION
+    /* the body overshoots by up to one element before it is flushed and must still fit a pool block */
+    if (batch->max_bytes > AIRBRAKE_STATIC_MAX_BLOCK / 2)
+        batch->max_bytes = AIRBRAKE_STATIC_MAX_BLOCK / 2;
+#endif
+    batch->max_delay_ms = max_delay_ms >= 0 ? max_delay_ms: AIRBRAKE_BATCH_DEFAULT_MAX_DELAY_MS;
+    return AIRBRAKE_OK;
+}
+
+/*
+ * Per-notice results come back as a <notices> document whose element
+ * children answer the batched notices in order.
+ */
+static void airbrake_client_read_batch_response(CURL *curl, const airbrake_string_t *out_buf, airbrake_notice_result_t *results, airbrake_error_t *errs, size_t n)
+{
+    airbrake_error_t err;
+    xmlParserCtxtPtr parser;
+    xmlDocPtr doc;
+    long http_status_code = 0;
+    size_t i = 0;
+
+    /* as for single notices, only a 200 is parsed */
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status_code);
+    if (http_status_code != 200)
+        err = airbrake_client_status_error(http_status_code);
+    else
+        err = airbrake_client_parse_response(curl, out_buf, &http_status_code, &parser, &doc);
+    if (!err && http_status_code == 200) {
+        xmlNodePtr root_node = xmlDocGetRootElement(doc), node;
+        if (!root_node || strcmp((const char *)root_node->name, "notices") != 0)
+            err = AIRBRAKE_ERROR_INVALID_RESPONSE;
+        if (!err) {
+            for (node = root_node->children; node && i < n; node = node->next) {
+                if (node->type != XML_ELEMENT_NODE)
+                    continue;
+                errs[i] = airbrake_client_read_notice_node(node, &results[i]);
+                i++;
+            }
+            /* for the notices left unanswered */
+            err = AIRBRAKE_ERROR_INVALID_RESPONSE;
+        }
+        xmlFreeDoc(doc);
+        xmlFreeParserCtxt(parser);
+    }
+    for (; i < n; i++)
+        errs[i] = err;
+}
+
+/* reports the outcome of each batched notice; takes over entries, errs and results */
+static void airbrake_client_complete_batch(airbrake_client_opaque_t *priv, airbrake_batch_entry_t *entries, size_t n, airbrake_error_t err, airbrake_error_t *errs, airbrake_notice_result_t *results)
+{
+    airbrake_batch_t *batch = &priv->batch;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        priv->queued_bytes -= entries[i].bytes;
+        AIRBRAKE_PROBE3(queue__dequeue, entries[i].seq, entries[i].bytes, priv->queued_bytes);
+    }
+    for (i = 0; i < n; i++) {
+        airbrake_error_t notice_err = err ? err: errs[i];
+        airbrake_client_count(priv, notice_err);
+        if (entries[i].completion_func)
+            entries[i].completion_func(entries[i].completion_ctx, notice_err, notice_err || priv->fire_and_forget ? 0: &results[i]);
+        if (results)
+            airbrake_notice_result_fini(&results[i]);
+    }
+    /* keep the array for the next batch unless a completion has started one */
+    if (!batch->entries) {
+        batch->entries = entries;
+        batch->cap = entries ? n: 0;
+    } else {
+        airbrake_free(entries);
+    }
+    airbrake_free(results);
+    airbrake_free(errs);
+}
+
+/* reads the per-notice outcomes of a finished batch transfer unless it has already failed with err */
+static airbrake_error_t airbrake_client_read_batch(airbrake_client_opaque_t *priv, CURL *curl, const airbrake_string_t *out_buf, airbrake_error_t err, size_t n, airbrake_error_t **errs, airbrake_notice_result_t **results)
+{
+    size_t i;
+
+    *results = 0;
+    *errs = 0;
+    if (!err) {
+        *results = airbrake_malloc(sizeof(airbrake_notice_result_t) * n);
+        *errs = airbrake_malloc(sizeof(airbrake_error_t) * n);
+        if (!*results || !*errs) {
+            err = AIRBRAKE_ERROR_MEM;
+        } else {
+            memset(*results, 0, sizeof(airbrake_notice_result_t) * n);
+            memset(*errs, 0, sizeof(airbrake_error_t) * n);
+        }
+    }
+    if (!err && priv->fire_and_forget) {
+        airbrake_error_t status_err = airbrake_client_handle_status(curl);
+        for (i = 0; i < n; i++)
+            (*errs)[i] = status_err;
+    } else if (!err) {
+        airbrake_client_read_batch_response(curl, out_buf, *results, *errs, n);
+    }
+    /* the first notice's outcome stands for the whole batch */
+    AIRBRAKE_PROBE3(transfer__done, curl, airbrake_probe_http_status(curl), err ? err: (*errs)[0]);
+    return err;
+}
+
+static void airbrake_transfer_complete_batch(airbrake_client_opaque_t *priv, airbrake_transfer_t *transfer, airbrake_error_t err)
+{
+    airbrake_batch_entry_t *entries = transfer->batch_entries;
+    size_t n = transfer->batch_n;
+    airbrake_notice_result_t *results;
+    airbrake_error_t *errs;
+
+    err = airbrake_client_read_batch(priv, transfer->curl, transfer->writer.buf, err, n, &errs, &results);
+    curl_easy_setopt(transfer->curl, CURLOPT_HTTPHEADER, (struct curl_slist *)0);
+    transfer->batch_entries = 0;
+    transfer->batch_n = 0;
+    /* the entries give their bytes back one by one */
+    transfer->queued_bytes = 0;
+    airbrake_transfer_free(priv, transfer);
+    airbrake_client_complete_batch(priv, entries, n, err, errs, results);
+}
+
+/* hands the pending batch to the event loop, which then owns its entries */
+static airbrake_error_t airbrake_client_start_batch(airbrake_client_t *client)
 {
     airbrake_error_t err;
+    airbrake_client_opaque_t *priv = client->priv;
+    airbrake_batch_t *batch = &priv->batch;
+    airbrake_transfer_t *transfer;
+    airbrake_string_t *buf;
+    size_t i;
 
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-          "<request>"
-            "<url>"));
+    err = airbrake_transfer_new(priv, &transfer);
     if (err)
         return err;
-    err = airbrake_string_append_xml_escape(buf, &request->url);
+    buf = airbrake_client_buffer_acquire(&transfer->request_buf);
+    buf->l = 0;
+    err = airbrake_string_append(buf, batch->compressed);
+    if (err) {
+        airbrake_transfer_free(priv, transfer);
+        return err;
+    }
+    transfer->writer.buf = airbrake_client_buffer_acquire(&transfer->response_buf);
+    transfer->writer.buf->l = 0;
+    transfer->client = client;
+    airbrake_client_setup_transfer(client, transfer->curl, batch->endpoint.p, buf, &transfer->writer);
+    curl_easy_setopt(transfer->curl, CURLOPT_TIMEOUT_MS, priv->submit_budget_ms);
+    curl_easy_setopt(transfer->curl, CURLOPT_HTTPHEADER, batch->headers);
+    curl_easy_setopt(transfer->curl, CURLOPT_PRIVATE, transfer);
+    AIRBRAKE_PROBE2(transfer__start, transfer->curl, buf->l);
+    if (curl_multi_add_handle(priv->multi, transfer->curl) != CURLM_OK) {
+        curl_easy_setopt(transfer->curl, CURLOPT_HTTPHEADER, (struct curl_slist *)0);
+        airbrake_transfer_free(priv, transfer);
+        return AIRBRAKE_ERROR_UNKNOWN;
+    }
+
+    /* the oldest notice in the batch decides when it is up for eviction */
+    transfer->seq = batch->entries[0].seq;
+    for (i = 0; i < batch->n; i++)
+        transfer->queued_bytes += batch->entries[i].bytes;
+    transfer->batch_entries = batch->entries;
+    transfer->batch_n = batch->n;
+    batch->entries = 0;
+    batch->n = batch->cap = 0;
+    batch->body.l = 0;
+
+    transfer->next = priv->transfers;
+    if (priv->transfers)
+        priv->transfers->prev = transfer;
+    priv->transfers = transfer;
+    priv->transfers_in_flight++;
+    return AIRBRAKE_OK;
+}
+
+/*
+ * With an event loop attached the batch goes out through it and its
+ * completions run from airbrake_client_socket_action(); otherwise this
+ * blocks until the collector has answered.
+ */
+airbrake_error_t airbrake_client_flush_batch(airbrake_client_t *client)
+{
+    airbrake_error_t err;
+    airbrake_error_t *errs = 0;
+    airbrake_client_opaque_t *priv = client->priv;
+    airbrake_batch_t *batch = &priv->batch;
+    airbrake_batch_entry_t *entries;
+    airbrake_notice_result_t *results = 0;
+    size_t n = batch->n;
+
+    if (n == 0)
+        return AIRBRAKE_OK;
+
+    err = airbrake_string_append(&batch->body, airbrake_string_static_z("</notices>"));
+    if (!err)
+        err = airbrake_gzip(&batch->compressed, &batch->body);
+    if (!err && priv->multi && !priv->detach_pending) {
+        err = airbrake_client_start_batch(client);
+        if (!err)
+            return AIRBRAKE_OK;
+    }
+
+    if (!err) {
+        CURL *curl = priv->curl;
+        airbrake_string_t *out_buf = airbrake_client_buffer_acquire(&priv->response_buf);
+        airbrake_curl_writer_t writer = { out_buf };
+
+        airbrake_client_setup_transfer(client, curl, batch->endpoint.p, &batch->compressed, &writer);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, priv->submit_budget_ms);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, batch->headers);
+        AIRBRAKE_PROBE2(transfer__start, curl, batch->compressed.l);
+        err = airbrake_client_read_batch(priv, curl, out_buf, curl_easy_perform(curl) ? AIRBRAKE_ERROR_NETWORK_FAILURE: AIRBRAKE_OK, n, &errs, &results);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, (struct curl_slist *)0);
+        airbrake_client_buffer_release(&priv->response_buf, priv->buffer_limit);
+    }
+
+    /* completions may enqueue again, so the batch is emptied before they run */
+    entries = batch->entries;
+    batch->entries = 0;
+    batch->n = batch->cap = 0;
+    batch->body.l = 0;
+    airbrake_client_complete_batch(priv, entries, n, err, errs, results);
+    return err;
+}
+
+/* reports the pending batch as abandoned without sending it */
+static void airbrake_client_abandon_batch(airbrake_client_opaque_t *priv)
+{
+    airbrake_batch_t *batch = &priv->batch;
+    airbrake_batch_entry_t *entries = batch->entries;
+    size_t n = batch->n;
+
+    if (n == 0)
+        return;
+    batch->entries = 0;
+    batch->n = batch->cap = 0;
+    batch->body.l = 0;
+    airbrake_client_complete_batch(priv, entries, n, AIRBRAKE_ERROR_NETWORK_FAILURE, 0, 0);
+}
+
+static const char airbrake_batch_prefix[] = "<?xml version=\"1.0\" ?><notices>";
+
+/* admits a <notice> element and adds it to the pending batch */
+static airbrake_error_t airbrake_client_batch_append(airbrake_client_t *client, const airbrake_string_t *element, airbrake_completion_func_t completion_func, void *completion_ctx)
+{
+    airbrake_error_t err;
+    airbrake_client_opaque_t *priv = client->priv;
+    airbrake_batch_t *batch = &priv->batch;
+    airbrake_batch_entry_t *entry;
+
+    /* admission may run completions that enqueue again, so the batch is only looked at afterwards */
+    err = airbrake_client_admit(client, element);
     if (err)
         return err;
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-            "</url>"
-            "<component>"));
+    if (batch->n == batch->cap) {
+        size_t new_cap = batch->cap ? batch->cap * 2: 16;
+        airbrake_batch_entry_t *new_entries = airbrake_realloc(batch->entries, sizeof(airbrake_batch_entry_t) * new_cap);
+        if (!new_entries)
+            return AIRBRAKE_ERROR_MEM;
+        batch->entries = new_entries;
+        batch->cap = new_cap;
+    }
+    if (batch->n == 0) {
+        batch->body.l = 0;
+        err = airbrake_string_append(&batch->body, airbrake_string_static(airbrake_batch_prefix, sizeof(airbrake_batch_prefix) - 1));
+        if (err)
+            return err;
+        batch->first_enqueued_ms = airbrake_now_ms();
+    }
+    err = airbrake_string_append(&batch->body, *element);
     if (err)
         return err;
-    err = airbrake_string_append_xml_escape(buf, &request->component);
+    entry = &batch->entries[batch->n++];
+    entry->completion_func = completion_func;
+    entry->completion_ctx = completion_ctx;
+    entry->bytes = element->l;
+    entry->seq = ++priv->queue_seq;
+    priv->queued_bytes += element->l;
+    AIRBRAKE_PROBE3(queue__enqueue, entry->seq, entry->bytes, priv->queued_bytes);
+    return AIRBRAKE_OK;
+}
+
+airbrake_error_t airbrake_client_enqueue_notice(airbrake_client_t *client, const airbrake_notice_t *notice, airbrake_completion_func_t completion_func, void *completion_ctx)
+{
+    airbrake_error_t err;
+    airbrake_client_opaque_t *priv = client->priv;
+    airbrake_batch_t *batch = &priv->batch;
+    airbrake_string_t xml, *buf = &xml;
+
+    if (!batch->endpoint.p)
+        return AIRBRAKE_ERROR_UNKNOWN;
+
+    /*
+     * Built aside so that admission may flush or evict without the new
+     * element in the body.  Admission may also run completions that enqueue
+     * again, so the shared buffer's storage is taken over for the duration.
+     */
+    xml = priv->request_buf.buf;
+    xml.l = 0;
+    xml.xl = 0;
+    priv->request_buf.buf = airbrake_string_null;
+    err = airbrake_client_build_notice_xml_element(client, buf, notice, 0);
+    if (!err)
+        err = airbrake_client_batch_append(client, buf, completion_func, completion_ctx);
+    if (!priv->request_buf.buf.p) {
+        priv->request_buf.buf = xml;
+        airbrake_client_buffer_release(&priv->request_buf, priv->buffer_limit);
+    } else {
+        airbrake_string_fini(&xml);
+    }
     if (err)
         return err;
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-            "</component>"));
+
+    if (batch->n >= batch->max_notices || batch->body.l >= batch->max_bytes)
+        airbrake_client_flush_batch(client);
+    return AIRBRAKE_OK;
+}
+
+/*
+ * Batches a notice document that has already been serialized, such as a
+ * frame received by a forwarding agent.  Its XML declaration, if any, is
+ * dropped, since the batch body carries one of its own.
+ */
+airbrake_error_t airbrake_client_enqueue_notice_xml(airbrake_client_t *client, airbrake_string_t xml, airbrake_completion_func_t completion_func, void *completion_ctx)
+{
+    airbrake_error_t err;
+    airbrake_batch_t *batch = &client->priv->batch;
+
+    if (!batch->endpoint.p)
+        return AIRBRAKE_ERROR_UNKNOWN;
+
+    if (xml.l >= 5 && memcmp(xml.p, "<?xml", 5) == 0) {
+        size_t o = 5;
+        while (o + 1 < xml.l && !(xml.p[o] == '?' && xml.p[o + 1] == '>'))
+            o++;
+        if (o + 1 >= xml.l)
+            return AIRBRAKE_ERROR_INVALID_RECORD;
+        o += 2;
+        while (o < xml.l && (xml.p[o] == ' ' || xml.p[o] == '\t' || xml.p[o] == '\r' || xml.p[o] == '\n'))
+            o++;
+        xml = airbrake_string_static(xml.p + o, xml.l - o);
+    }
+    err = airbrake_client_batch_append(client, &xml, completion_func, completion_ctx);
     if (err)
         return err;
 
-    if (request->action.p) {
-        err = airbrake_string_append(buf, airbrake_string_static_z(
-                "<action>"));
-        if (err)
-            return err;
-        err = airbrake_string_append_xml_escape(buf, &request->action);
+    if (batch->n >= batch->max_notices || batch->body.l >= batch->max_bytes)
+        airbrake_client_flush_batch(client);
+    return AIRBRAKE_OK;
+}
+
+long airbrake_client_batch_timeout(airbrake_client_t *client)
+{
+    airbrake_batch_t *batch = &client->priv->batch;
+    long remaining;
+
+    if (batch->n == 0)
+        return -1;
+    remaining = batch->first_enqueued_ms + batch->max_delay_ms - airbrake_now_ms();
+    return remaining > 0 ? remaining: 0;
+}
+
+airbrake_error_t airbrake_client_poll_batch(airbrake_client_t *client)
+{
+    if (airbrake_client_batch_timeout(client) != 0)
+        return AIRBRAKE_OK;
+    return airbrake_client_flush_batch(client);
+}
+
+static void airbrake_client_drop(airbrake_client_opaque_t *priv, unsigned long seq, size_t bytes)
+{
+    AIRBRAKE_PROBE2(queue__drop, seq, bytes);
+    pthread_mutex_lock(&priv->stats_mutex);
+    priv->stats.dropped++;
+    pthread_mutex_unlock(&priv->stats_mutex);
+    if (priv->drop_func)
+        priv->drop_func(priv->drop_ctx, bytes);
+}
+
+/*
+ * Removes the notice that has been held the longest, whether it is still
+ * waiting in the batch or already in flight.  Its completion is reported
+ * with AIRBRAKE_ERROR_QUEUE_FULL and must not submit anything itself.
+ * Returns non-zero when there was something to evict.
+ */
+static int airbrake_client_evict_oldest(airbrake_client_opaque_t *priv)
+{
+    airbrake_batch_t *batch = &priv->batch;
+    airbrake_transfer_t *oldest = 0, *i;
+
+    /* transfers are linked newest first */
+    for (i = priv->transfers; i; i = i->next)
+        oldest = i;
+
+    if (batch->n > 0 && (!oldest || batch->entries[0].seq < oldest->seq)) {
+        airbrake_batch_entry_t entry = batch->entries[0];
+        size_t offset = sizeof(airbrake_batch_prefix) - 1;
+
+        memmove(batch->body.p + offset, batch->body.p + offset + entry.bytes, batch->body.l - offset - entry.bytes);
+        batch->body.l -= entry.bytes;
+        batch->n--;
+        memmove(batch->entries, batch->entries + 1, sizeof(airbrake_batch_entry_t) * batch->n);
+        priv->queued_bytes -= entry.bytes;
+        AIRBRAKE_PROBE3(queue__dequeue, entry.seq, entry.bytes, priv->queued_bytes);
+        airbrake_client_drop(priv, entry.seq, entry.bytes);
+        airbrake_client_count(priv, AIRBRAKE_ERROR_QUEUE_FULL);
+        if (entry.completion_func)
+            entry.completion_func(entry.completion_ctx, AIRBRAKE_ERROR_QUEUE_FULL, 0);
+        return 1;
+    }
+    if (oldest) {
+        curl_multi_remove_handle(priv->multi, oldest->curl);
+        airbrake_transfer_unlink(priv, oldest);
+        if (oldest->batch_n) {
+            size_t j;
+            for (j = 0; j < oldest->batch_n; j++)
+                airbrake_client_drop(priv, oldest->batch_entries[j].seq, oldest->batch_entries[j].bytes);
+        } else {
+            airbrake_client_drop(priv, oldest->seq, oldest->queued_bytes);
+        }
+        airbrake_transfer_complete(priv, oldest, AIRBRAKE_ERROR_QUEUE_FULL);
+        return 1;
+    }
+    return 0;
+}
+
+/* appends the notice to the spill file in the same framing as the unix transport */
+static airbrake_error_t airbrake_client_spill(airbrake_client_opaque_t *priv, const airbrake_string_t *xml)
+{
+    unsigned char header[4];
+    struct iovec iov[2];
+    off_t size;
+    ssize_t n;
+
+    if (priv->spill_fd < 0) {
+        priv->spill_fd = open(priv->spill_path.p, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if (priv->spill_fd < 0)
+            return AIRBRAKE_ERROR_UNKNOWN;
+    }
+    header[0] = (unsigned char)(xml->l >> 24);
+    header[1] = (unsigned char)(xml->l >> 16);
+    header[2] = (unsigned char)(xml->l >> 8);
+    header[3] = (unsigned char)xml->l;
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = xml->p;
+    iov[1].iov_len = xml->l;
+
+    size = lseek(priv->spill_fd, 0, SEEK_END);
+    do {
+        n = writev(priv->spill_fd, iov, 2);
+    } while (n < 0 && errno == EINTR);
+    if (n != (ssize_t)(sizeof(header) + xml->l)) {
+        /* a torn frame would take every later frame with it */
+        if (size >= 0 && ftruncate(priv->spill_fd, size)) {
+            close(priv->spill_fd);
+            priv->spill_fd = -1;
+        }
+        return AIRBRAKE_ERROR_UNKNOWN;
+    }
+    pthread_mutex_lock(&priv->stats_mutex);
+    priv->stats.spilled++;
+    pthread_mutex_unlock(&priv->stats_mutex);
+    return AIRBRAKE_OK;
+}
+
+/* runs the in-flight transfers for up to timeout_ms on behalf of a caller that has to wait for them */
+static void airbrake_client_drive(airbrake_client_t *client, long timeout_ms)
+{
+    airbrake_client_opaque_t *priv = client->priv;
+    size_t n = priv->watches_count, i;
+    struct pollfd *pfds = 0;
+    int ready;
+
+    if (priv->multi_timeout_at >= 0) {
+        long until_timer = priv->multi_timeout_at - airbrake_now_ms();
+        if (until_timer < timeout_ms)
+            timeout_ms = until_timer > 0 ? until_timer: 0;
+    }
+    if (n > 0) {
+        /* the watch list changes under socket_action */
+        pfds = airbrake_malloc(sizeof(struct pollfd) * n);
+        if (!pfds)
+            return;
+        memcpy(pfds, priv->watches, sizeof(struct pollfd) * n);
+    }
+    ready = poll(pfds, n, (int)timeout_ms);
+    if (ready <= 0) {
+        airbrake_client_socket_action(client, AIRBRAKE_SOCKET_TIMEOUT, 0);
+    } else {
+        for (i = 0; i < n; i++) {
+            int events = 0;
+            if (!pfds[i].revents)
+                continue;
+            if (pfds[i].revents & POLLIN)
+                events |= AIRBRAKE_POLL_IN;
+            if (pfds[i].revents & POLLOUT)
+                events |= AIRBRAKE_POLL_OUT;
+            if (pfds[i].revents & (POLLERR | POLLHUP))
+                events |= AIRBRAKE_POLL_ERROR;
+            airbrake_client_socket_action(client, pfds[i].fd, events);
+        }
+    }
+    airbrake_free(pfds);
+}
+
+/* returns non-zero when no room for bytes could be made within the block timeout */
+static int airbrake_client_wait_for_room(airbrake_client_t *client, size_t bytes)
+{
+    airbrake_client_opaque_t *priv = client->priv;
+    long deadline = airbrake_now_ms() + priv->block_timeout_ms;
+
+    if (priv->batch.n > 0 && priv->queued_bytes + bytes > priv->queue_limit)
+        airbrake_client_flush_batch(client);
+    while (priv->queued_bytes + bytes > priv->queue_limit) {
+        long remaining = deadline - airbrake_now_ms();
+        if (remaining <= 0 || !priv->multi || !priv->transfers_in_flight)
+            return 1;
+        airbrake_client_drive(client, remaining);
+    }
+    return 0;
+}
+
+/*
+ * Applies the backpressure policy to a notice about to be queued.  Returns
+ * AIRBRAKE_OK when it may be queued, AIRBRAKE_ERROR_SPILLED when it went to
+ * the spill file instead and AIRBRAKE_ERROR_QUEUE_FULL when it was dropped.
+ */
+static airbrake_error_t airbrake_client_admit(airbrake_client_t *client, const airbrake_string_t *xml)
+{
+    airbrake_client_opaque_t *priv = client->priv;
+
+    if (!priv->queue_limit || priv->queued_bytes + xml->l <= priv->queue_limit)
+        return AIRBRAKE_OK;
+
+    switch (priv->backpressure) {
+    case AIRBRAKE_BACKPRESSURE_DROP_OLDEST:
+        if (xml->l > priv->queue_limit)
+            break;
+        while (priv->queued_bytes + xml->l > priv->queue_limit && airbrake_client_evict_oldest(priv));
+        return AIRBRAKE_OK;
+    case AIRBRAKE_BACKPRESSURE_SPILL:
+        if (!airbrake_client_spill(priv, xml))
+            return AIRBRAKE_ERROR_SPILLED;
+        break;
+    case AIRBRAKE_BACKPRESSURE_BLOCK:
+        if (xml->l <= priv->queue_limit && !airbrake_client_wait_for_room(client, xml->l))
+            return AIRBRAKE_OK;
+        break;
+    default:
+        break;
+    }
+    airbrake_client_drop(priv, 0, xml->l);
+    return AIRBRAKE_ERROR_QUEUE_FULL;
+}
+
+void airbrake_client_set_queue_limit(airbrake_client_t *client, size_t max_bytes)
+{
+    client->priv->queue_limit = max_bytes;
+}
+
+airbrake_error_t airbrake_client_set_backpressure(airbrake_client_t *client, airbrake_backpressure_t policy, airbrake_string_t spill_path, long block_timeout_ms)
+{
+    airbrake_error_t err;
+    airbrake_client_opaque_t *priv = client->priv;
+
+    if (policy == AIRBRAKE_BACKPRESSURE_SPILL && !spill_path.l)
+        return AIRBRAKE_ERROR_UNKNOWN;
+    if (priv->spill_fd >= 0) {
+        close(priv->spill_fd);
+        priv->spill_fd = -1;
+    }
+    if (spill_path.l) {
+        err = airbrake_string_assign(&priv->spill_path, spill_path);
         if (err)
             return err;
-        err = airbrake_string_append(buf, airbrake_string_static_z(
-                "</action>"));
+    }
+    priv->backpressure = policy;
+    priv->block_timeout_ms = block_timeout_ms > 0 ? block_timeout_ms: 0;
+    return AIRBRAKE_OK;
+}
+
+void airbrake_client_set_drop_callback(airbrake_client_t *client, airbrake_drop_func_t drop_func, void *ctx)
+{
+    client->priv->drop_func = drop_func;
+    client->priv->drop_ctx = ctx;
+}
+
+size_t airbrake_client_queued_bytes(airbrake_client_t *client)
+{
+    size_t queued_bytes;
+
+    pthread_mutex_lock(&client->priv->stats_mutex);
+    queued_bytes = client->priv->queued_bytes;
+    pthread_mutex_unlock(&client->priv->stats_mutex);
+    return queued_bytes;
+}
+
+/* moves everything from offset on into a fresh spill file */
+static airbrake_error_t airbrake_client_compact_spill(airbrake_client_opaque_t *priv, int fd, off_t offset)
+{
+    airbrake_error_t err = AIRBRAKE_OK;
+    airbrake_string_t tmp_path = { 0, 0, 0, 0, 0, 0 };
+    char chunk[65536];
+    int tmp_fd;
+    ssize_t n;
+
+    err = airbrake_string_init_c(&tmp_path, &priv->spill_path);
+    if (!err)
+        err = airbrake_string_append(&tmp_path, airbrake_string_static_z(".tmp"));
+    if (err)
+        goto out;
+    tmp_fd = open(tmp_path.p, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (tmp_fd < 0) {
+        err = AIRBRAKE_ERROR_UNKNOWN;
+        goto out;
+    }
+    while ((n = pread(fd, chunk, sizeof(chunk), offset)) > 0) {
+        if (write(tmp_fd, chunk, n) != n) {
+            err = AIRBRAKE_ERROR_UNKNOWN;
+            break;
+        }
+        offset += n;
+    }
+    if (n < 0)
+        err = AIRBRAKE_ERROR_UNKNOWN;
+    if (close(tmp_fd) && !err)
+        err = AIRBRAKE_ERROR_UNKNOWN;
+    if (!err && rename(tmp_path.p, priv->spill_path.p))
+        err = AIRBRAKE_ERROR_UNKNOWN;
+    if (err)
+        unlink(tmp_path.p);
+out:
+    airbrake_string_fini(&tmp_path);
+    return err;
+}
+
+/*
+ * Submits the notices written to the spill file, synchronously and in
+ * order.  Stops at the first one the endpoints cannot take and keeps it and
+ * everything after it for the next call.
+ */
+airbrake_error_t airbrake_client_replay_spill(airbrake_client_t *client)
+{
+    airbrake_error_t err = AIRBRAKE_OK;
+    airbrake_client_opaque_t *priv = client->priv;
+    airbrake_string_t *buf;
+    off_t offset = 0;
+    int fd;
+
+    if (!priv->spill_path.p)
+        return AIRBRAKE_ERROR_UNKNOWN;
+    if (priv->spill_fd >= 0) {
+        close(priv->spill_fd);
+        priv->spill_fd = -1;
+    }
+    fd = open(priv->spill_path.p, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT ? AIRBRAKE_OK: AIRBRAKE_ERROR_UNKNOWN;
+
+    buf = airbrake_client_buffer_acquire(&priv->request_buf);
+    for (;;) {
+        airbrake_notice_result_t result;
+        unsigned char header[4];
+        size_t frame_len;
+
+        /* a short read here is the end of the file or a torn last frame */
+        if (pread(fd, header, sizeof(header), offset) != sizeof(header))
+            break;
+        frame_len = ((size_t)header[0] << 24) | ((size_t)header[1] << 16) | ((size_t)header[2] << 8) | header[3];
+        err = airbrake_string_grow(buf, frame_len + 1);
         if (err)
+            break;
+        if (pread(fd, buf->p, frame_len, offset + sizeof(header)) != (ssize_t)frame_len)
+            break;
+        buf->l = frame_len;
+        err = airbrake_client_post(client, &result, buf);
+        if (!err)
+            airbrake_notice_result_fini(&result);
+        if (err == AIRBRAKE_ERROR_WOULD_BLOCK || airbrake_endpoint_failover_error(err))
+            break;
+        err = AIRBRAKE_OK;
+        offset += sizeof(header) + frame_len;
+    }
+    airbrake_client_buffer_release(&priv->request_buf, priv->buffer_limit);
+
+    if (err) {
+        airbrake_error_t compact_err = offset > 0 ? airbrake_client_compact_spill(priv, fd, offset): AIRBRAKE_OK;
+        close(fd);
+        return compact_err ? compact_err: err;
+    }
+    close(fd);
+    unlink(priv->spill_path.p);
+    return AIRBRAKE_OK;
+}
+
+void airbrake_client_fini(airbrake_client_t *client)
+{
+    /* nothing may block with an event loop attached, so its pending batch goes the way of its transfers */
+    if (client->priv->multi)
+        airbrake_client_abandon_batch(client->priv);
+    else
+        airbrake_client_flush_batch(client);
+    airbrake_client_opaque_fini(&client->priv);
+    airbrake_string_fini(&client->notice_endpoint);
+    airbrake_string_fini(&client->api_key);
+}
+
+airbrake_error_t airbrake_client_acquire_notice(airbrake_client_t *client, airbrake_notice_slot_t **retval)
+{
+    airbrake_error_t err;
+    airbrake_client_opaque_t *priv = client->priv;
+    airbrake_notice_slot_t *slot;
+
+    pthread_mutex_lock(&priv->notice_pool_mutex);
+    slot = priv->notice_pool;
+    if (slot) {
+        priv->notice_pool = slot->next;
+        priv->notice_pool_size--;
+    }
+    pthread_mutex_unlock(&priv->notice_pool_mutex);
+
+    if (!slot) {
+        slot = airbrake_malloc(sizeof(airbrake_notice_slot_t));
+        if (!slot)
+            return AIRBRAKE_ERROR_MEM;
+        err = airbrake_notice_slot_init(slot);
+        if (err) {
+            airbrake_free(slot);
             return err;
+        }
+    }
+    slot->next = 0;
+    *retval = slot;
+    return AIRBRAKE_OK;
+}
+
+void airbrake_client_release_notice(airbrake_client_t *client, airbrake_notice_slot_t *slot)
+{
+    airbrake_client_opaque_t *priv = client->priv;
+
+    airbrake_notice_slot_clear(slot);
+    pthread_mutex_lock(&priv->notice_pool_mutex);
+    /* a pooled slot keeps its buffers, so one outsized notice could pin
+     * the static arena; give them back once half of it is in use */
+    if (!airbrake_static_pressure(2) && priv->notice_pool_size < AIRBRAKE_NOTICE_POOL_MAX) {
+        slot->next = priv->notice_pool;
+        priv->notice_pool = slot;
+        priv->notice_pool_size++;
+        slot = 0;
     }
+    pthread_mutex_unlock(&priv->notice_pool_mutex);
 
-    err = airbrake_client_build_notice_xml_params(&request->params, "params", buf);
-    if (err)
-        return err;
+    if (slot) {
+        airbrake_notice_slot_fini(slot);
+        airbrake_free(slot);
+    }
+}
+
+void airbrake_client_set_fire_and_forget(airbrake_client_t *client, int enabled)
+{
+    client->priv->fire_and_forget = enabled;
+}
+
+void airbrake_client_get_stats(airbrake_client_t *client, airbrake_client_stats_t *stats)
+{
+    pthread_mutex_lock(&client->priv->stats_mutex);
+    *stats = client->priv->stats;
+    pthread_mutex_unlock(&client->priv->stats_mutex);
+}
+
+void airbrake_client_set_buffer_limit(airbrake_client_t *client, size_t limit)
+{
+    client->priv->buffer_limit = limit;
+}
+
+airbrake_intern_table_t *airbrake_client_get_intern_table(airbrake_client_t *client)
+{
+    return client->priv->intern_table;
+}
+
+/*
+ * Shared-memory notice ring.
+ *
+ * The mapping is a header followed by fixed-size slots, used as a bounded
+ * multi-producer queue: each slot carries a sequence number that tells
+ * whether it is free for the writer at a given position (seq == pos),
+ * published (seq == pos + 1) or recycled for the next lap (seq == pos +
+ * nslots).  Writers claim a position with a compare-and-swap on head, copy
+ * an encoded notice record in and publish it; the collector, of which
+ * there must be only one, reads published records in place and recycles
+ * the slots.
+ *
+ * A writer that dies between claiming and publishing leaves its slot
+ * unpublished forever.  Each writer stores its pid in the slot right after
+ * the claim, and the collector skips a slot whose writer no longer exists,
+ * or that has stayed unpublished for AIRBRAKE_RING_STALE_MS.  Publishing
+ * is a compare-and-swap too, so a writer that was given up on cannot
+ * publish into a slot that has since been recycled, but its copy may still
+ * land on top of the next writer's.  Each record therefore carries a
+ * checksum seeded with its position, and the collector copies the record
+ * out of the ring and checks the copy before decoding it; a record that
+ * was overwritten or changes while being copied is dropped.
+ */
+#define AIRBRAKE_RING_MAGIC 0x41425247UL
+#define AIRBRAKE_RING_VERSION 2
+#define AIRBRAKE_RING_CACHE_LINE 64
+
+typedef struct airbrake_ring_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nslots;
+    uint32_t slot_size;
+    char pad0[AIRBRAKE_RING_CACHE_LINE - 16];
+    uint64_t head;
+    char pad1[AIRBRAKE_RING_CACHE_LINE - 8];
+    uint64_t tail;
+    uint64_t dropped;
+    uint64_t abandoned;
+    char pad2[AIRBRAKE_RING_CACHE_LINE - 24];
+} airbrake_ring_header_t;
+
+typedef struct airbrake_ring_slot_t {
+    uint64_t seq;
+    uint32_t pid;
+    uint32_t len;
+    uint32_t sum;
+    uint32_t pad;
+} airbrake_ring_slot_t;
+
+struct airbrake_ring_t {
+    airbrake_ring_header_t *header;
+    size_t map_size;
+    uint64_t stuck_pos;
+    long stuck_since_ms;
+    /* the collector's private copy of the record being drained */
+    airbrake_string_t record;
+};
+
+static airbrake_ring_slot_t *airbrake_ring_slot(airbrake_ring_t *ring, uint64_t pos)
+{
+    return (airbrake_ring_slot_t *)((char *)(ring->header + 1) + (size_t)(pos % ring->header->nslots) * ring->header->slot_size);
+}
+
+/* FNV-1a over the position and the record */
+static uint32_t airbrake_ring_checksum(uint64_t pos, const char *p, size_t len)
+{
+    uint32_t h = 2166136261u;
+    size_t i;
 
-    err = airbrake_client_build_notice_xml_params(&request->session, "session", buf);
-    if (err)
-        return err;
+    for (i = 0; i < sizeof(pos); i++) {
+        h ^= (unsigned char)(pos >> (i * 8));
+        h *= 16777619u;
+    }
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
 
-    err = airbrake_client_build_notice_xml_params(&request->cgi_data, "cgi-data", buf);
-    if (err)
-        return err;
+static airbrake_error_t airbrake_ring_map(airbrake_ring_t **retval, int fd, size_t map_size)
+{
+    airbrake_ring_t *ring;
+    void *p;
 
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-          "</request>"));
-    return err;
+    ring = malloc(sizeof(airbrake_ring_t));
+    if (!ring)
+        return AIRBRAKE_ERROR_MEM;
+    p = mmap(0, map_size, PROT_READ | PROT_WRITE, fd >= 0 ? MAP_SHARED: MAP_SHARED | MAP_ANONYMOUS, fd, 0);
+    if (p == MAP_FAILED) {
+        free(ring);
+        return AIRBRAKE_ERROR_MEM;
+    }
+    ring->header = p;
+    ring->map_size = map_size;
+    ring->stuck_pos = (uint64_t)-1;
+    ring->stuck_since_ms = 0;
+    ring->record = airbrake_string_null;
+    *retval = ring;
+    return AIRBRAKE_OK;
 }
 
-static airbrake_error_t airbrake_client_build_notice_xml_server_environment(const airbrake_environment_info_t *environment, airbrake_string_t *buf)
+/*
+ * Creates a ring.  With a null name the mapping is anonymous and reaches
+ * other processes only through fork(), which is the usual prefork setup;
+ * otherwise it is a POSIX shared memory object that unrelated processes can
+ * attach to with airbrake_ring_open().
+ */
+airbrake_error_t airbrake_ring_init(airbrake_ring_t **retval, airbrake_string_t name, size_t nslots, size_t slot_size)
 {
     airbrake_error_t err;
+    airbrake_ring_header_t *header;
+    size_t map_size, i;
+    int fd = -1;
 
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-          "<server-environment>"));
-    if (environment->project_root.p) {
-        err = airbrake_string_append(buf, airbrake_string_static_z(
-                "<project-root>"));
-        if (err)
-            return err;
-        err = airbrake_string_append_xml_escape(buf, &environment->project_root);
+    if (!nslots)
+        nslots = AIRBRAKE_RING_DEFAULT_SLOTS;
+    if (!slot_size)
+        slot_size = AIRBRAKE_RING_DEFAULT_SLOT_SIZE;
+    /* slots stay 8-byte aligned for the sequence numbers */
+    slot_size = (slot_size + 7) & ~(size_t)7;
+    if (slot_size <= sizeof(airbrake_ring_slot_t) + AIRBRAKE_NOTICE_RECORD_HEADER_SIZE || nslots > 0xffffffffUL || slot_size > 0xffffffffUL)
+        return AIRBRAKE_ERROR_UNKNOWN;
+    map_size = sizeof(airbrake_ring_header_t) + nslots * slot_size;
+
+    if (name.p) {
+        fd = shm_open(name.p, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0)
+            return AIRBRAKE_ERROR_UNKNOWN;
+        if (ftruncate(fd, map_size)) {
+            close(fd);
+            shm_unlink(name.p);
+            return AIRBRAKE_ERROR_MEM;
+        }
+    }
+    err = airbrake_ring_map(retval, fd, map_size);
+    if (fd >= 0) {
+        close(fd);
         if (err)
-            return err;
-        err = airbrake_string_append(buf, airbrake_string_static_z(
-                "</project-root>"));
+            shm_unlink(name.p);
     }
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-        "<environment-name>"));
-    if (err)
-        return err;
-    err = airbrake_string_append_xml_escape(buf, &environment->environment_name);
     if (err)
         return err;
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-            "</environment-name>"));
 
-    if (environment->app_version.p) {
-        err = airbrake_string_append(buf, airbrake_string_static_z(
-                "<app-version>"));
-        if (err)
-            return err;
-        err = airbrake_string_append_xml_escape(buf, &environment->app_version);
-        if (err)
-            return err;
-        err = airbrake_string_append(buf, airbrake_string_static_z(
-                "</app-version>"));
+    header = (*retval)->header;
+    header->nslots = nslots;
+    header->slot_size = slot_size;
+    header->head = 0;
+    header->tail = 0;
+    header->dropped = 0;
+    header->abandoned = 0;
+    for (i = 0; i < nslots; i++) {
+        airbrake_ring_slot_t *slot = airbrake_ring_slot(*retval, i);
+        slot->seq = i;
+        slot->pid = 0;
+        slot->len = 0;
+        slot->sum = 0;
     }
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-          "</server-environment>"));
-    return err;
+    header->version = AIRBRAKE_RING_VERSION;
+    __atomic_store_n(&header->magic, AIRBRAKE_RING_MAGIC, __ATOMIC_RELEASE);
+    return AIRBRAKE_OK;
 }
 
-airbrake_error_t airbrake_client_build_notice_xml(airbrake_client_t *client, airbrake_string_t *buf, const airbrake_notice_t *notice)
+airbrake_error_t airbrake_ring_open(airbrake_ring_t **retval, airbrake_string_t name)
 {
     airbrake_error_t err;
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-        "<?xml version=\"1.0\" ?>"
-        "<notice version=\"2.0\">"
-          "<api-key>"));
-    if (err)
-        return err;
-    err = airbrake_string_append_xml_escape(buf, &client->api_key);
-    if (err)
-        return err;
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-          "</api-key>"));
-    if (err)
-        return err;
-    err = airbrake_client_build_notice_xml_notifier(client->info, buf);
-    if (err)
-        return err;
+    airbrake_ring_header_t *header;
+    struct stat st;
+    int fd;
 
-    err = airbrake_client_build_notice_xml_error(notice->exception, buf);
+    if (!name.p)
+        return AIRBRAKE_ERROR_UNKNOWN;
+    fd = shm_open(name.p, O_RDWR, 0);
+    if (fd < 0)
+        return AIRBRAKE_ERROR_UNKNOWN;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(airbrake_ring_header_t)) {
+        close(fd);
+        return AIRBRAKE_ERROR_INVALID_RECORD;
+    }
+    err = airbrake_ring_map(retval, fd, st.st_size);
+    close(fd);
     if (err)
         return err;
 
-    if (notice->request) {
-        err = airbrake_client_build_notice_xml_request(notice->request, buf);
-        if (err)
-            return err;
+    header = (*retval)->header;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != AIRBRAKE_RING_MAGIC
+            || header->version != AIRBRAKE_RING_VERSION
+            || header->nslots == 0
+            || header->slot_size <= sizeof(airbrake_ring_slot_t) + AIRBRAKE_NOTICE_RECORD_HEADER_SIZE
+            || (header->slot_size & 7)
+            || sizeof(airbrake_ring_header_t) + (size_t)header->nslots * header->slot_size > (size_t)st.st_size) {
+        airbrake_ring_fini(retval);
+        return AIRBRAKE_ERROR_INVALID_RECORD;
     }
+    return AIRBRAKE_OK;
+}
+
+void airbrake_ring_fini(airbrake_ring_t **ring)
+{
+    munmap((*ring)->header, (*ring)->map_size);
+    airbrake_string_fini(&(*ring)->record);
+    free(*ring);
+    *ring = 0;
+}
+
+airbrake_error_t airbrake_ring_unlink(airbrake_string_t name)
+{
+    if (!name.p || shm_unlink(name.p))
+        return AIRBRAKE_ERROR_UNKNOWN;
+    return AIRBRAKE_OK;
+}
+
+/* never blocks: a full ring drops the notice and counts it */
+airbrake_error_t airbrake_ring_write(airbrake_ring_t *ring, const airbrake_notice_t *notice)
+{
+    airbrake_error_t err;
+    airbrake_ring_header_t *header = ring->header;
+    airbrake_string_t record = { 0, 0, 0, 0, 0, 0 };
+    airbrake_ring_slot_t *slot;
+    uint64_t pos, expected;
 
-    err = airbrake_client_build_notice_xml_server_environment(notice->environment, buf);
+    /* encoded outside the ring so that a failed encode never holds a slot */
+    err = airbrake_notice_encode(&record, notice);
     if (err)
-        return err;
+        goto out;
+    if (record.l > header->slot_size - sizeof(airbrake_ring_slot_t)) {
+        err = AIRBRAKE_ERROR_TOO_LARGE;
+        goto out;
+    }
 
-    err = airbrake_string_append(buf, airbrake_string_static_z(
-        "</notice>"));
+    pos = __atomic_load_n(&header->head, __ATOMIC_RELAXED);
+    for (;;) {
+        int64_t diff;
+        slot = airbrake_ring_slot(ring, pos);
+        diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&header->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            __atomic_fetch_add(&header->dropped, 1, __ATOMIC_RELAXED);
+            err = AIRBRAKE_ERROR_QUEUE_FULL;
+            goto out;
+        } else {
+            pos = __atomic_load_n(&header->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    __atomic_store_n(&slot->pid, (uint32_t)getpid(), __ATOMIC_RELAXED);
+    slot->len = record.l;
+    slot->sum = airbrake_ring_checksum(pos, record.p, record.l);
+    memcpy(slot + 1, record.p, record.l);
+    expected = pos;
+    if (!__atomic_compare_exchange_n(&slot->seq, &expected, pos + 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        err = AIRBRAKE_ERROR_QUEUE_FULL;
+out:
+    airbrake_string_fini(&record);
     return err;
 }
 
-airbrake_error_t airbrake_client_submit_notice(airbrake_client_t *client, airbrake_notice_result_t *result, const airbrake_notice_t *notice)
+/* decides whether the unpublished slot at pos has been abandoned by its writer */
+static int airbrake_ring_slot_abandoned(airbrake_ring_t *ring, airbrake_ring_slot_t *slot, uint64_t pos)
 {
-    airbrake_error_t err = AIRBRAKE_OK;
-    airbrake_string_t buf = { 0, 0, 0 };
-
-    result->error_id.p = 0;
-    result->url.p = 0;
-    result->id.p = 0;
+    uint32_t pid = __atomic_load_n(&slot->pid, __ATOMIC_RELAXED);
+    long now = airbrake_now_ms();
 
-    err = airbrake_client_build_notice_xml(client, &buf, notice);
-    if (err) {
-        airbrake_string_fini(&buf);
-        return err;
+    if (pid && kill((pid_t)pid, 0) && errno == ESRCH)
+        return 1;
+    if (ring->stuck_pos != pos) {
+        ring->stuck_pos = pos;
+        ring->stuck_since_ms = now;
+        return 0;
     }
+    return now - ring->stuck_since_ms >= AIRBRAKE_RING_STALE_MS;
+}
 
-    {
-        CURL *curl = client->priv->curl;
-        airbrake_string_t out_buf = { 0, 0, 0 };
-        airbrake_curl_writer_t writer = { &out_buf };
-        xmlParserCtxtPtr parser = 0;
-        xmlDocPtr doc = 0;
-        const char *content_type_header_value;
-        long http_status_code;
-        airbrake_string_t content_type = { 0, 0, 0 };
-        airbrake_string_t charset = { 0, 0, 0 };
-
-        curl_easy_setopt(curl, CURLOPT_URL, client->notice_endpoint.p);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, buf.p);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, buf.l);
-        curl_easy_setopt(curl, CURLOPT_POST, 1);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, airbrake_curl_writer_func);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &writer);
-        if (curl_easy_perform(curl)) {
-            err = AIRBRAKE_ERROR_NETWORK_FAILURE;
-            goto out_inner;
-        }
+static void airbrake_ring_recycle(airbrake_ring_t *ring, airbrake_ring_slot_t *slot, uint64_t pos)
+{
+    airbrake_ring_header_t *header = ring->header;
 
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_status_code);
-        curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &content_type_header_value);
-        if (content_type_header_value) {
-            do {
-                const char *p = content_type_header_value, *q;
-                size_t l;
-
-                while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
-                if (!*p)
-                    break;
-                content_type.p = (char *)p;
-
-                while (*p && *p != ';' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') p++;
-                content_type.l = p - content_type.p;
-
-                while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
-                if (*p != ';')
-                    break;
-                p++;
-                while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
-                if (!*p)
-                    break;
-
-                l = strlen(p);
-                if (l <= 8 || memcmp(p, "charset", 7) != 0)
-                    break;
-                p += 7;
-                while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
-                if (*p != '=')
-                    break;
-                p++;
-                while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
-                if (*p)
-                    break;
-                q = p;
-                while (*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') p++;
-                l = p - charset.p;
-                err = airbrake_string_init(&charset, q, l);
-                if (err)
-                    goto out_inner;
-            } while (0);
-        }
-
-        if (!(content_type.l == 8 && memcmp("text/xml", content_type.p, 8) == 0) &&
-            !(content_type.l == 9 && memcmp("application/xml", content_type.p, 15) == 0)) {
-            err = AIRBRAKE_ERROR_INVALID_RESPONSE;
-            goto out_inner;
+    slot->pid = 0;
+    slot->len = 0;
+    slot->sum = 0;
+    __atomic_store_n(&slot->seq, pos + header->nslots, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->tail, pos + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Submits up to max_notices published notices (0 for no limit) through the
+ * client, in ring order.  Stops early at a slot that is still being
+ * written.  A notice that fails to submit is not retried.
+ */
+airbrake_error_t airbrake_ring_drain(airbrake_ring_t *ring, airbrake_client_t *client, size_t max_notices, size_t *drained)
+{
+    airbrake_error_t err = AIRBRAKE_OK;
+    airbrake_ring_header_t *header = ring->header;
+    size_t n = 0;
+
+    while (!max_notices || n < max_notices) {
+        uint64_t pos = __atomic_load_n(&header->tail, __ATOMIC_RELAXED);
+        airbrake_ring_slot_t *slot = airbrake_ring_slot(ring, pos);
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == pos) {
+            uint64_t expected = pos;
+            if (__atomic_load_n(&header->head, __ATOMIC_RELAXED) == pos)
+                break;
+            if (!airbrake_ring_slot_abandoned(ring, slot, pos))
+                break;
+            /* the writer may publish at the last moment, in which case the slot is read as usual */
+            if (__atomic_compare_exchange_n(&slot->seq, &expected, pos + header->nslots, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                slot->pid = 0;
+                __atomic_fetch_add(&header->abandoned, 1, __ATOMIC_RELAXED);
+                __atomic_store_n(&header->tail, pos + 1, __ATOMIC_RELEASE);
+                continue;
+            }
+            seq = expected;
         }
+        if (seq != pos + 1)
+            break;
 
-        parser = xmlNewParserCtxt();
-        if (!parser) {
-            err = AIRBRAKE_ERROR_MEM;
-            goto out_inner;
+        {
+            airbrake_notice_reader_t reader;
+            airbrake_notice_record_t record;
+            airbrake_string_t *buf = airbrake_client_buffer_acquire(&client->priv->request_buf);
+            size_t len = __atomic_load_n(&slot->len, __ATOMIC_RELAXED);
+            uint32_t sum = __atomic_load_n(&slot->sum, __ATOMIC_RELAXED);
+
+            /* a writer that was given up on may still be copying into the
+             * slot, so only a private copy that matches its checksum is decoded */
+            if (len > header->slot_size - sizeof(airbrake_ring_slot_t))
+                len = 0;
+            ring->record.l = 0;
+            err = airbrake_string_append(&ring->record, airbrake_string_static((const char *)(slot + 1), len));
+            if (!err && airbrake_ring_checksum(pos, ring->record.p, ring->record.l) != sum)
+                err = AIRBRAKE_ERROR_INVALID_RECORD;
+            if (!err) {
+                airbrake_notice_reader_init(&reader, ring->record.p, ring->record.l);
+                err = airbrake_notice_reader_next(&reader, &record);
+            }
+            if (!err)
+                err = airbrake_client_build_notice_xml_record(client, buf, &record);
+            if (!err) {
+                airbrake_notice_result_t result;
+                if (!airbrake_client_post(client, &result, buf))
+                    airbrake_notice_result_fini(&result);
+            }
+            airbrake_client_buffer_release(&client->priv->request_buf, client->priv->buffer_limit);
         }
+        airbrake_ring_recycle(ring, slot, pos);
+        n++;
+        if (err == AIRBRAKE_ERROR_MEM)
+            break;
+        err = AIRBRAKE_OK;
+    }
+    if (drained)
+        *drained = n;
+    return err;
+}
 
-        doc = xmlCtxtReadDoc(parser, out_buf.p, 0, charset.p, 0);
-        if (!doc) {
-            err = AIRBRAKE_ERROR_INVALID_RESPONSE;
-            goto out_inner;
+void airbrake_ring_get_stats(airbrake_ring_t *ring, airbrake_ring_stats_t *stats)
+{
+    airbrake_ring_header_t *header = ring->header;
+    uint64_t head = __atomic_load_n(&header->head, __ATOMIC_RELAXED);
+    uint64_t tail = __atomic_load_n(&header->tail, __ATOMIC_RELAXED);
+
+    stats->pending = head > tail ? head - tail: 0;
+    stats->dropped = __atomic_load_n(&header->dropped, __ATOMIC_RELAXED);
+    stats->abandoned = __atomic_load_n(&header->abandoned, __ATOMIC_RELAXED);
+}
+
+/*
+ * Staged submission.  The caller's thread only captures the notice into an
+ * encoded record; a pool of serialize workers turns records into XML, an
+ * optional compress stage gzips it, and a few transmit workers, each with
+ * its own handle, keep transfers in flight.  The stages are joined by
+ * bounded queues, and the later stages wait for room, so a slow network
+ * holds back serialization rather than piling up XML.
+ *
+ * Capture goes through the client's backpressure policy: each job is
+ * charged its encoded record against the queue limit until it completes,
+ * and a full serialize queue counts as being out of room too.  Dropped and
+ * evicted notices show up in the client's stats and drop callback just as
+ * they do for the client's own queue.
+ *
+ * The pipeline owns the client while it exists; completions run on the
+ * transmit workers.
+ */
+typedef struct airbrake_pipeline_job_t airbrake_pipeline_job_t;
+
+struct airbrake_pipeline_job_t {
+    airbrake_pipeline_job_t *next;
+    airbrake_string_t record;
+    airbrake_string_t xml;
+    airbrake_string_t compressed;
+    const airbrake_string_t *body;
+    size_t bytes;
+    unsigned long seq;
+    airbrake_error_t err;
+    airbrake_notice_result_t result;
+    airbrake_completion_func_t completion_func;
+    void *completion_ctx;
+};
+
+typedef struct airbrake_pipeline_queue_t {
+    airbrake_pipeline_job_t *first;
+    airbrake_pipeline_job_t *last;
+    size_t n;
+    size_t cap;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    unsigned long processed;
+    unsigned long failed;
+} airbrake_pipeline_queue_t;
+
+typedef struct airbrake_pipeline_worker_t {
+    airbrake_pipeline_t *pipeline;
+    airbrake_pipeline_stage_t stage;
+    pthread_t thread;
+    CURL *curl;
+    airbrake_string_t response;
+} airbrake_pipeline_worker_t;
+
+struct airbrake_pipeline_t {
+    airbrake_client_t *client;
+    pthread_mutex_t mutex;
+    pthread_cond_t idle;
+    pthread_cond_t room;
+    airbrake_pipeline_queue_t queues[AIRBRAKE_PIPELINE_STAGES];
+    airbrake_pipeline_job_t *spare_jobs;
+    airbrake_pipeline_worker_t *workers;
+    size_t workers_count;
+    size_t in_flight;
+    int compress;
+    int stopping;
+    long started_ms;
+    struct curl_slist *headers;
+};
+
+static void airbrake_pipeline_push(airbrake_pipeline_queue_t *queue, airbrake_pipeline_job_t *job)
+{
+    job->next = 0;
+    if (queue->last)
+        queue->last->next = job;
+    else
+        queue->first = job;
+    queue->last = job;
+    queue->n++;
+    pthread_cond_signal(&queue->not_empty);
+}
+
+static airbrake_pipeline_job_t *airbrake_pipeline_pop(airbrake_pipeline_queue_t *queue)
+{
+    airbrake_pipeline_job_t *job = queue->first;
+
+    queue->first = job->next;
+    if (!queue->first)
+        queue->last = 0;
+    queue->n--;
+    pthread_cond_signal(&queue->not_full);
+    return job;
+}
+
+static void airbrake_pipeline_job_free(airbrake_pipeline_job_t *job)
+{
+    airbrake_string_fini(&job->record);
+    airbrake_string_fini(&job->xml);
+    airbrake_string_fini(&job->compressed);
+    airbrake_free(job);
+}
+
+/* runs one stage on a job and returns the stage it goes to next, or AIRBRAKE_PIPELINE_STAGES when it is done */
+static airbrake_pipeline_stage_t airbrake_pipeline_run(airbrake_pipeline_worker_t *worker, airbrake_pipeline_job_t *job)
+{
+    airbrake_pipeline_t *pipeline = worker->pipeline;
+    airbrake_client_t *client = pipeline->client;
+
+    switch (worker->stage) {
+    case AIRBRAKE_PIPELINE_SERIALIZE: {
+        airbrake_notice_reader_t reader;
+        airbrake_notice_record_t record;
+
+        airbrake_notice_reader_init(&reader, job->record.p, job->record.l);
+        job->xml.l = 0;
+        job->err = airbrake_notice_reader_next(&reader, &record);
+        if (!job->err)
+            job->err = airbrake_client_build_notice_xml_record(client, &job->xml, &record);
+        if (job->err)
+            return AIRBRAKE_PIPELINE_STAGES;
+        job->body = &job->xml;
+        return pipeline->compress ? AIRBRAKE_PIPELINE_COMPRESS: AIRBRAKE_PIPELINE_TRANSMIT;
+    }
+    case AIRBRAKE_PIPELINE_COMPRESS:
+        job->err = airbrake_gzip(&job->compressed, &job->xml);
+        if (job->err)
+            return AIRBRAKE_PIPELINE_STAGES;
+        job->body = &job->compressed;
+        return AIRBRAKE_PIPELINE_TRANSMIT;
+    case AIRBRAKE_PIPELINE_TRANSMIT:
+        job->result.error_id.p = 0;
+        job->result.url.p = 0;
+        job->result.id.p = 0;
+        if (client->priv->transport == AIRBRAKE_TRANSPORT_UNIX) {
+            AIRBRAKE_PROBE2(transfer__start, 0, job->body->l);
+            job->err = airbrake_client_post_unix(client, job->body);
+            AIRBRAKE_PROBE3(transfer__done, 0, 0, job->err);
+        } else {
+            job->err = airbrake_client_perform(client, worker->curl, &worker->response, &job->result, job->body);
         }
+        return AIRBRAKE_PIPELINE_STAGES;
+    default:
+        return AIRBRAKE_PIPELINE_STAGES;
+    }
+}
 
-        switch (http_status_code) {
-        case 200:
-            {
-                xmlNodePtr root_node = xmlDocGetRootElement(doc);
-                xmlNodePtr node;
-                if (strcmp(root_node->name, "notice") != 0) {
-                    err = AIRBRAKE_ERROR_INVALID_RESPONSE;
-                    goto out_inner;
-                }
-                for (node = root_node->children; node; node = node->next) {
-                    if (node->type != XML_ELEMENT_NODE)
-                        continue;
-                    if (strcmp(node->name, "error-id") == 0) {
-                        if (!node->children || node->children->type != XML_TEXT_NODE) {
-                            err = AIRBRAKE_ERROR_INVALID_RESPONSE;
-                            goto out_inner;
-                        }
-                        airbrake_string_init(&result->error_id, node->children->content, strlen(node->children->content));
-                    } else if (strcmp(node->name, "url") == 0) {
-                        if (!node->children || node->children->type != XML_TEXT_NODE) {
-                            err = AIRBRAKE_ERROR_INVALID_RESPONSE;
-                            goto out_inner;
-                        }
-                        airbrake_string_init(&result->url, node->children->content, strlen(node->children->content));
-                    } else if (strcmp(node->name, "id") == 0) {
-                        if (!node->children || node->children->type != XML_TEXT_NODE) {
-                            err = AIRBRAKE_ERROR_INVALID_RESPONSE;
-                            goto out_inner;
-                        }
-                        airbrake_string_init(&result->id, node->children->content, strlen(node->children->content));
-                    }
+/* spare jobs keep their buffers unless they grew past the limit or, in
+ * the static mode, half of the arena is in use */
+static void airbrake_pipeline_job_trim(airbrake_string_t *buf, size_t limit)
+{
+    if (buf->al > limit || airbrake_static_pressure(2)) {
+        airbrake_string_fini(buf);
+        buf->l = 0;
+        buf->al = 0;
+    }
+}
+
+/* called with the mutex held; drops it while the completion runs */
+static void airbrake_pipeline_complete(airbrake_pipeline_t *pipeline, airbrake_pipeline_job_t *job)
+{
+    airbrake_client_opaque_t *priv = pipeline->client->priv;
+
+    if (job->bytes) {
+        pthread_mutex_lock(&priv->stats_mutex);
+        priv->queued_bytes -= job->bytes;
+        pthread_mutex_unlock(&priv->stats_mutex);
+        AIRBRAKE_PROBE3(queue__dequeue, job->seq, job->bytes, priv->queued_bytes);
+        job->bytes = 0;
+    }
+    pthread_mutex_unlock(&pipeline->mutex);
+    if (job->completion_func)
+        job->completion_func(job->completion_ctx, job->err, job->err || priv->fire_and_forget ? 0: &job->result);
+    airbrake_notice_result_fini(&job->result);
+    airbrake_pipeline_job_trim(&job->record, priv->buffer_limit);
+    airbrake_pipeline_job_trim(&job->xml, priv->buffer_limit);
+    airbrake_pipeline_job_trim(&job->compressed, priv->buffer_limit);
+    pthread_mutex_lock(&pipeline->mutex);
+
+    job->next = pipeline->spare_jobs;
+    pipeline->spare_jobs = job;
+    if (--pipeline->in_flight == 0)
+        pthread_cond_broadcast(&pipeline->idle);
+    pthread_cond_broadcast(&pipeline->room);
+}
+
+/* completes the oldest job still waiting to be serialized with AIRBRAKE_ERROR_QUEUE_FULL; called with the mutex held */
+static void airbrake_pipeline_evict_oldest(airbrake_pipeline_t *pipeline)
+{
+    airbrake_client_opaque_t *priv = pipeline->client->priv;
+    airbrake_pipeline_queue_t *queue = &pipeline->queues[AIRBRAKE_PIPELINE_SERIALIZE];
+    airbrake_pipeline_job_t *job = airbrake_pipeline_pop(queue);
+
+    AIRBRAKE_PROBE3(stage__dequeue, job, AIRBRAKE_PIPELINE_SERIALIZE, queue->n);
+    queue->failed++;
+    job->err = AIRBRAKE_ERROR_QUEUE_FULL;
+    pthread_mutex_unlock(&pipeline->mutex);
+    airbrake_client_drop(priv, job->seq, job->bytes);
+    airbrake_client_count(priv, AIRBRAKE_ERROR_QUEUE_FULL);
+    pthread_mutex_lock(&pipeline->mutex);
+    airbrake_pipeline_complete(pipeline, job);
+}
+
+/*
+ * airbrake_client_admit() for a job about to be captured, called with the
+ * mutex held.  Evictions and blocking waits drop the mutex, so the room is
+ * looked at again each time; a dropped job is left for the caller to report
+ * once the mutex is released.
+ */
+static airbrake_error_t airbrake_pipeline_admit(airbrake_pipeline_t *pipeline, airbrake_pipeline_job_t *job, const airbrake_notice_t *notice)
+{
+    airbrake_client_t *client = pipeline->client;
+    airbrake_client_opaque_t *priv = client->priv;
+    airbrake_pipeline_queue_t *queue = &pipeline->queues[AIRBRAKE_PIPELINE_SERIALIZE];
+    size_t bytes = job->record.l;
+    int fits = !priv->queue_limit || bytes <= priv->queue_limit;
+    struct timespec deadline;
+    int waiting = 0;
+
+    for (;;) {
+        /* in the static mode the arena bounds the backlog too; a job about
+         * triples its record by the time it is compressed, so hold off while a
+         * quarter of the arena is taken and let the later stages catch up */
+        int full = queue->n >= queue->cap || (pipeline->in_flight && airbrake_static_pressure(4));
+
+        if (!full && (!priv->queue_limit || priv->queued_bytes + bytes <= priv->queue_limit))
+            return AIRBRAKE_OK;
+        switch (priv->backpressure) {
+        case AIRBRAKE_BACKPRESSURE_DROP_OLDEST:
+            if (!fits || !queue->first)
+                break;
+            airbrake_pipeline_evict_oldest(pipeline);
+            continue;
+        case AIRBRAKE_BACKPRESSURE_SPILL:
+            job->xml.l = 0;
+            if (!airbrake_client_build_notice_xml(client, &job->xml, notice) && !airbrake_client_spill(priv, &job->xml))
+                return AIRBRAKE_ERROR_SPILLED;
+            break;
+        case AIRBRAKE_BACKPRESSURE_BLOCK:
+            if (!fits)
+                break;
+            if (!waiting) {
+                clock_gettime(CLOCK_MONOTONIC, &deadline);
+                deadline.tv_sec += priv->block_timeout_ms / 1000;
+                deadline.tv_nsec += (priv->block_timeout_ms % 1000) * 1000000L;
+                if (deadline.tv_nsec >= 1000000000L) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000L;
                 }
+                waiting = 1;
             }
+            if (pthread_cond_timedwait(&pipeline->room, &pipeline->mutex, &deadline) != ETIMEDOUT)
+                continue;
             break;
-        case 403:
-            err = AIRBRAKE_ERROR_SSL_NOT_SUPPORTED;
-            break;
-        case 422:
-            err = AIRBRAKE_ERROR_API_KEY_INVALID;
+        default:
             break;
-        case 500:
-            err = AIRBRAKE_ERROR_UNEXPECTED;
+        }
+        break;
+    }
+    return AIRBRAKE_ERROR_QUEUE_FULL;
+}
+
+static void *airbrake_pipeline_worker_main(void *arg)
+{
+    airbrake_pipeline_worker_t *worker = arg;
+    airbrake_pipeline_t *pipeline = worker->pipeline;
+    airbrake_pipeline_queue_t *queue = &pipeline->queues[worker->stage];
+
+    pthread_mutex_lock(&pipeline->mutex);
+    for (;;) {
+        airbrake_pipeline_job_t *job;
+        airbrake_pipeline_stage_t next;
+
+        while (!queue->first && !pipeline->stopping)
+            pthread_cond_wait(&queue->not_empty, &pipeline->mutex);
+        if (!queue->first)
             break;
+        job = airbrake_pipeline_pop(queue);
+        AIRBRAKE_PROBE3(stage__dequeue, job, worker->stage, queue->n);
+        if (worker->stage == AIRBRAKE_PIPELINE_SERIALIZE)
+            pthread_cond_broadcast(&pipeline->room);
+        pthread_mutex_unlock(&pipeline->mutex);
+
+        next = airbrake_pipeline_run(worker, job);
+
+        pthread_mutex_lock(&pipeline->mutex);
+        if (job->err)
+            queue->failed++;
+        else
+            queue->processed++;
+        if (worker->stage == AIRBRAKE_PIPELINE_TRANSMIT)
+            airbrake_client_count(pipeline->client->priv, job->err);
+        if (next == AIRBRAKE_PIPELINE_STAGES) {
+            airbrake_pipeline_complete(pipeline, job);
+        } else {
+            airbrake_pipeline_queue_t *next_queue = &pipeline->queues[next];
+            while (next_queue->n >= next_queue->cap)
+                pthread_cond_wait(&next_queue->not_full, &pipeline->mutex);
+            airbrake_pipeline_push(next_queue, job);
+            AIRBRAKE_PROBE3(stage__enqueue, job, next, next_queue->n);
+        }
+    }
+    pthread_mutex_unlock(&pipeline->mutex);
+    return 0;
+}
+
+static airbrake_error_t airbrake_pipeline_start_worker(airbrake_pipeline_t *pipeline, airbrake_pipeline_stage_t stage)
+{
+    airbrake_pipeline_worker_t *worker = &pipeline->workers[pipeline->workers_count];
+
+    worker->pipeline = pipeline;
+    worker->stage = stage;
+    worker->curl = 0;
+    worker->response.p = 0;
+    worker->response.l = worker->response.al = worker->response.xl = 0;
+    if (stage == AIRBRAKE_PIPELINE_TRANSMIT) {
+        worker->curl = curl_easy_init();
+        if (!worker->curl)
+            return AIRBRAKE_ERROR_UNKNOWN;
+        curl_easy_setopt(worker->curl, CURLOPT_NOSIGNAL, 1L);
+        if (pipeline->headers)
+            curl_easy_setopt(worker->curl, CURLOPT_HTTPHEADER, pipeline->headers);
+    }
+    if (pthread_create(&worker->thread, 0, airbrake_pipeline_worker_main, worker)) {
+        if (worker->curl)
+            curl_easy_cleanup(worker->curl);
+        return AIRBRAKE_ERROR_UNKNOWN;
+    }
+    pipeline->workers_count++;
+    return AIRBRAKE_OK;
+}
+
+/*
+ * Zero worker counts pick one serialize and one compress worker per online
+ * CPU and AIRBRAKE_PIPELINE_DEFAULT_TRANSMIT_WORKERS transmit workers;
+ * compress workers are only started when compress is set.  The unix
+ * transport shares one socket, so it always gets a single transmit worker
+ * and is never compressed.
+ */
+airbrake_error_t airbrake_pipeline_init(airbrake_pipeline_t **retval, airbrake_client_t *client, size_t serialize_workers, size_t compress_workers, size_t transmit_workers, size_t queue_depth, int compress)
+{
+    airbrake_error_t err;
+    airbrake_pipeline_t *pipeline;
+    pthread_condattr_t attr;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t i;
+
+    if (!serialize_workers)
+        serialize_workers = ncpus > 0 ? (size_t)ncpus: 1;
+    if (!compress_workers)
+        compress_workers = ncpus > 0 ? (size_t)ncpus: 1;
+    if (!transmit_workers)
+        transmit_workers = AIRBRAKE_PIPELINE_DEFAULT_TRANSMIT_WORKERS;
+    if (!queue_depth)
+        queue_depth = AIRBRAKE_PIPELINE_DEFAULT_QUEUE_DEPTH;
+    if (client->priv->transport == AIRBRAKE_TRANSPORT_UNIX) {
+        transmit_workers = 1;
+        compress = 0;
+    }
+    if (!compress)
+        compress_workers = 0;
+
+    pipeline = calloc(1, sizeof(airbrake_pipeline_t));
+    if (!pipeline)
+        return AIRBRAKE_ERROR_MEM;
+    pipeline->workers = calloc(serialize_workers + compress_workers + transmit_workers, sizeof(airbrake_pipeline_worker_t));
+    if (!pipeline->workers) {
+        free(pipeline);
+        return AIRBRAKE_ERROR_MEM;
+    }
+    pipeline->client = client;
+    pipeline->compress = compress;
+    pipeline->started_ms = airbrake_now_ms();
+    pthread_mutex_init(&pipeline->mutex, 0);
+    pthread_cond_init(&pipeline->idle, 0);
+    /* blocked captures wait for room against a monotonic deadline */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pipeline->room, &attr);
+    pthread_condattr_destroy(&attr);
+    for (i = 0; i < AIRBRAKE_PIPELINE_STAGES; i++) {
+        pipeline->queues[i].cap = queue_depth;
+        pthread_cond_init(&pipeline->queues[i].not_empty, 0);
+        pthread_cond_init(&pipeline->queues[i].not_full, 0);
+    }
+    if (compress) {
+        struct curl_slist *tmp = curl_slist_append(0, "Content-Type: text/xml");
+        if (tmp)
+            pipeline->headers = curl_slist_append(tmp, "Content-Encoding: gzip");
+        if (!pipeline->headers) {
+            curl_slist_free_all(tmp);
+            err = AIRBRAKE_ERROR_MEM;
+            goto fail;
         }
+    }
 
-    out_inner:
-        airbrake_string_fini(&out_buf);
-        airbrake_string_fini(&content_type);
-        airbrake_string_fini(&charset);
-        if (doc)
-            xmlFreeDoc(doc);
-        if (parser)
-            xmlFreeParserCtxt(parser);
+    for (i = 0; i < serialize_workers; i++) {
+        err = airbrake_pipeline_start_worker(pipeline, AIRBRAKE_PIPELINE_SERIALIZE);
+        if (err)
+            goto fail;
     }
-    if (err)
-        airbrake_notice_result_fini(result);
-    airbrake_string_fini(&buf);
+    for (i = 0; i < compress_workers; i++) {
+        err = airbrake_pipeline_start_worker(pipeline, AIRBRAKE_PIPELINE_COMPRESS);
+        if (err)
+            goto fail;
+    }
+    for (i = 0; i < transmit_workers; i++) {
+        err = airbrake_pipeline_start_worker(pipeline, AIRBRAKE_PIPELINE_TRANSMIT);
+        if (err)
+            goto fail;
+    }
+    *retval = pipeline;
+    return AIRBRAKE_OK;
+fail:
+    airbrake_pipeline_fini(&pipeline);
     return err;
 }
 
-void airbrake_client_fini(airbrake_client_t *client)
+void airbrake_pipeline_drain(airbrake_pipeline_t *pipeline)
 {
-    airbrake_client_opaque_fini(&client->priv);
-    airbrake_string_fini(&client->notice_endpoint);
-    airbrake_string_fini(&client->api_key);
+    pthread_mutex_lock(&pipeline->mutex);
+    while (pipeline->in_flight > 0)
+        pthread_cond_wait(&pipeline->idle, &pipeline->mutex);
+    pthread_mutex_unlock(&pipeline->mutex);
+}
+
+/* completes every notice already captured before stopping the workers */
+void airbrake_pipeline_fini(airbrake_pipeline_t **pipeline)
+{
+    airbrake_pipeline_t *_pipeline = *pipeline;
+    size_t i;
+
+    airbrake_pipeline_drain(_pipeline);
+    pthread_mutex_lock(&_pipeline->mutex);
+    _pipeline->stopping = 1;
+    for (i = 0; i < AIRBRAKE_PIPELINE_STAGES; i++)
+        pthread_cond_broadcast(&_pipeline->queues[i].not_empty);
+    pthread_mutex_unlock(&_pipeline->mutex);
+
+    for (i = 0; i < _pipeline->workers_count; i++) {
+        airbrake_pipeline_worker_t *worker = &_pipeline->workers[i];
+        pthread_join(worker->thread, 0);
+        if (worker->curl)
+            curl_easy_cleanup(worker->curl);
+        airbrake_string_fini(&worker->response);
+    }
+    while (_pipeline->spare_jobs) {
+        airbrake_pipeline_job_t *next = _pipeline->spare_jobs->next;
+        airbrake_pipeline_job_free(_pipeline->spare_jobs);
+        _pipeline->spare_jobs = next;
+    }
+    for (i = 0; i < AIRBRAKE_PIPELINE_STAGES; i++) {
+        pthread_cond_destroy(&_pipeline->queues[i].not_empty);
+        pthread_cond_destroy(&_pipeline->queues[i].not_full);
+    }
+    pthread_cond_destroy(&_pipeline->idle);
+    pthread_cond_destroy(&_pipeline->room);
+    pthread_mutex_destroy(&_pipeline->mutex);
+    curl_slist_free_all(_pipeline->headers);
+    free(_pipeline->workers);
+    free(_pipeline);
+    *pipeline = 0;
+}
+
+airbrake_error_t airbrake_pipeline_submit(airbrake_pipeline_t *pipeline, const airbrake_notice_t *notice, airbrake_completion_func_t completion_func, void *completion_ctx)
+{
+    airbrake_error_t err;
+    airbrake_client_opaque_t *priv = pipeline->client->priv;
+    airbrake_pipeline_queue_t *capture = &pipeline->queues[AIRBRAKE_PIPELINE_CAPTURE];
+    airbrake_pipeline_queue_t *queue = &pipeline->queues[AIRBRAKE_PIPELINE_SERIALIZE];
+    airbrake_pipeline_job_t *job;
+    size_t dropped = 0;
+
+    pthread_mutex_lock(&pipeline->mutex);
+    job = pipeline->spare_jobs;
+    if (job)
+        pipeline->spare_jobs = job->next;
+    pthread_mutex_unlock(&pipeline->mutex);
+
+    if (!job) {
+        job = airbrake_malloc(sizeof(airbrake_pipeline_job_t));
+        if (!job)
+            return AIRBRAKE_ERROR_MEM;
+        memset(job, 0, sizeof(airbrake_pipeline_job_t));
+    }
+    job->record.l = 0;
+    job->body = 0;
+    job->bytes = 0;
+    job->err = AIRBRAKE_OK;
+    job->result.error_id.p = 0;
+    job->result.url.p = 0;
+    job->result.id.p = 0;
+    job->completion_func = completion_func;
+    job->completion_ctx = completion_ctx;
+
+    /* the record is a private copy, so the caller may reuse the notice right away */
+    err = airbrake_notice_encode(&job->record, notice);
+
+    pthread_mutex_lock(&pipeline->mutex);
+    if (!err)
+        err = airbrake_pipeline_admit(pipeline, job, notice);
+    if (err) {
+        if (err == AIRBRAKE_ERROR_QUEUE_FULL)
+            dropped = job->record.l;
+        capture->failed++;
+        job->next = pipeline->spare_jobs;
+        pipeline->spare_jobs = job;
+    } else {
+        job->bytes = job->record.l;
+        job->seq = ++priv->queue_seq;
+        pthread_mutex_lock(&priv->stats_mutex);
+        priv->queued_bytes += job->bytes;
+        pthread_mutex_unlock(&priv->stats_mutex);
+        AIRBRAKE_PROBE3(queue__enqueue, job->seq, job->bytes, priv->queued_bytes);
+        capture->processed++;
+        pipeline->in_flight++;
+        airbrake_pipeline_push(queue, job);
+        AIRBRAKE_PROBE3(stage__enqueue, job, AIRBRAKE_PIPELINE_SERIALIZE, queue->n);
+    }
+    pthread_mutex_unlock(&pipeline->mutex);
+    if (dropped)
+        airbrake_client_drop(priv, 0, dropped);
+    return err;
+}
+
+void airbrake_pipeline_get_stats(airbrake_pipeline_t *pipeline, airbrake_pipeline_stage_t stage, airbrake_pipeline_stats_t *stats)
+{
+    airbrake_pipeline_queue_t *queue = &pipeline->queues[stage];
+    long elapsed_ms;
+
+    pthread_mutex_lock(&pipeline->mutex);
+    /* captured notices wait in the serialize queue, so capture itself never has a backlog */
+    stats->depth = stage == AIRBRAKE_PIPELINE_CAPTURE ? 0: queue->n;
+    stats->processed = queue->processed;
+    stats->failed = queue->failed;
+    pthread_mutex_unlock(&pipeline->mutex);
+    elapsed_ms = airbrake_now_ms() - pipeline->started_ms;
+    stats->throughput = elapsed_ms > 0 ? stats->processed * 1000. / elapsed_ms: 0.;
 }
 
 void airbrake_init()
@@ -0,0 +1,410 @@
+/*
+ * Copyright (c) 2011 Moriyoshi Koizumi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef AIRBRAKE_HPP
+#define AIRBRAKE_HPP
+
+/*
+ * Header-only C++17 wrapper around airbrake.h.
+ *
+ * All types are move-only owners of the underlying C objects.  Strings are
+ * taken as std::string_view and passed straight to the C API, which makes
+ * the one copy it always makes; no std::string temporaries are created.
+ * Notices are drawn from the client's notice pool, so a steady stream of
+ * reports does not allocate.  Notices share ownership of the C client and
+ * interned strings keep their table alive, so notices and interned
+ * backtraces may outlive the airbrake::client they came from.
+ */
+
+#include <cstdlib>
+#include <exception>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string_view>
+#include <typeinfo>
+#include <utility>
+#if defined(__GNUG__)
+#include <cxxabi.h>
+#endif
+
+#include "airbrake.h"
+
+namespace airbrake {
+
+class error: public std::runtime_error {
+public:
+    explicit error(airbrake_error_t code)
+        : std::runtime_error(describe(code)), code_(code) {}
+
+    airbrake_error_t code() const noexcept { return code_; }
+
+    static const char *describe(airbrake_error_t code) noexcept
+    {
+        switch (code) {
+        case AIRBRAKE_OK: return "no error";
+        case AIRBRAKE_ERROR_MEM: return "out of memory";
+        case AIRBRAKE_ERROR_NETWORK_FAILURE: return "network failure";
+        case AIRBRAKE_ERROR_INVALID_RESPONSE: return "invalid response";
+        case AIRBRAKE_ERROR_SSL_NOT_SUPPORTED: return "SSL not supported";
+        case AIRBRAKE_ERROR_API_KEY_INVALID: return "invalid API key";
+        case AIRBRAKE_ERROR_UNEXPECTED: return "unexpected server error";
+        case AIRBRAKE_ERROR_WOULD_BLOCK: return "operation would block";
+        case AIRBRAKE_ERROR_INVALID_RECORD: return "invalid notice record";
+        case AIRBRAKE_ERROR_THROTTLED: return "throttled by the collector";
+        default: return "unknown error";
+        }
+    }
+
+private:
+    airbrake_error_t code_;
+};
+
+inline void check(airbrake_error_t err)
+{
+    if (err) {
+        if (err == AIRBRAKE_ERROR_MEM)
+            throw std::bad_alloc();
+        throw error(err);
+    }
+}
+
+/* a non-owning airbrake_string_t over the viewed characters */
+constexpr airbrake_string_t borrow(std::string_view sv) noexcept
+{
+    return airbrake_string_t{ const_cast<char *>(sv.data()), sv.size(), 0, 0, nullptr, 0 };
+}
+
+constexpr std::string_view view(const airbrake_string_t &s) noexcept
+{
+    return s.p ? std::string_view(s.p, s.l): std::string_view();
+}
+
+inline constexpr airbrake_string_t null_string{ nullptr, 0, 0, 0, nullptr, 0 };
+
+namespace keys {
+inline constexpr std::string_view request_method = "REQUEST_METHOD";
+inline constexpr std::string_view request_uri = "REQUEST_URI";
+inline constexpr std::string_view query_string = "QUERY_STRING";
+inline constexpr std::string_view remote_addr = "REMOTE_ADDR";
+inline constexpr std::string_view server_name = "SERVER_NAME";
+inline constexpr std::string_view http_host = "HTTP_HOST";
+inline constexpr std::string_view http_user_agent = "HTTP_USER_AGENT";
+inline constexpr std::string_view http_referer = "HTTP_REFERER";
+}
+
+class library {
+public:
+    library() { airbrake_init(); }
+    ~library() { airbrake_cleanup(); }
+    library(const library &) = delete;
+    library &operator=(const library &) = delete;
+};
+
+class string_table {
+public:
+    string_table() noexcept { airbrake_string_table_init(&table_); }
+    ~string_table() { airbrake_string_table_fini(&table_); }
+
+    string_table(string_table &&other) noexcept: string_table() { swap(other); }
+    string_table &operator=(string_table &&other) noexcept { swap(other); return *this; }
+    string_table(const string_table &) = delete;
+    string_table &operator=(const string_table &) = delete;
+
+    string_table &add(std::string_view key, std::string_view value)
+    {
+        check(airbrake_string_table_add(&table_, borrow(key), borrow(value)));
+        return *this;
+    }
+
+    void clear() noexcept { airbrake_string_table_reset(&table_); }
+    bool empty() const noexcept { return !table_.first; }
+
+    void swap(string_table &other) noexcept { std::swap(table_, other.table_); }
+    void swap(airbrake_string_table_t &other) noexcept { std::swap(table_, other); }
+
+    airbrake_string_table_t *get() noexcept { return &table_; }
+    const airbrake_string_table_t *get() const noexcept { return &table_; }
+
+private:
+    airbrake_string_table_t table_;
+};
+
+class backtrace {
+public:
+    backtrace() noexcept { airbrake_backtrace_init(&backtrace_); }
+    ~backtrace() { airbrake_backtrace_fini(&backtrace_); }
+
+    backtrace(backtrace &&other) noexcept: backtrace() { swap(other); }
+    backtrace &operator=(backtrace &&other) noexcept { swap(other); return *this; }
+    backtrace(const backtrace &) = delete;
+    backtrace &operator=(const backtrace &) = delete;
+
+    backtrace &add(std::string_view method, std::string_view file, int line)
+    {
+        check(airbrake_backtrace_add_entry(&backtrace_, borrow(method), borrow(file), line));
+        return *this;
+    }
+
+    backtrace &add(airbrake_intern_table_t *interns, std::string_view method, std::string_view file, int line)
+    {
+        check(airbrake_backtrace_add_entry_interned(&backtrace_, interns, borrow(method), borrow(file), line));
+        return *this;
+    }
+
+    void clear() noexcept { airbrake_backtrace_reset(&backtrace_); }
+
+    void swap(backtrace &other) noexcept { std::swap(backtrace_, other.backtrace_); }
+    void swap(airbrake_backtrace_t &other) noexcept { std::swap(backtrace_, other); }
+
+    airbrake_backtrace_t *get() noexcept { return &backtrace_; }
+    const airbrake_backtrace_t *get() const noexcept { return &backtrace_; }
+
+private:
+    airbrake_backtrace_t backtrace_;
+};
+
+class result {
+public:
+    result() noexcept: result_{ null_string, null_string, null_string } {}
+    ~result() { airbrake_notice_result_fini(&result_); }
+
+    result(result &&other) noexcept: result() { std::swap(result_, other.result_); }
+    result &operator=(result &&other) noexcept { std::swap(result_, other.result_); return *this; }
+    result(const result &) = delete;
+    result &operator=(const result &) = delete;
+
+    std::string_view error_id() const noexcept { return view(result_.error_id); }
+    std::string_view url() const noexcept { return view(result_.url); }
+    std::string_view id() const noexcept { return view(result_.id); }
+
+    airbrake_notice_result_t *get() noexcept { return &result_; }
+
+private:
+    airbrake_notice_result_t result_;
+};
+
+class client;
+
+class notice {
+public:
+    notice() noexcept: client_(), slot_(nullptr), has_request_(false) {}
+    ~notice() { release(); }
+
+    notice(notice &&other) noexcept
+        : client_(std::move(other.client_)),
+          slot_(std::exchange(other.slot_, nullptr)),
+          has_request_(other.has_request_) {}
+
+    notice &operator=(notice &&other) noexcept
+    {
+        if (this != &other) {
+            release();
+            client_ = std::move(other.client_);
+            slot_ = std::exchange(other.slot_, nullptr);
+            has_request_ = other.has_request_;
+        }
+        return *this;
+    }
+
+    notice(const notice &) = delete;
+    notice &operator=(const notice &) = delete;
+
+    notice &exception(std::string_view klass, std::string_view message)
+    {
+        check(airbrake_exception_reset(&slot_->exception, borrow(klass), borrow(message)));
+        return *this;
+    }
+
+    /* converts whatever ep holds; std::exception subclasses keep their type name */
+    notice &exception(std::exception_ptr ep)
+    {
+        /* rethrowing a null exception_ptr is undefined */
+        if (!ep)
+            return exception("unknown", "no exception");
+        try {
+            std::rethrow_exception(ep);
+        } catch (const std::exception &e) {
+            return exception_with_type_name(typeid(e).name(), e.what());
+        } catch (...) {
+            return exception("unknown", "non-standard exception");
+        }
+    }
+
+    notice &frame(std::string_view method, std::string_view file, int line)
+    {
+        check(airbrake_backtrace_add_entry_interned(slot_->exception.backtrace, airbrake_client_get_intern_table(client_.get()), borrow(method), borrow(file), line));
+        return *this;
+    }
+
+    notice &frames(backtrace &&bt) noexcept
+    {
+        bt.swap(*slot_->exception.backtrace);
+        return *this;
+    }
+
+    notice &request(std::string_view url, std::string_view component, std::string_view action)
+    {
+        check(airbrake_request_info_reset(&slot_->request, borrow(url), borrow(component), action.data() ? borrow(action): null_string));
+        has_request_ = true;
+        return *this;
+    }
+
+    notice &param(std::string_view key, std::string_view value)
+    {
+        check(airbrake_string_table_add(&slot_->request.params, borrow(key), borrow(value)));
+        return *this;
+    }
+
+    notice &session(std::string_view key, std::string_view value)
+    {
+        check(airbrake_string_table_add(&slot_->request.session, borrow(key), borrow(value)));
+        return *this;
+    }
+
+    notice &cgi(std::string_view key, std::string_view value)
+    {
+        check(airbrake_string_table_add(&slot_->request.cgi_data, borrow(key), borrow(value)));
+        return *this;
+    }
+
+    notice &params(string_table &&table) noexcept { table.swap(slot_->request.params); return *this; }
+    notice &session(string_table &&table) noexcept { table.swap(slot_->request.session); return *this; }
+    notice &cgi(string_table &&table) noexcept { table.swap(slot_->request.cgi_data); return *this; }
+
+    notice &environment(std::string_view project_root, std::string_view environment_name, std::string_view app_version)
+    {
+        check(airbrake_environment_info_reset(&slot_->environment,
+            project_root.data() ? borrow(project_root): null_string,
+            borrow(environment_name),
+            app_version.data() ? borrow(app_version): null_string));
+        return *this;
+    }
+
+    const airbrake_notice_t *get() noexcept
+    {
+        slot_->notice.request = has_request_ ? &slot_->request: nullptr;
+        return &slot_->notice;
+    }
+
+    explicit operator bool() const noexcept { return slot_ != nullptr; }
+
+private:
+    friend class client;
+
+    notice(std::shared_ptr<airbrake_client_t> c, airbrake_notice_slot_t *slot) noexcept
+        : client_(std::move(c)), slot_(slot), has_request_(false) {}
+
+    notice &exception_with_type_name(const char *mangled, const char *message)
+    {
+#if defined(__GNUG__)
+        int status = 0;
+        char *demangled = abi::__cxa_demangle(mangled, nullptr, nullptr, &status);
+        if (demangled) {
+            airbrake_error_t err = airbrake_exception_reset(&slot_->exception, borrow(demangled), borrow(message));
+            std::free(demangled);
+            check(err);
+            return *this;
+        }
+#endif
+        return exception(mangled, message);
+    }
+
+    void release() noexcept
+    {
+        if (slot_) {
+            airbrake_client_release_notice(client_.get(), slot_);
+            slot_ = nullptr;
+        }
+        client_.reset();
+    }
+
+    std::shared_ptr<airbrake_client_t> client_;
+    airbrake_notice_slot_t *slot_;
+    bool has_request_;
+};
+
+class client {
+public:
+    client(std::string_view endpoint, std::string_view api_key, const airbrake_client_info_t *info = nullptr)
+    {
+        airbrake_client_t *c = new airbrake_client_t;
+        airbrake_error_t err = airbrake_client_init(c, info, borrow(endpoint), borrow(api_key));
+        if (err) {
+            delete c;
+            check(err);
+        }
+        /* finalizes c itself should the control block fail to allocate */
+        client_ = std::shared_ptr<airbrake_client_t>(c, finalize);
+    }
+
+    explicit client(std::string_view api_key)
+        : client(view(airbrake_default_notice_endpoint_url), api_key) {}
+
+    /* the C client is kept on the heap and shared with the notices drawn from it */
+    client(client &&other) noexcept = default;
+    client &operator=(client &&other) noexcept = default;
+    client(const client &) = delete;
+    client &operator=(const client &) = delete;
+
+    notice make_notice()
+    {
+        airbrake_notice_slot_t *slot;
+        check(airbrake_client_acquire_notice(client_.get(), &slot));
+        return notice(client_, slot);
+    }
+
+    notice make_notice(std::exception_ptr ep)
+    {
+        notice retval = make_notice();
+        retval.exception(ep);
+        return retval;
+    }
+
+    result submit(notice &n)
+    {
+        result retval;
+        check(airbrake_client_submit_notice(client_.get(), retval.get(), n.get()));
+        return retval;
+    }
+
+    airbrake_error_t try_submit(notice &n, result &r) noexcept
+    {
+        return airbrake_client_submit_notice(client_.get(), r.get(), n.get());
+    }
+
+    airbrake_intern_table_t *interns() noexcept { return airbrake_client_get_intern_table(client_.get()); }
+
+    airbrake_client_t *get() noexcept { return client_.get(); }
+
+private:
+    static void finalize(airbrake_client_t *c) noexcept
+    {
+        airbrake_client_fini(c);
+        delete c;
+    }
+
+    std::shared_ptr<airbrake_client_t> client_;
+};
+
+} /* namespace airbrake */
+
+#endif /* AIRBRAKE_HPP */
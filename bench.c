@@ -0,0 +1,695 @@
+/*
+ * Copyright (c) 2011 Moriyoshi Koizumi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "airbrake.h"
+#include "standin.h"
+
+/*
+ * Allocations are counted by interposing the allocator, which glibc
+ * allows through its __libc_* entry points.  Counters are per thread, so
+ * the stand-in's own allocations stay out of the figures, and so do those
+ * of the pipeline workers.  Sanitizer builds bring their own allocator and
+ * go without counts.
+ */
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+#define BENCH_COUNT_ALLOCS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static __thread unsigned long bench_allocs = 0;
+static __thread unsigned long bench_alloc_bytes = 0;
+
+void *malloc(size_t size)
+{
+    bench_allocs++;
+    bench_alloc_bytes += size;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    bench_allocs++;
+    bench_alloc_bytes += nmemb * size;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    bench_allocs++;
+    bench_alloc_bytes += size;
+    return __libc_realloc(ptr, size);
+}
+#else
+static unsigned long bench_allocs = 0;
+static unsigned long bench_alloc_bytes = 0;
+#endif
+
+typedef enum bench_format_t {
+    BENCH_FORMAT_TEXT,
+    BENCH_FORMAT_CSV,
+    BENCH_FORMAT_JSON
+} bench_format_t;
+
+typedef struct bench_mark_t {
+    double started_ns;
+    unsigned long allocs;
+    unsigned long alloc_bytes;
+} bench_mark_t;
+
+static bench_format_t bench_format = BENCH_FORMAT_TEXT;
+static const char *bench_filter = 0;
+
+static double bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int bench_selected(const char *label)
+{
+    return !bench_filter || strncmp(label, bench_filter, strlen(bench_filter)) == 0;
+}
+
+static void bench_start(bench_mark_t *mark)
+{
+    mark->allocs = bench_allocs;
+    mark->alloc_bytes = bench_alloc_bytes;
+    mark->started_ns = bench_now_ns();
+}
+
+/* counts_allocs is zero for cases whose work happens on other threads */
+static void bench_stop(const bench_mark_t *mark, const char *label, long iterations, int counts_allocs)
+{
+    double elapsed = bench_now_ns() - mark->started_ns;
+    double allocs = (double)(bench_allocs - mark->allocs) / iterations;
+    double alloc_bytes = (double)(bench_alloc_bytes - mark->alloc_bytes) / iterations;
+#ifndef BENCH_COUNT_ALLOCS
+    counts_allocs = 0;
+#endif
+
+    switch (bench_format) {
+    case BENCH_FORMAT_TEXT:
+        if (counts_allocs)
+            printf("%-32s %10ld ops %12.0f ns/op %10.2f allocs/op %12.0f B/op\n", label, iterations, elapsed / iterations, allocs, alloc_bytes);
+        else
+            printf("%-32s %10ld ops %12.0f ns/op %10s allocs/op %12s B/op\n", label, iterations, elapsed / iterations, "-", "-");
+        break;
+    case BENCH_FORMAT_CSV:
+        if (counts_allocs)
+            printf("%s,%ld,%.1f,%.2f,%.0f\n", label, iterations, elapsed / iterations, allocs, alloc_bytes);
+        else
+            printf("%s,%ld,%.1f,,\n", label, iterations, elapsed / iterations);
+        break;
+    case BENCH_FORMAT_JSON:
+        if (counts_allocs)
+            printf("{\"name\":\"%s\",\"iterations\":%ld,\"ns_per_op\":%.1f,\"allocs_per_op\":%.2f,\"bytes_per_op\":%.0f}\n", label, iterations, elapsed / iterations, allocs, alloc_bytes);
+        else
+            printf("{\"name\":\"%s\",\"iterations\":%ld,\"ns_per_op\":%.1f,\"allocs_per_op\":null,\"bytes_per_op\":null}\n", label, iterations, elapsed / iterations);
+        break;
+    }
+    fflush(stdout);
+}
+
+static int bench_string_append(const char *label, long iterations)
+{
+    static const char chunk[] = "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef";
+    airbrake_string_t buf = { 0, 0, 0, 0, 0, 0 };
+    bench_mark_t mark;
+    long i;
+    int j;
+
+    bench_start(&mark);
+    for (i = 0; i < iterations; i++) {
+        buf.l = 0;
+        for (j = 0; j < 16; j++) {
+            if (airbrake_string_append(&buf, airbrake_string_static(chunk, sizeof(chunk) - 1)))
+                return 1;
+        }
+    }
+    bench_stop(&mark, label, iterations, 1);
+    airbrake_string_fini(&buf);
+    return 0;
+}
+
+/* grows a fresh string to 16KiB in 64-byte steps, so every op pays the full growth sequence */
+static int bench_string_grow(const char *label, long iterations)
+{
+    bench_mark_t mark;
+    long i;
+    size_t j;
+
+    bench_start(&mark);
+    for (i = 0; i < iterations; i++) {
+        airbrake_string_t buf = { 0, 0, 0, 0, 0, 0 };
+        for (j = 64; j <= 16384; j += 64) {
+            if (airbrake_string_grow(&buf, j))
+                return 1;
+            buf.l = j - 1;
+        }
+        airbrake_string_fini(&buf);
+    }
+    bench_stop(&mark, label, iterations, 1);
+    return 0;
+}
+
+/* cold clears the cached escaped length before every op, so that the scan is measured too */
+static int bench_escape(const char *label, long iterations, const char *unit, int cold)
+{
+    airbrake_string_t src = { 0, 0, 0, 0, 0, 0 }, buf = { 0, 0, 0, 0, 0, 0 };
+    bench_mark_t mark;
+    long i;
+    int status = 1;
+
+    while (src.l < 1024) {
+        if (airbrake_string_append(&src, airbrake_string_static_z(unit)))
+            goto out;
+    }
+
+    bench_start(&mark);
+    for (i = 0; i < iterations; i++) {
+        buf.l = 0;
+        if (cold)
+            src.xl = 0;
+        if (airbrake_string_append_xml_escape(&buf, &src))
+            goto out;
+    }
+    bench_stop(&mark, label, iterations, 1);
+    status = 0;
+out:
+    airbrake_string_fini(&src);
+    airbrake_string_fini(&buf);
+    return status;
+}
+
+static int bench_backtrace(airbrake_client_t *client, const char *label, long iterations, int interned)
+{
+    airbrake_backtrace_t backtrace;
+    bench_mark_t mark;
+    long i;
+    int j, status = 1;
+
+    if (airbrake_backtrace_init(&backtrace))
+        return 1;
+
+    bench_start(&mark);
+    for (i = 0; i < iterations; i++) {
+        airbrake_backtrace_reset(&backtrace);
+        for (j = 0; j < 32; j++) {
+            airbrake_error_t err;
+            if (interned)
+                err = airbrake_backtrace_add_entry_interned(&backtrace, airbrake_client_get_intern_table(client), airbrake_string_static_z("app::handlers::process_request"), airbrake_string_static_z("/srv/app/src/handlers/process_request.c"), j + 1);
+            else
+                err = airbrake_backtrace_add_entry(&backtrace, airbrake_string_static_z("app::handlers::process_request"), airbrake_string_static_z("/srv/app/src/handlers/process_request.c"), j + 1);
+            if (err)
+                goto out;
+        }
+    }
+    bench_stop(&mark, label, iterations, 1);
+    status = 0;
+out:
+    airbrake_backtrace_fini(&backtrace);
+    return status;
+}
+
+static int bench_table(const char *label, long iterations)
+{
+    airbrake_string_table_t table;
+    bench_mark_t mark;
+    long i;
+    int j, status = 1;
+
+    if (airbrake_string_table_init(&table))
+        return 1;
+
+    bench_start(&mark);
+    for (i = 0; i < iterations; i++) {
+        airbrake_string_table_reset(&table);
+        for (j = 0; j < 32; j++) {
+            char key[32];
+            snprintf(key, sizeof(key), "HTTP_X_HEADER_%d", j);
+            if (airbrake_string_table_add(&table, airbrake_string_static_z(key), airbrake_string_static_z("value with <markup> & entities")))
+                goto out;
+        }
+    }
+    bench_stop(&mark, label, iterations, 1);
+    status = 0;
+out:
+    airbrake_string_table_fini(&table);
+    return status;
+}
+
+static airbrake_error_t bench_fill_notice(airbrake_notice_slot_t *slot, int frames, int vars, const char *value)
+{
+    airbrake_error_t err;
+    int i;
+
+    err = airbrake_exception_reset(&slot->exception, airbrake_string_static_z("RuntimeError"), airbrake_string_static_z("something <went> wrong & \"badly\""));
+    if (err)
+        return err;
+    for (i = 0; i < frames; i++) {
+        err = airbrake_backtrace_add_entry(slot->exception.backtrace, airbrake_string_static_z("app::handlers::process_request"), airbrake_string_static_z("/srv/app/src/handlers/process_request.c"), i + 1);
+        if (err)
+            return err;
+    }
+    err = airbrake_request_info_reset(&slot->request, airbrake_string_static_z("http://example.com/some/path?q=1&r=2"), airbrake_string_static_z("handlers"), airbrake_string_static_z("process"));
+    if (err)
+        return err;
+    for (i = 0; i < vars; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "HTTP_X_HEADER_%d", i);
+        err = airbrake_string_table_add(&slot->request.cgi_data, airbrake_string_static_z(key), airbrake_string_static_z(value));
+        if (err)
+            return err;
+    }
+    return airbrake_environment_info_reset(&slot->environment, airbrake_string_static_z("/srv/app"), airbrake_string_static_z("production"), airbrake_string_static_z("1.2.3"));
+}
+
+/* serializes one prepared notice over and over into a reused buffer */
+static int bench_build_notice(airbrake_client_t *client, const char *label, long iterations, int frames, int vars, const char *value)
+{
+    airbrake_notice_slot_t *slot;
+    airbrake_string_t buf = { 0, 0, 0, 0, 0, 0 };
+    bench_mark_t mark;
+    long i;
+
+    if (airbrake_client_acquire_notice(client, &slot))
+        return 1;
+    if (bench_fill_notice(slot, frames, vars, value)) {
+        airbrake_client_release_notice(client, slot);
+        return 1;
+    }
+
+    bench_start(&mark);
+    for (i = 0; i < iterations; i++) {
+        buf.l = 0;
+        if (airbrake_client_build_notice_xml(client, &buf, &slot->notice)) {
+            fprintf(stderr, "%s: build failed at iteration %ld\n", label, i);
+            break;
+        }
+    }
+    if (i == iterations)
+        bench_stop(&mark, label, iterations, 1);
+
+    airbrake_string_fini(&buf);
+    airbrake_client_release_notice(client, slot);
+    return i < iterations;
+}
+
+static int bench_submit(airbrake_client_t *client, const char *label, long iterations)
+{
+    airbrake_notice_slot_t *slot;
+    bench_mark_t mark;
+    long i;
+
+    if (airbrake_client_acquire_notice(client, &slot))
+        return 1;
+    if (bench_fill_notice(slot, 32, 32, "value with <markup> & entities")) {
+        airbrake_client_release_notice(client, slot);
+        return 1;
+    }
+
+    bench_start(&mark);
+    for (i = 0; i < iterations; i++) {
+        airbrake_notice_result_t result = { { 0, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0 }, { 0, 0, 0, 0, 0, 0 } };
+        if (airbrake_client_submit_notice(client, &result, &slot->notice)) {
+            fprintf(stderr, "%s: submit failed at iteration %ld\n", label, i);
+            airbrake_client_release_notice(client, slot);
+            return 1;
+        }
+        airbrake_notice_result_fini(&result);
+    }
+    bench_stop(&mark, label, iterations, 1);
+
+    airbrake_client_release_notice(client, slot);
+    return 0;
+}
+
+static airbrake_error_t bench_provide_vars(void *ctx, airbrake_var_writer_t *writer)
+{
+    int i, vars = *(int *)ctx;
+
+    for (i = 0; i < vars; i++) {
+        char key[32];
+        airbrake_error_t err;
+        snprintf(key, sizeof(key), "HTTP_X_HEADER_%d", i);
+        err = airbrake_var_writer_write(writer, airbrake_string_static_z(key), airbrake_string_static_z("value with <markup> & entities"));
+        if (err)
+            return err;
+    }
+    return AIRBRAKE_OK;
+}
+
+/* request variables gathered up front into tables, or streamed by a provider at serialization time */
+static int bench_build(airbrake_client_t *client, const char *label, long iterations, int use_provider)
+{
+    airbrake_notice_slot_t *slot;
+    airbrake_string_t buf = { 0, 0, 0, 0, 0, 0 };
+    bench_mark_t mark;
+    long i;
+    int vars = 32;
+
+    if (airbrake_client_acquire_notice(client, &slot))
+        return 1;
+    if (bench_fill_notice(slot, 32, 0, "")) {
+        airbrake_client_release_notice(client, slot);
+        return 1;
+    }
+
+    bench_start(&mark);
+    for (i = 0; i < iterations; i++) {
+        if (use_provider) {
+            airbrake_request_info_set_provider(&slot->request, AIRBRAKE_REQUEST_CGI_DATA, bench_provide_vars, &vars);
+        } else {
+            int j;
+            airbrake_string_table_reset(&slot->request.cgi_data);
+            for (j = 0; j < vars; j++) {
+                char key[32];
+                snprintf(key, sizeof(key), "HTTP_X_HEADER_%d", j);
+                airbrake_string_table_add(&slot->request.cgi_data, airbrake_string_static_z(key), airbrake_string_static_z("value with <markup> & entities"));
+            }
+        }
+        buf.l = 0;
+        if (airbrake_client_build_notice_xml(client, &buf, &slot->notice)) {
+            fprintf(stderr, "%s: build failed at iteration %ld\n", label, i);
+            break;
+        }
+    }
+    if (i == iterations)
+        bench_stop(&mark, label, iterations, 1);
+
+    airbrake_string_fini(&buf);
+    airbrake_client_release_notice(client, slot);
+    return i < iterations;
+}
+
+/* bench_hpp.cpp */
+void *bench_hpp_client_new(const char *endpoint);
+void bench_hpp_client_delete(void *client);
+int bench_hpp_report(void *client, airbrake_string_t *buf, int frames, int vars);
+
+static const char *const bench_report_keys[] = {
+    "REQUEST_METHOD", "REQUEST_URI", "QUERY_STRING", "REMOTE_ADDR",
+    "SERVER_NAME", "HTTP_HOST", "HTTP_USER_AGENT", "HTTP_REFERER"
+};
+
+/* one report as the C API puts it together: a pooled notice, interned frames, serialized and handed back */
+static int bench_report_c(airbrake_client_t *client, airbrake_string_t *buf, int frames, int vars)
+{
+    airbrake_notice_slot_t *slot;
+    airbrake_error_t err;
+    int i;
+
+    if (airbrake_client_acquire_notice(client, &slot))
+        return 1;
+    err = airbrake_exception_reset(&slot->exception, airbrake_string_static_z("RuntimeError"), airbrake_string_static_z("something <went> wrong & \"badly\""));
+    for (i = 0; !err && i < frames; i++)
+        err = airbrake_backtrace_add_entry_interned(slot->exception.backtrace, airbrake_client_get_intern_table(client), airbrake_string_static_z("app::handlers::process_request"), airbrake_string_static_z("/srv/app/src/handlers/process_request.cpp"), i + 1);
+    if (!err)
+        err = airbrake_request_info_reset(&slot->request, airbrake_string_static_z("http://example.com/some/path?q=1&r=2"), airbrake_string_static_z("handlers"), airbrake_string_static_z("process"));
+    for (i = 0; !err && i < vars; i++)
+        err = airbrake_string_table_add(&slot->request.cgi_data, airbrake_string_static_z(bench_report_keys[i % 8]), airbrake_string_static_z("value with <markup> & entities"));
+    if (!err)
+        err = airbrake_environment_info_reset(&slot->environment, airbrake_string_static_z("/srv/app"), airbrake_string_static_z("production"), airbrake_string_static_z("1.2.3"));
+    if (!err) {
+        buf->l = 0;
+        err = airbrake_client_build_notice_xml(client, buf, &slot->notice);
+    }
+    airbrake_client_release_notice(client, slot);
+    return err != AIRBRAKE_OK;
+}
+
+/* the same report through airbrake.hpp, on a client of its own */
+static int bench_report(const char *endpoint, airbrake_client_t *client, const char *label, long iterations, int hpp)
+{
+    airbrake_string_t buf = { 0, 0, 0, 0, 0, 0 };
+    void *hpp_client = 0;
+    bench_mark_t mark;
+    long i;
+
+    if (hpp) {
+        hpp_client = bench_hpp_client_new(endpoint);
+        if (!hpp_client)
+            return 1;
+    }
+
+    bench_start(&mark);
+    for (i = 0; i < iterations; i++) {
+        if (hpp ? bench_hpp_report(hpp_client, &buf, 8, 8): bench_report_c(client, &buf, 8, 8)) {
+            fprintf(stderr, "%s: report failed at iteration %ld\n", label, i);
+            break;
+        }
+    }
+    if (i == iterations)
+        bench_stop(&mark, label, iterations, 1);
+
+    airbrake_string_fini(&buf);
+    if (hpp_client)
+        bench_hpp_client_delete(hpp_client);
+    return i < iterations;
+}
+
+static void bench_count_completion(void *ctx, airbrake_error_t err, const airbrake_notice_result_t *result)
+{
+    if (err)
+        ++*(int *)ctx;
+}
+
+static int bench_enqueue(airbrake_client_t *client, const char *label, long iterations)
+{
+    airbrake_notice_slot_t *slot;
+    bench_mark_t mark;
+    long i;
+    int failed = 0;
+
+    if (airbrake_client_acquire_notice(client, &slot))
+        return 1;
+    if (bench_fill_notice(slot, 32, 32, "value with <markup> & entities")) {
+        airbrake_client_release_notice(client, slot);
+        return 1;
+    }
+
+    bench_start(&mark);
+    for (i = 0; i < iterations; i++) {
+        if (airbrake_client_enqueue_notice(client, &slot->notice, bench_count_completion, &failed)) {
+            fprintf(stderr, "%s: enqueue failed at iteration %ld\n", label, i);
+            /* the pending batch points its completions at our stack */
+            airbrake_client_flush_batch(client);
+            airbrake_client_release_notice(client, slot);
+            return 1;
+        }
+    }
+    airbrake_client_flush_batch(client);
+    bench_stop(&mark, label, iterations, 1);
+
+    airbrake_client_release_notice(client, slot);
+    if (failed) {
+        fprintf(stderr, "%s: %d notices failed\n", label, failed);
+        return 1;
+    }
+    return 0;
+}
+
+static void bench_count_completion_atomic(void *ctx, airbrake_error_t err, const airbrake_notice_result_t *result)
+{
+    if (err)
+        __atomic_fetch_add((int *)ctx, 1, __ATOMIC_RELAXED);
+}
+
+static int bench_pipeline(airbrake_client_t *client, const char *label, long iterations, int compress)
+{
+    static const char *stage_names[AIRBRAKE_PIPELINE_STAGES] = { "capture", "serialize", "compress", "transmit" };
+    airbrake_notice_slot_t *slot;
+    airbrake_pipeline_t *pipeline;
+    bench_mark_t mark;
+    long i;
+    int failed = 0;
+
+    if (airbrake_client_acquire_notice(client, &slot))
+        return 1;
+    if (bench_fill_notice(slot, 32, 32, "value with <markup> & entities") || airbrake_pipeline_init(&pipeline, client, 0, 0, 0, 0, compress)) {
+        airbrake_client_release_notice(client, slot);
+        return 1;
+    }
+
+    bench_start(&mark);
+    for (i = 0; i < iterations; i++) {
+        airbrake_error_t err = airbrake_pipeline_submit(pipeline, &slot->notice, bench_count_completion_atomic, &failed);
+        if (err == AIRBRAKE_ERROR_QUEUE_FULL) {
+            struct timespec ts = { 0, 100000 };
+            nanosleep(&ts, 0);
+            i--;
+            continue;
+        }
+        if (err) {
+            fprintf(stderr, "%s: submit failed at iteration %ld\n", label, i);
+            break;
+        }
+    }
+    airbrake_pipeline_drain(pipeline);
+    /* serialization and transmission allocate on the workers, out of sight of the per-thread counters */
+    bench_stop(&mark, label, iterations, 0);
+    for (i = 0; bench_format == BENCH_FORMAT_TEXT && i < AIRBRAKE_PIPELINE_STAGES; i++) {
+        airbrake_pipeline_stats_t stats;
+        airbrake_pipeline_get_stats(pipeline, (airbrake_pipeline_stage_t)i, &stats);
+        printf("  %-30s %10lu ok %10lu failed %10.0f /s\n", stage_names[i], stats.processed, stats.failed, stats.throughput);
+    }
+
+    airbrake_pipeline_fini(&pipeline);
+    airbrake_client_release_notice(client, slot);
+    if (failed) {
+        fprintf(stderr, "%s: %d notices failed\n", label, failed);
+        return 1;
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n ITERATIONS] [-f text|csv|json] [-c CASE_PREFIX]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    int status = 0, opt;
+    long iterations = 2000;
+    standin_t *standin;
+    airbrake_client_t client;
+    char endpoint[128], batch_endpoint[128];
+
+    while ((opt = getopt(argc, argv, "n:f:c:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = strtol(optarg, 0, 10);
+            break;
+        case 'f':
+            if (strcmp(optarg, "text") == 0) {
+                bench_format = BENCH_FORMAT_TEXT;
+            } else if (strcmp(optarg, "csv") == 0) {
+                bench_format = BENCH_FORMAT_CSV;
+            } else if (strcmp(optarg, "json") == 0) {
+                bench_format = BENCH_FORMAT_JSON;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'c':
+            bench_filter = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    /* the iteration count used to be the only, positional, argument */
+    if (optind < argc)
+        iterations = strtol(argv[optind], 0, 10);
+    if (iterations < 10) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (bench_format == BENCH_FORMAT_CSV)
+        printf("name,iterations,ns_per_op,allocs_per_op,bytes_per_op\n");
+
+    airbrake_init();
+    if (standin_start(&standin, 0)) {
+        fprintf(stderr, "failed to start the stand-in endpoint\n");
+        return 1;
+    }
+    snprintf(endpoint, sizeof(endpoint), "http://127.0.0.1:%u/notifier_api/v2/notices", standin_port(standin));
+    snprintf(batch_endpoint, sizeof(batch_endpoint), "http://127.0.0.1:%u/notifier_api/v2/notices/batch", standin_port(standin));
+
+    if (airbrake_client_init(&client, 0, airbrake_string_static_z(endpoint), airbrake_string_static_z("0123456789abcdef"))) {
+        standin_stop(standin);
+        return 1;
+    }
+
+    if (bench_selected("string/append"))
+        status |= bench_string_append("string/append", iterations * 100);
+    if (bench_selected("string/grow-16k"))
+        status |= bench_string_grow("string/grow-16k", iterations * 10);
+    if (bench_selected("escape/plain-1k"))
+        status |= bench_escape("escape/plain-1k", iterations * 100, "plain text only ", 1);
+    if (bench_selected("escape/markup-1k"))
+        status |= bench_escape("escape/markup-1k", iterations * 100, "<a href=\"x\">&</a>", 1);
+    if (bench_selected("escape/markup-1k-cached"))
+        status |= bench_escape("escape/markup-1k-cached", iterations * 100, "<a href=\"x\">&</a>", 0);
+    if (bench_selected("backtrace/32-frames"))
+        status |= bench_backtrace(&client, "backtrace/32-frames", iterations * 100, 0);
+    if (bench_selected("backtrace/32-frames-interned"))
+        status |= bench_backtrace(&client, "backtrace/32-frames-interned", iterations * 100, 1);
+    if (bench_selected("table/32-vars"))
+        status |= bench_table("table/32-vars", iterations * 100);
+
+    if (bench_selected("build/small"))
+        status |= bench_build_notice(&client, "build/small", iterations * 100, 1, 0, "");
+    if (bench_selected("build/medium"))
+        status |= bench_build_notice(&client, "build/medium", iterations * 10, 32, 32, "value with <markup> & entities");
+#if !defined(AIRBRAKE_STATIC_ALLOCATION) || AIRBRAKE_STATIC_MAX_BLOCK >= 1024 * 1024
+    /* about half a megabyte of XML, more than the static arena usually allows in one block */
+    if (bench_selected("build/huge"))
+        status |= bench_build_notice(&client, "build/huge", iterations / 10, 1000, 1000,
+            "a long header value with <markup> & \"entities\" that repeats, "
+            "a long header value with <markup> & \"entities\" that repeats, "
+            "a long header value with <markup> & \"entities\" that repeats, "
+            "a long header value with <markup> & \"entities\" that repeats");
+#endif
+    if (bench_selected("report/c"))
+        status |= bench_report(endpoint, &client, "report/c", iterations * 10, 0);
+    if (bench_selected("report/hpp"))
+        status |= bench_report(endpoint, &client, "report/hpp", iterations * 10, 1);
+    if (bench_selected("build/table-vars"))
+        status |= bench_build(&client, "build/table-vars", iterations * 10, 0);
+    if (bench_selected("build/provider-vars"))
+        status |= bench_build(&client, "build/provider-vars", iterations * 10, 1);
+
+    /* a zero limit releases the buffers after every call, as before */
+    airbrake_client_set_buffer_limit(&client, 0);
+    if (bench_selected("submit/fresh-buffers"))
+        status |= bench_submit(&client, "submit/fresh-buffers", iterations);
+    airbrake_client_set_buffer_limit(&client, AIRBRAKE_CLIENT_BUFFER_DEFAULT_LIMIT);
+    if (bench_selected("submit/reused-buffers"))
+        status |= bench_submit(&client, "submit/reused-buffers", iterations);
+    airbrake_client_set_fire_and_forget(&client, 1);
+    if (bench_selected("submit/fire-and-forget"))
+        status |= bench_submit(&client, "submit/fire-and-forget", iterations);
+    airbrake_client_set_fire_and_forget(&client, 0);
+    if (bench_selected("submit/pipelined"))
+        status |= bench_pipeline(&client, "submit/pipelined", iterations, 0);
+    if (bench_selected("submit/pipelined-gzip"))
+        status |= bench_pipeline(&client, "submit/pipelined-gzip", iterations, 1);
+    airbrake_client_set_batch_endpoint(&client, airbrake_string_static_z(batch_endpoint), 0, 0, -1);
+    if (bench_selected("submit/batched"))
+        status |= bench_enqueue(&client, "submit/batched", iterations);
+
+    airbrake_client_fini(&client);
+    standin_stop(standin);
+    airbrake_cleanup();
+    return status;
+}
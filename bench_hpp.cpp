@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2011 Moriyoshi Koizumi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * The airbrake.hpp side of the report/ cases in bench.c, which times it
+ * and counts its allocations against the same notice put together in C.
+ */
+#include <new>
+#include "airbrake.hpp"
+
+extern "C" {
+
+void *bench_hpp_client_new(const char *endpoint)
+{
+    try {
+        return new airbrake::client(endpoint, "0123456789abcdef");
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void bench_hpp_client_delete(void *client)
+{
+    delete static_cast<airbrake::client *>(client);
+}
+
+int bench_hpp_report(void *client, airbrake_string_t *buf, int frames, int vars)
+{
+    static const std::string_view keys[] = {
+        airbrake::keys::request_method, airbrake::keys::request_uri, airbrake::keys::query_string, airbrake::keys::remote_addr,
+        airbrake::keys::server_name, airbrake::keys::http_host, airbrake::keys::http_user_agent, airbrake::keys::http_referer
+    };
+    airbrake::client &c = *static_cast<airbrake::client *>(client);
+
+    try {
+        airbrake::notice n = c.make_notice();
+        n.exception("RuntimeError", "something <went> wrong & \"badly\"");
+        for (int i = 0; i < frames; i++)
+            n.frame("app::handlers::process_request", "/srv/app/src/handlers/process_request.cpp", i + 1);
+        n.request("http://example.com/some/path?q=1&r=2", "handlers", "process");
+        for (int i = 0; i < vars; i++)
+            n.cgi(keys[i % 8], "value with <markup> & entities");
+        n.environment("/srv/app", "production", "1.2.3");
+        buf->l = 0;
+        return airbrake_client_build_notice_xml(c.get(), buf, n.get()) != AIRBRAKE_OK;
+    } catch (...) {
+        return 1;
+    }
+}
+
+}
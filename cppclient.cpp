@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2011 Moriyoshi Koizumi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Exercises airbrake.hpp against the loopback stand-in: builds notices from
+ * a caught exception, from an empty exception_ptr and by hand, and one that
+ * outlives its client, submits each of them, and exits non-zero unless
+ * every one is accepted.
+ */
+#include <cstdio>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include "airbrake.hpp"
+#include "standin.h"
+
+static void raise_error()
+{
+    throw std::runtime_error("raised from cppclient");
+}
+
+static int submit(airbrake::client &c, airbrake::notice &n, const char *what)
+{
+    airbrake::result r;
+    airbrake_error_t err = c.try_submit(n, r);
+    if (err) {
+        std::fprintf(stderr, "%s: %s\n", what, airbrake::error::describe(err));
+        return 1;
+    }
+    std::printf("%s: error_id: %.*s\n", what, (int)r.error_id().size(), r.error_id().data());
+    return 0;
+}
+
+int main()
+{
+    airbrake::library library;
+    standin_t *standin;
+    int failed = 0;
+
+    if (standin_start(&standin, 0)) {
+        std::fprintf(stderr, "failed to start the stand-in endpoint\n");
+        return 1;
+    }
+    try {
+        std::string endpoint = "http://127.0.0.1:" + std::to_string(standin_port(standin)) + "/notifier_api/v2/notices";
+        airbrake::client c(endpoint, "0123456789abcdef");
+
+        try {
+            raise_error();
+        } catch (...) {
+            airbrake::notice n = c.make_notice(std::current_exception());
+            n.frame("raise_error", "cppclient.cpp", __LINE__)
+                .environment({}, "test", {});
+            failed += submit(c, n, "caught exception");
+        }
+
+        {
+            airbrake::notice n = c.make_notice(std::exception_ptr());
+            n.environment({}, "test", {});
+            failed += submit(c, n, "empty exception_ptr");
+        }
+
+        {
+            airbrake::backtrace bt;
+            airbrake::string_table params;
+            bt.add(c.interns(), "main", "cppclient.cpp", __LINE__);
+            params.add("id", "<42>");
+            airbrake::notice n = c.make_notice();
+            n.exception("SomeClass", "some message & more")
+                .frames(std::move(bt))
+                .request("http://example.com/", "component", "action")
+                .params(std::move(params))
+                .cgi("HTTP_HOST", "example.com")
+                .environment("/srv/app", "test", "1.0");
+            failed += submit(c, n, "built by hand");
+        }
+    } catch (const std::exception &e) {
+        std::fprintf(stderr, "%s\n", e.what());
+        failed++;
+    }
+
+    /* a notice and an interned backtrace from an outer scope outlive their client */
+    try {
+        airbrake::notice late;
+        airbrake::backtrace frames;
+        {
+            std::string endpoint = "http://127.0.0.1:" + std::to_string(standin_port(standin)) + "/notifier_api/v2/notices";
+            airbrake::client c(endpoint, "0123456789abcdef");
+            frames.add(c.interns(), "main", "cppclient.cpp", __LINE__);
+            late = c.make_notice();
+            late.exception("SomeClass", "outlives its client")
+                .frames(std::move(frames))
+                .environment({}, "test", {});
+            failed += submit(c, late, "outer scope");
+            frames.add(c.interns(), "main", "cppclient.cpp", __LINE__);
+        }
+    } catch (const std::exception &e) {
+        std::fprintf(stderr, "%s\n", e.what());
+        failed++;
+    }
+    if (standin_requests(standin) != 4)
+        failed++;
+    standin_stop(standin);
+    return failed != 0;
+}
@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2011 Moriyoshi Koizumi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Drives a client from a plain epoll loop: the library reports which
+ * sockets to watch and when to time out, and the loop calls back in on
+ * readiness.  Submits a number of notices to the loopback stand-in, one
+ * transfer each and then once more as a single batch, and exits non-zero
+ * unless every one of them completes successfully.  Then has the stand-in
+ * answer with error pages that are not XML and checks that each failure
+ * still carries the error its HTTP status maps to.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "airbrake.h"
+#include "standin.h"
+
+typedef struct eventloop_t {
+    int epfd;
+    long deadline;
+    airbrake_client_t *client;
+    int completed;
+    int failed;
+    airbrake_error_t last_err;
+} eventloop_t;
+
+static long eventloop_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void eventloop_socket_func(void *ctx, int fd, int events)
+{
+    eventloop_t *loop = ctx;
+    struct epoll_event ev;
+
+    if (events & AIRBRAKE_POLL_REMOVE) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, 0);
+        return;
+    }
+    ev.events = 0;
+    if (events & AIRBRAKE_POLL_IN)
+        ev.events |= EPOLLIN;
+    if (events & AIRBRAKE_POLL_OUT)
+        ev.events |= EPOLLOUT;
+    ev.data.fd = fd;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) && errno == ENOENT)
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void eventloop_timer_func(void *ctx, long timeout_ms)
+{
+    eventloop_t *loop = ctx;
+    loop->deadline = timeout_ms < 0 ? -1: eventloop_now_ms() + timeout_ms;
+}
+
+static void eventloop_completion_func(void *ctx, airbrake_error_t err, const airbrake_notice_result_t *result)
+{
+    eventloop_t *loop = ctx;
+    loop->completed++;
+    loop->last_err = err;
+    if (err) {
+        loop->failed++;
+        fprintf(stderr, "notice failed: %d\n", err);
+        return;
+    }
+    printf("error_id: %s, url: %s, id: %s\n", result->error_id.p, result->url.p, result->id.p);
+}
+
+static int eventloop_run(eventloop_t *loop, int expected)
+{
+    struct epoll_event events[16];
+
+    while (loop->completed < expected) {
+        int n, i, timeout = -1;
+
+        if (loop->deadline >= 0) {
+            long remaining = loop->deadline - eventloop_now_ms();
+            timeout = remaining > 0 ? (int)remaining: 0;
+        }
+        n = epoll_wait(loop->epfd, events, 16, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        if (n == 0) {
+            loop->deadline = -1;
+            airbrake_client_socket_action(loop->client, AIRBRAKE_SOCKET_TIMEOUT, 0);
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            int ev = 0;
+            if (events[i].events & EPOLLIN)
+                ev |= AIRBRAKE_POLL_IN;
+            if (events[i].events & EPOLLOUT)
+                ev |= AIRBRAKE_POLL_OUT;
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+                ev |= AIRBRAKE_POLL_ERROR;
+            airbrake_client_socket_action(loop->client, events[i].data.fd, ev);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int nnotices = argc > 1 ? atoi(argv[1]): 8, i, status = 1;
+    char endpoint[128], batch_endpoint[128];
+    standin_t *standin;
+    airbrake_client_t client;
+    airbrake_notice_slot_t *slot;
+    eventloop_t loop = { -1, -1, 0, 0, 0, AIRBRAKE_OK };
+
+    airbrake_init();
+    if (standin_start(&standin, 0)) {
+        fprintf(stderr, "failed to start the stand-in endpoint\n");
+        return 1;
+    }
+    snprintf(endpoint, sizeof(endpoint), "http://127.0.0.1:%u/notifier_api/v2/notices", standin_port(standin));
+    snprintf(batch_endpoint, sizeof(batch_endpoint), "http://127.0.0.1:%u/notifier_api/v2/notices/batch", standin_port(standin));
+    if (airbrake_client_init(&client, 0, airbrake_string_static_z(endpoint), airbrake_string_static_z("0123456789abcdef")))
+        goto out_standin;
+
+    loop.epfd = epoll_create1(0);
+    loop.client = &client;
+    if (loop.epfd < 0 || airbrake_client_attach_event_loop(&client, eventloop_socket_func, eventloop_timer_func, &loop))
+        goto out_client;
+    /* a full batch goes out through the loop instead of blocking the enqueuer */
+    if (airbrake_client_set_batch_endpoint(&client, airbrake_string_static_z(batch_endpoint), nnotices, 0, -1))
+        goto out_client;
+
+    if (airbrake_client_acquire_notice(&client, &slot))
+        goto out_client;
+    airbrake_exception_reset(&slot->exception, airbrake_string_static_z("SomeClass"), airbrake_string_static_z("some message"));
+    airbrake_backtrace_add_entry(slot->exception.backtrace, airbrake_string_static_z("main"), airbrake_string_static_z("eventloop.c"), __LINE__);
+    airbrake_environment_info_reset(&slot->environment, airbrake_string_null, airbrake_string_static_z("test"), airbrake_string_null);
+    slot->notice.request = 0;
+
+    /* the notice is serialized on submission, so one slot serves every transfer */
+    for (i = 0; i < nnotices; i++) {
+        if (airbrake_client_submit_notice_async(&client, &slot->notice, eventloop_completion_func, &loop)) {
+            fprintf(stderr, "submission failed\n");
+            airbrake_client_release_notice(&client, slot);
+            goto out_client;
+        }
+    }
+    for (i = 0; i < nnotices; i++) {
+        if (airbrake_client_enqueue_notice(&client, &slot->notice, eventloop_completion_func, &loop)) {
+            fprintf(stderr, "enqueue failed\n");
+            airbrake_client_release_notice(&client, slot);
+            goto out_client;
+        }
+    }
+
+    if (eventloop_run(&loop, nnotices * 2) == 0 && loop.failed == 0 && standin_requests(standin) == (unsigned long)nnotices * 2)
+        status = 0;
+    printf("%d completed, %d failed\n", loop.completed, loop.failed);
+
+    for (i = 0; status == 0 && i < 2; i++) {
+        static const char *const specs[] = { "429=1", "500=1" };
+        static const airbrake_error_t expected[] = { AIRBRAKE_ERROR_THROTTLED, AIRBRAKE_ERROR_UNEXPECTED };
+        standin_faults_t faults;
+
+        memset(&faults, 0, sizeof(faults));
+        standin_parse_faults(&faults, specs[i]);
+        standin_set_faults(standin, &faults);
+        if (airbrake_client_submit_notice_async(&client, &slot->notice, eventloop_completion_func, &loop)
+                || eventloop_run(&loop, loop.completed + 1) || loop.last_err != expected[i]) {
+            fprintf(stderr, "%s: expected %d, got %d\n", specs[i], expected[i], loop.last_err);
+            status = 1;
+        }
+    }
+    airbrake_client_release_notice(&client, slot);
+
+out_client:
+    airbrake_client_fini(&client);
+    /* after fini, which still removes the client's sockets from it */
+    if (loop.epfd >= 0)
+        close(loop.epfd);
+out_standin:
+    standin_stop(standin);
+    airbrake_cleanup();
+    return status;
+}
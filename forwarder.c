@@ -0,0 +1,413 @@
+/*
+ * Copyright (c) 2011 Moriyoshi Koizumi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Local forwarding agent.  Processes whose client was initialized with a
+ * unix:// endpoint write length-prefixed notice frames to this daemon, which
+ * submits each of them upstream as a notice of its own, or, given a collector
+ * batch endpoint with -b, in batches of several notices a request.  The
+ * upstream client runs on the daemon's own poll loop, so connections keep
+ * being read while notices are on their way.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "airbrake.h"
+
+#define FORWARDER_MAX_CONNS 1024
+#define FORWARDER_MAX_FRAME (16 * 1024 * 1024)
+#define FORWARDER_SHUTDOWN_MS 10000
+#define FORWARDER_READS_PER_WAKEUP 16
+
+typedef struct forwarder_conn_t {
+    int fd;
+    airbrake_string_t buf;
+} forwarder_conn_t;
+
+/* what the upstream client asked the loop to watch */
+typedef struct forwarder_upstream_t {
+    airbrake_client_t client;
+    struct pollfd *watches;
+    size_t nwatches;
+    size_t watches_cap;
+    long deadline;
+    int batching;
+    unsigned long failed;
+} forwarder_upstream_t;
+
+static volatile sig_atomic_t forwarder_stopping = 0;
+
+static void forwarder_handle_signal(int sig)
+{
+    forwarder_stopping = 1;
+}
+
+static long forwarder_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void forwarder_socket_func(void *ctx, int fd, int events)
+{
+    forwarder_upstream_t *upstream = ctx;
+    short poll_events = (events & AIRBRAKE_POLL_IN ? POLLIN: 0) | (events & AIRBRAKE_POLL_OUT ? POLLOUT: 0);
+    size_t i;
+
+    for (i = 0; i < upstream->nwatches; i++) {
+        if (upstream->watches[i].fd != fd)
+            continue;
+        if (events & AIRBRAKE_POLL_REMOVE)
+            upstream->watches[i] = upstream->watches[--upstream->nwatches];
+        else
+            upstream->watches[i].events = poll_events;
+        return;
+    }
+    if (events & AIRBRAKE_POLL_REMOVE)
+        return;
+    if (upstream->nwatches == upstream->watches_cap) {
+        size_t new_cap = upstream->watches_cap ? upstream->watches_cap * 2: 8;
+        struct pollfd *new_watches = realloc(upstream->watches, sizeof(struct pollfd) * new_cap);
+        if (!new_watches) {
+            fprintf(stderr, "forwarder: out of memory watching an upstream socket\n");
+            return;
+        }
+        upstream->watches = new_watches;
+        upstream->watches_cap = new_cap;
+    }
+    upstream->watches[upstream->nwatches].fd = fd;
+    upstream->watches[upstream->nwatches].events = poll_events;
+    upstream->watches[upstream->nwatches].revents = 0;
+    upstream->nwatches++;
+}
+
+static void forwarder_timer_func(void *ctx, long timeout_ms)
+{
+    forwarder_upstream_t *upstream = ctx;
+    upstream->deadline = timeout_ms < 0 ? -1: forwarder_now_ms() + timeout_ms;
+}
+
+static void forwarder_completion_func(void *ctx, airbrake_error_t err, const airbrake_notice_result_t *result)
+{
+    forwarder_upstream_t *upstream = ctx;
+    if (err) {
+        upstream->failed++;
+        fprintf(stderr, "forwarder: a notice failed upstream (%d), %lu so far\n", err, upstream->failed);
+    }
+}
+
+/* the poll timeout that wakes the loop for the upstream timer or the batch delay */
+static int forwarder_timeout(forwarder_upstream_t *upstream)
+{
+    long timeout = airbrake_client_batch_timeout(&upstream->client);
+
+    if (upstream->deadline >= 0) {
+        long remaining = upstream->deadline - forwarder_now_ms();
+        if (remaining < 0)
+            remaining = 0;
+        if (timeout < 0 || remaining < timeout)
+            timeout = remaining;
+    }
+    return (int)timeout;
+}
+
+/* hands the events polled on the upstream sockets to the client */
+static void forwarder_upstream_events(forwarder_upstream_t *upstream, const struct pollfd *pfds, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        int events = 0;
+        if (!pfds[i].revents)
+            continue;
+        if (pfds[i].revents & POLLIN)
+            events |= AIRBRAKE_POLL_IN;
+        if (pfds[i].revents & POLLOUT)
+            events |= AIRBRAKE_POLL_OUT;
+        if (pfds[i].revents & (POLLERR | POLLHUP))
+            events |= AIRBRAKE_POLL_ERROR;
+        airbrake_client_socket_action(&upstream->client, pfds[i].fd, events);
+    }
+    if (upstream->deadline >= 0 && forwarder_now_ms() >= upstream->deadline) {
+        upstream->deadline = -1;
+        airbrake_client_socket_action(&upstream->client, AIRBRAKE_SOCKET_TIMEOUT, 0);
+    }
+    airbrake_client_poll_batch(&upstream->client);
+}
+
+/* returns non-zero when the connection must be dropped */
+static int forwarder_consume(forwarder_conn_t *conn, forwarder_upstream_t *upstream)
+{
+    size_t o = 0;
+
+    while (conn->buf.l - o >= 4) {
+        const unsigned char *h = (const unsigned char *)conn->buf.p + o;
+        size_t frame_len = ((size_t)h[0] << 24) | ((size_t)h[1] << 16) | ((size_t)h[2] << 8) | h[3];
+        airbrake_error_t err;
+        if (frame_len > FORWARDER_MAX_FRAME)
+            return 1;
+        if (conn->buf.l - o - 4 < frame_len)
+            break;
+        /* the frame is copied into the request, so the connection buffer may move on */
+        if (upstream->batching)
+            err = airbrake_client_enqueue_notice_xml(&upstream->client, airbrake_string_static(conn->buf.p + o + 4, frame_len), forwarder_completion_func, upstream);
+        else
+            err = airbrake_client_submit_notice_xml_async(&upstream->client, airbrake_string_static(conn->buf.p + o + 4, frame_len), forwarder_completion_func, upstream);
+        if (err) {
+            upstream->failed++;
+            fprintf(stderr, "forwarder: a notice could not be submitted (%d), %lu so far\n", err, upstream->failed);
+        }
+        o += 4 + frame_len;
+    }
+    memmove(conn->buf.p, conn->buf.p + o, conn->buf.l - o);
+    conn->buf.l -= o;
+    return 0;
+}
+
+static int forwarder_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "forwarder: socket path too long\n");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 128)) {
+        perror("forwarder");
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s -s SOCKET_PATH [-u UPSTREAM_URL] [-b BATCH_URL [-n BATCH_SIZE] [-t FLUSH_INTERVAL_MS]]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *socket_path = 0;
+    const char *upstream_url = airbrake_default_notice_endpoint_url.p;
+    const char *batch_url = 0;
+    size_t batch_size = 64;
+    long flush_interval = 1000, shutdown_deadline;
+    int opt, listen_fd, status = 0;
+    size_t nconns = 0, pfds_cap = 0, i;
+    forwarder_conn_t *conns;
+    struct pollfd *pfds = 0;
+    forwarder_upstream_t upstream;
+
+    while ((opt = getopt(argc, argv, "s:u:b:n:t:")) != -1) {
+        switch (opt) {
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'u':
+            upstream_url = optarg;
+            break;
+        case 'b':
+            batch_url = optarg;
+            break;
+        case 'n':
+            batch_size = strtoul(optarg, 0, 10);
+            break;
+        case 't':
+            flush_interval = strtol(optarg, 0, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!socket_path || batch_size == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    conns = calloc(FORWARDER_MAX_CONNS, sizeof(forwarder_conn_t));
+    if (!conns)
+        return 1;
+
+    memset(&upstream, 0, sizeof(upstream));
+    upstream.deadline = -1;
+    airbrake_init();
+    /* notices carry their own API key, so the upstream client needs none */
+    if (airbrake_client_init(&upstream.client, 0, airbrake_string_static_z(upstream_url), airbrake_string_null)) {
+        fprintf(stderr, "forwarder: failed to initialize the upstream client\n");
+        return 1;
+    }
+    /* batches need a collector that takes several notices a request, so they are opt-in */
+    upstream.batching = batch_url != 0;
+    if (airbrake_client_attach_event_loop(&upstream.client, forwarder_socket_func, forwarder_timer_func, &upstream)
+            || (upstream.batching && airbrake_client_set_batch_endpoint(&upstream.client, airbrake_string_static_z(batch_url), batch_size, 0, flush_interval))) {
+        fprintf(stderr, "forwarder: failed to set up the upstream event loop\n");
+        airbrake_client_fini(&upstream.client);
+        return 1;
+    }
+    listen_fd = forwarder_listen(socket_path);
+    if (listen_fd < 0) {
+        airbrake_client_fini(&upstream.client);
+        return 1;
+    }
+
+    signal(SIGINT, forwarder_handle_signal);
+    signal(SIGTERM, forwarder_handle_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (!forwarder_stopping) {
+        size_t nwatches = upstream.nwatches, watches_at = nconns + 1;
+        int n;
+
+        if (watches_at + nwatches > pfds_cap) {
+            struct pollfd *new_pfds = realloc(pfds, sizeof(struct pollfd) * (FORWARDER_MAX_CONNS + 1 + nwatches));
+            if (!new_pfds) {
+                status = 1;
+                break;
+            }
+            pfds = new_pfds;
+            pfds_cap = FORWARDER_MAX_CONNS + 1 + nwatches;
+        }
+        pfds[0].fd = listen_fd;
+        pfds[0].events = POLLIN;
+        for (i = 0; i < nconns; i++) {
+            pfds[i + 1].fd = conns[i].fd;
+            pfds[i + 1].events = POLLIN;
+        }
+        /* a snapshot, since the client changes its watches as it goes */
+        memcpy(pfds + watches_at, upstream.watches, sizeof(struct pollfd) * nwatches);
+
+        n = poll(pfds, watches_at + nwatches, forwarder_timeout(&upstream));
+        if (n < 0 && errno != EINTR) {
+            perror("forwarder");
+            status = 1;
+            break;
+        }
+        if (n < 0)
+            continue;
+
+        forwarder_upstream_events(&upstream, pfds + watches_at, nwatches);
+
+        if (n > 0 && (pfds[0].revents & POLLIN)) {
+            int fd;
+            while ((fd = accept(listen_fd, 0, 0)) >= 0) {
+                if (nconns == FORWARDER_MAX_CONNS) {
+                    close(fd);
+                    continue;
+                }
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                conns[nconns].fd = fd;
+                conns[nconns].buf = airbrake_string_null;
+                pfds[nconns + 1].revents = 0;
+                nconns++;
+            }
+        }
+
+        for (i = 0; n > 0 && i < nconns; i++) {
+            forwarder_conn_t *conn = &conns[i];
+            int drop = 0, reads;
+
+            if (!pfds[i + 1].revents)
+                continue;
+            /*
+             * Frames are taken off after every read, so the buffer never holds
+             * more than one partial frame, and a busy writer gets a bounded
+             * share of the loop.
+             */
+            for (reads = 0; !drop && reads < FORWARDER_READS_PER_WAKEUP; reads++) {
+                ssize_t r;
+                if (airbrake_string_grow(&conn->buf, conn->buf.l + 65536)) {
+                    drop = 1;
+                    break;
+                }
+                r = recv(conn->fd, conn->buf.p + conn->buf.l, 65536, 0);
+                if (r > 0) {
+                    conn->buf.l += r;
+                    drop = forwarder_consume(conn, &upstream);
+                    continue;
+                }
+                if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                    break;
+                drop = 1;
+            }
+            if (drop) {
+                close(conn->fd);
+                airbrake_string_fini(&conn->buf);
+                conns[i] = conns[nconns - 1];
+                pfds[i + 1] = pfds[nconns];
+                nconns--;
+                i--;
+            }
+        }
+    }
+
+    /* send what is left and give the transfers a while to finish */
+    airbrake_client_flush_batch(&upstream.client);
+    shutdown_deadline = forwarder_now_ms() + FORWARDER_SHUTDOWN_MS;
+    while (airbrake_client_transfers_in_flight(&upstream.client) > 0 && forwarder_now_ms() < shutdown_deadline) {
+        size_t nwatches = upstream.nwatches;
+        struct pollfd *watches = malloc(sizeof(struct pollfd) * (nwatches ? nwatches: 1));
+        int timeout = forwarder_timeout(&upstream);
+
+        if (!watches)
+            break;
+        memcpy(watches, upstream.watches, sizeof(struct pollfd) * nwatches);
+        if (timeout < 0 || timeout > 100)
+            timeout = 100;
+        if (poll(watches, nwatches, timeout) >= 0)
+            forwarder_upstream_events(&upstream, watches, nwatches);
+        free(watches);
+    }
+
+    for (i = 0; i < nconns; i++) {
+        close(conns[i].fd);
+        airbrake_string_fini(&conns[i].buf);
+    }
+    free(conns);
+    free(pfds);
+    close(listen_fd);
+    unlink(socket_path);
+    /* anything still in flight is reported failed here */
+    airbrake_client_fini(&upstream.client);
+    free(upstream.watches);
+    airbrake_cleanup();
+    return status;
+}
@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2011 Moriyoshi Koizumi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Load generator.  Each thread drives its own client and submits notices
+ * with airbrake_client_submit_notice() on a fixed schedule, so that the
+ * threads together offer the target rate.  Latency is taken from the time
+ * a submission was due, not the time it started, so that a server that
+ * falls behind shows up in the figures instead of slowing the load down.
+ * Without -u a loopback stand-in is started in process, with the faults
+ * given by -F.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "airbrake.h"
+#include "standin.h"
+
+#define LOADGEN_MAX_ERROR AIRBRAKE_ERROR_THROTTLED
+
+typedef struct loadgen_config_t {
+    const char *url;
+    int threads;
+    double rate;
+    long duration_ms;
+    long budget_ms;
+    double started_ns;
+} loadgen_config_t;
+
+typedef struct loadgen_thread_t {
+    pthread_t thread;
+    const loadgen_config_t *config;
+    int index;
+    double *latencies;
+    size_t n;
+    size_t cap;
+    unsigned long errors[LOADGEN_MAX_ERROR + 1];
+    int status;
+} loadgen_thread_t;
+
+static double loadgen_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void loadgen_sleep_until(double deadline_ns)
+{
+    double now = loadgen_now_ns();
+    struct timespec ts;
+
+    if (deadline_ns <= now)
+        return;
+    ts.tv_sec = (time_t)((deadline_ns - now) / 1e9);
+    ts.tv_nsec = (long)(deadline_ns - now - ts.tv_sec * 1e9);
+    while (nanosleep(&ts, &ts) && errno == EINTR);
+}
+
+static int loadgen_record(loadgen_thread_t *thread, double latency_ms)
+{
+    if (thread->n == thread->cap) {
+        size_t new_cap = thread->cap ? thread->cap * 2: 1024;
+        double *new_latencies = realloc(thread->latencies, sizeof(double) * new_cap);
+        if (!new_latencies)
+            return 1;
+        thread->latencies = new_latencies;
+        thread->cap = new_cap;
+    }
+    thread->latencies[thread->n++] = latency_ms;
+    return 0;
+}
+
+static airbrake_error_t loadgen_fill_notice(airbrake_notice_slot_t *slot, int index)
+{
+    airbrake_error_t err;
+    int i;
+
+    err = airbrake_exception_reset(&slot->exception, airbrake_string_static_z("LoadError"), airbrake_string_static_z("generated <under> load & \"stress\""));
+    if (err)
+        return err;
+    for (i = 0; i < 16; i++) {
+        err = airbrake_backtrace_add_entry(slot->exception.backtrace, airbrake_string_static_z("app::handlers::process_request"), airbrake_string_static_z("/srv/app/src/handlers/process_request.c"), i + 1);
+        if (err)
+            return err;
+    }
+    err = airbrake_request_info_reset(&slot->request, airbrake_string_static_z("http://example.com/load"), airbrake_string_static_z("loadgen"), airbrake_string_static_z("submit"));
+    if (err)
+        return err;
+    for (i = 0; i < 16; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "HTTP_X_LOADGEN_%d_%d", index, i);
+        err = airbrake_string_table_add(&slot->request.cgi_data, airbrake_string_static_z(key), airbrake_string_static_z("value"));
+        if (err)
+            return err;
+    }
+    return airbrake_environment_info_reset(&slot->environment, airbrake_string_static_z("/srv/app"), airbrake_string_static_z("load"), airbrake_string_static_z("1.0"));
+}
+
+static void *loadgen_thread_main(void *arg)
+{
+    loadgen_thread_t *thread = arg;
+    const loadgen_config_t *config = thread->config;
+    airbrake_client_t client;
+    airbrake_notice_slot_t *slot;
+    double interval_ns = config->rate > 0. ? config->threads * 1e9 / config->rate: 0.;
+    double due_ns, ends_ns = config->started_ns + config->duration_ms * 1e6;
+
+    thread->status = 1;
+    if (airbrake_client_init(&client, 0, airbrake_string_static_z(config->url), airbrake_string_static_z("0123456789abcdef")))
+        return 0;
+    airbrake_client_set_submit_budget(&client, config->budget_ms);
+    if (airbrake_client_acquire_notice(&client, &slot))
+        goto out;
+    if (loadgen_fill_notice(slot, thread->index))
+        goto out_slot;
+
+    /* the threads' schedules are staggered across one interval */
+    due_ns = config->started_ns + interval_ns * thread->index / config->threads;
+    loadgen_sleep_until(config->started_ns);
+    for (;;) {
+        airbrake_notice_result_t result;
+        airbrake_error_t err;
+
+        if (interval_ns > 0.) {
+            loadgen_sleep_until(due_ns);
+        } else {
+            due_ns = loadgen_now_ns();
+        }
+        if (due_ns >= ends_ns)
+            break;
+        err = airbrake_client_submit_notice(&client, &result, &slot->notice);
+        if (!err)
+            airbrake_notice_result_fini(&result);
+        thread->errors[err <= LOADGEN_MAX_ERROR ? err: AIRBRAKE_ERROR_UNKNOWN]++;
+        if (loadgen_record(thread, (loadgen_now_ns() - due_ns) / 1e6))
+            goto out_slot;
+        due_ns += interval_ns;
+    }
+    thread->status = 0;
+
+out_slot:
+    airbrake_client_release_notice(&client, slot);
+out:
+    airbrake_client_fini(&client);
+    return 0;
+}
+
+static int loadgen_compare(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1: x > y;
+}
+
+static double loadgen_percentile(const double *sorted, size_t n, double p)
+{
+    size_t i = (size_t)(p / 100. * n);
+    return sorted[i < n ? i: n - 1];
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-u URL | -F FAULTS] [-c THREADS] [-r RATE] [-d DURATION_MS] [-T BUDGET_MS] [-m MAX_DROP_RATE]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    static const double percentiles[] = { 50., 90., 99., 99.9 };
+    loadgen_config_t config = { 0, 8, 0., 5000, 1000, 0. };
+    standin_faults_t faults = { 0 };
+    standin_t *standin = 0;
+    loadgen_thread_t *threads;
+    char endpoint[128];
+    double *latencies, elapsed_ms, max_drop_rate = 1., drop_rate;
+    unsigned long errors[LOADGEN_MAX_ERROR + 1] = { 0 }, failed;
+    size_t n = 0, i;
+    int opt, has_faults = 0, j, status = 0;
+
+    while ((opt = getopt(argc, argv, "u:F:c:r:d:T:m:")) != -1) {
+        switch (opt) {
+        case 'u':
+            config.url = optarg;
+            break;
+        case 'F':
+            if (standin_parse_faults(&faults, optarg)) {
+                fprintf(stderr, "loadgen: invalid fault specification: %s\n", optarg);
+                return 1;
+            }
+            has_faults = 1;
+            break;
+        case 'c':
+            config.threads = atoi(optarg);
+            break;
+        case 'r':
+            config.rate = strtod(optarg, 0);
+            break;
+        case 'd':
+            config.duration_ms = strtol(optarg, 0, 10);
+            break;
+        case 'T':
+            config.budget_ms = strtol(optarg, 0, 10);
+            break;
+        case 'm':
+            max_drop_rate = strtod(optarg, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (config.threads <= 0 || config.duration_ms <= 0 || (config.url && has_faults)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    airbrake_init();
+    if (!config.url) {
+        if (standin_start(&standin, 0)) {
+            fprintf(stderr, "failed to start the stand-in endpoint\n");
+            return 1;
+        }
+        standin_set_faults(standin, &faults);
+        snprintf(endpoint, sizeof(endpoint), "http://127.0.0.1:%u/notifier_api/v2/notices", standin_port(standin));
+        config.url = endpoint;
+    }
+
+    threads = calloc(config.threads, sizeof(loadgen_thread_t));
+    if (!threads)
+        return 1;
+    /* gives every thread time to set up its client before the clock starts */
+    config.started_ns = loadgen_now_ns() + 100e6;
+    for (j = 0; j < config.threads; j++) {
+        threads[j].config = &config;
+        threads[j].index = j;
+        if (pthread_create(&threads[j].thread, 0, loadgen_thread_main, &threads[j])) {
+            config.threads = j;
+            status = 1;
+            break;
+        }
+    }
+    for (j = 0; j < config.threads; j++) {
+        pthread_join(threads[j].thread, 0);
+        status |= threads[j].status;
+        n += threads[j].n;
+        for (i = 0; i <= LOADGEN_MAX_ERROR; i++)
+            errors[i] += threads[j].errors[i];
+    }
+    elapsed_ms = (loadgen_now_ns() - config.started_ns) / 1e6;
+
+    latencies = malloc(sizeof(double) * (n ? n: 1));
+    if (!latencies)
+        return 1;
+    for (n = 0, j = 0; j < config.threads; j++) {
+        memcpy(latencies + n, threads[j].latencies, sizeof(double) * threads[j].n);
+        n += threads[j].n;
+        free(threads[j].latencies);
+    }
+    free(threads);
+    qsort(latencies, n, sizeof(double), loadgen_compare);
+
+    failed = n - errors[AIRBRAKE_OK];
+    drop_rate = n ? (double)failed / n: 0.;
+    printf("%lu notices in %.0f ms (%.1f/s), %lu failed (%.2f%% dropped)\n", (unsigned long)n, elapsed_ms, n * 1000. / elapsed_ms, failed, drop_rate * 100.);
+    if (n) {
+        printf("latency ms:");
+        for (i = 0; i < sizeof(percentiles) / sizeof(*percentiles); i++)
+            printf(" p%g=%.2f", percentiles[i], loadgen_percentile(latencies, n, percentiles[i]));
+        printf(" max=%.2f\n", latencies[n - 1]);
+    }
+    for (i = 1; i <= LOADGEN_MAX_ERROR; i++) {
+        if (errors[i])
+            printf("error %lu: %lu\n", (unsigned long)i, errors[i]);
+    }
+    if (standin)
+        printf("stand-in: %lu notices accepted, %lu faults injected\n", standin_requests(standin), standin_faults_injected(standin));
+    if (drop_rate > max_drop_rate)
+        status = 1;
+
+    free(latencies);
+    if (standin)
+        standin_stop(standin);
+    airbrake_cleanup();
+    return status;
+}
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2011 Moriyoshi Koizumi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Prefork layout: the master sets up a shared-memory ring before forking,
+ * the workers write notices into it, and the master drains the ring through
+ * its single client.  Exits non-zero unless every notice written by the
+ * workers reaches the loopback stand-in.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "airbrake.h"
+#include "standin.h"
+
+static int prefork_worker(airbrake_ring_t *ring, int id, int nnotices)
+{
+    airbrake_exception_t exception;
+    airbrake_environment_info_t environment;
+    airbrake_notice_t notice;
+    char message[64];
+    int i, written = 0;
+
+    snprintf(message, sizeof(message), "raised in worker %d", id);
+    if (airbrake_exception_init(&exception, airbrake_string_static_z("WorkerError"), airbrake_string_static_z(message)))
+        return 1;
+    if (airbrake_environment_info_init(&environment, airbrake_string_null, airbrake_string_static_z("test"), airbrake_string_null)) {
+        airbrake_exception_fini(&exception);
+        return 1;
+    }
+    notice.exception = &exception;
+    notice.request = 0;
+    notice.environment = &environment;
+
+    for (i = 0; i < nnotices; i++) {
+        airbrake_error_t err = airbrake_ring_write(ring, &notice);
+        if (err == AIRBRAKE_ERROR_QUEUE_FULL) {
+            /* the master is behind; a real worker would just drop the notice */
+            struct timespec ts = { 0, 1000000 };
+            nanosleep(&ts, 0);
+            i--;
+            continue;
+        }
+        if (err)
+            break;
+        written++;
+    }
+
+    airbrake_environment_info_fini(&environment);
+    airbrake_exception_fini(&exception);
+    return written != nnotices;
+}
+
+int main(int argc, char **argv)
+{
+    int nworkers = argc > 1 ? atoi(argv[1]): 4;
+    int nnotices = argc > 2 ? atoi(argv[2]): 64;
+    int i, running, status = 1;
+    size_t total = 0, expected = (size_t)nworkers * nnotices;
+    char endpoint[128];
+    standin_t *standin;
+    airbrake_client_t client;
+    airbrake_ring_t *ring;
+    airbrake_ring_stats_t stats;
+
+    airbrake_init();
+    /* an anonymous ring is shared with the workers by fork() alone */
+    if (airbrake_ring_init(&ring, airbrake_string_null, 64, 0)) {
+        fprintf(stderr, "failed to set up the ring\n");
+        return 1;
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            nworkers = i;
+            break;
+        }
+        if (pid == 0)
+            _exit(prefork_worker(ring, i, nnotices));
+    }
+    expected = (size_t)nworkers * nnotices;
+
+    if (standin_start(&standin, 0)) {
+        fprintf(stderr, "failed to start the stand-in endpoint\n");
+        goto out_ring;
+    }
+    snprintf(endpoint, sizeof(endpoint), "http://127.0.0.1:%u/notifier_api/v2/notices", standin_port(standin));
+    if (airbrake_client_init(&client, 0, airbrake_string_static_z(endpoint), airbrake_string_static_z("0123456789abcdef")))
+        goto out_standin;
+
+    for (running = nworkers; running > 0 || total < expected;) {
+        size_t drained = 0;
+        int wstatus;
+
+        if (airbrake_ring_drain(ring, &client, 0, &drained))
+            break;
+        total += drained;
+        while (running > 0 && waitpid(-1, &wstatus, WNOHANG) > 0) {
+            running--;
+            if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus))
+                fprintf(stderr, "a worker failed\n");
+        }
+        if (!drained) {
+            struct timespec ts = { 0, 1000000 };
+            if (running == 0) {
+                airbrake_ring_get_stats(ring, &stats);
+                if (stats.pending == 0)
+                    break;
+            }
+            nanosleep(&ts, 0);
+        }
+    }
+
+    airbrake_ring_get_stats(ring, &stats);
+    printf("%lu drained, %lu dropped, %lu abandoned\n", (unsigned long)total, stats.dropped, stats.abandoned);
+    if (total == expected && standin_requests(standin) == (unsigned long)expected)
+        status = 0;
+
+    airbrake_client_fini(&client);
+out_standin:
+    standin_stop(standin);
+out_ring:
+    while (waitpid(-1, 0, 0) > 0 || errno == EINTR)
+        ;
+    airbrake_ring_fini(&ring);
+    airbrake_cleanup();
+    return status;
+}
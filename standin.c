@@ -0,0 +1,647 @@
+/*
+ * Copyright (c) 2011 Moriyoshi Koizumi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "standin.h"
+
+typedef struct standin_conn_t standin_conn_t;
+
+typedef enum standin_fault_t {
+    STANDIN_FAULT_NONE,
+    STANDIN_FAULT_STALL,
+    STANDIN_FAULT_RESET,
+    STANDIN_FAULT_FORBIDDEN,
+    STANDIN_FAULT_INVALID_KEY,
+    STANDIN_FAULT_SERVER_ERROR,
+    STANDIN_FAULT_THROTTLED,
+    STANDIN_FAULT_WRONG_CONTENT_TYPE
+} standin_fault_t;
+
+struct standin_conn_t {
+    standin_conn_t *next;
+    standin_t *standin;
+    pthread_t thread;
+    int fd;
+    unsigned int seed;
+};
+
+struct standin_t {
+    int listen_fd;
+    unsigned short port;
+    pthread_t accept_thread;
+    pthread_mutex_t mutex;
+    standin_conn_t *conns;
+    unsigned long requests;
+    unsigned long faults_injected;
+    unsigned long connections;
+    standin_faults_t faults;
+    int stopping;
+};
+
+static int standin_write_all(int fd, const char *p, size_t l)
+{
+    while (l > 0) {
+        ssize_t n = send(fd, p, l, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        l -= n;
+    }
+    return 0;
+}
+
+static const char *standin_find_header(const char *headers, const char *name)
+{
+    size_t name_len = strlen(name);
+    const char *p = strstr(headers, "\r\n");
+    while (p) {
+        p += 2;
+        if (strncasecmp(p, name, name_len) == 0 && p[name_len] == ':') {
+            p += name_len + 1;
+            while (*p == ' ' || *p == '\t') p++;
+            return p;
+        }
+        p = strstr(p, "\r\n");
+    }
+    return 0;
+}
+
+static int standin_inflate(const char *p, size_t l, char **retval, size_t *retval_len)
+{
+    z_stream z;
+    size_t al = l * 4 + 1024;
+    char *out = malloc(al);
+    int zerr;
+
+    if (!out)
+        return -1;
+    memset(&z, 0, sizeof(z));
+    /* 32 added to the window bits accepts both zlib and gzip headers */
+    if (inflateInit2(&z, 15 + 32) != Z_OK) {
+        free(out);
+        return -1;
+    }
+    z.next_in = (Bytef *)p;
+    z.avail_in = l;
+    for (;;) {
+        z.next_out = (Bytef *)out + z.total_out;
+        z.avail_out = al - z.total_out - 1;
+        zerr = inflate(&z, Z_NO_FLUSH);
+        if (zerr == Z_STREAM_END)
+            break;
+        if (zerr != Z_OK && zerr != Z_BUF_ERROR)
+            goto fail;
+        if (z.avail_out == 0) {
+            char *new_out = realloc(out, al * 2);
+            if (!new_out)
+                goto fail;
+            out = new_out;
+            al *= 2;
+        } else if (z.avail_in == 0) {
+            goto fail;
+        }
+    }
+    out[z.total_out] = 0;
+    *retval = out;
+    *retval_len = z.total_out;
+    inflateEnd(&z);
+    return 0;
+fail:
+    inflateEnd(&z);
+    free(out);
+    return -1;
+}
+
+static double standin_random(unsigned int *seed)
+{
+    return rand_r(seed) / (RAND_MAX + 1.);
+}
+
+static void standin_sleep_ms(unsigned int ms)
+{
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    while (nanosleep(&ts, &ts) && errno == EINTR);
+}
+
+/* applies the configured delay and decides what goes wrong with this request, if anything */
+static standin_fault_t standin_inject(standin_t *standin, standin_conn_t *conn)
+{
+    standin_faults_t faults;
+    standin_fault_t fault = STANDIN_FAULT_NONE;
+    const double *rates[7];
+    unsigned int delay;
+    double r;
+    int i;
+
+    pthread_mutex_lock(&standin->mutex);
+    faults = standin->faults;
+    pthread_mutex_unlock(&standin->mutex);
+
+    rates[0] = &faults.stall_rate;
+    rates[1] = &faults.reset_rate;
+    rates[2] = &faults.forbidden_rate;
+    rates[3] = &faults.invalid_key_rate;
+    rates[4] = &faults.server_error_rate;
+    rates[5] = &faults.throttled_rate;
+    rates[6] = &faults.wrong_content_type_rate;
+    r = standin_random(&conn->seed);
+    for (i = 0; i < 7; i++) {
+        if (r < *rates[i]) {
+            fault = (standin_fault_t)(STANDIN_FAULT_STALL + i);
+            break;
+        }
+        r -= *rates[i];
+    }
+
+    delay = faults.latency_ms;
+    if (faults.jitter_ms)
+        delay += (unsigned int)(standin_random(&conn->seed) * (faults.jitter_ms + 1));
+    if (faults.tail_ms && standin_random(&conn->seed) < faults.tail_rate)
+        delay += faults.tail_ms;
+    if (delay && fault != STANDIN_FAULT_STALL)
+        standin_sleep_ms(delay);
+
+    if (fault != STANDIN_FAULT_NONE) {
+        pthread_mutex_lock(&standin->mutex);
+        standin->faults_injected++;
+        pthread_mutex_unlock(&standin->mutex);
+    }
+    return fault;
+}
+
+static int standin_respond_fault(standin_t *standin, int fd, standin_fault_t fault)
+{
+    char head[256];
+    const char *status, *content_type = "text/xml; charset=utf-8", *extra = "", *body;
+    int head_len;
+
+    switch (fault) {
+    case STANDIN_FAULT_FORBIDDEN:
+        status = "403 Forbidden";
+        body = "<?xml version=\"1.0\" encoding=\"UTF-8\"?><errors><error>SSL is not supported on this plan</error></errors>";
+        break;
+    case STANDIN_FAULT_INVALID_KEY:
+        status = "422 Unprocessable Entity";
+        body = "<?xml version=\"1.0\" encoding=\"UTF-8\"?><errors><error>No project exists with the given API key.</error></errors>";
+        break;
+    case STANDIN_FAULT_SERVER_ERROR:
+        /* as a proxy in front of the collector would answer */
+        status = "500 Internal Server Error";
+        content_type = "text/html; charset=utf-8";
+        body = "<html><body><h1>500 Internal Server Error</h1></body></html>";
+        break;
+    case STANDIN_FAULT_THROTTLED:
+        /* load balancers throttle with an empty body */
+        status = "429 Too Many Requests";
+        extra = "Retry-After: 1\r\n";
+        body = "";
+        break;
+    case STANDIN_FAULT_WRONG_CONTENT_TYPE:
+        status = "200 OK";
+        content_type = "text/html; charset=utf-8";
+        body = "<html><body><h1>It works!</h1></body></html>";
+        break;
+    default:
+        return -1;
+    }
+    head_len = snprintf(head, sizeof(head),
+        "HTTP/1.1 %s\r\n"
+        "Content-Type: %s\r\n"
+        "%s"
+        "Content-Length: %lu\r\n"
+        "\r\n", status, content_type, extra, (unsigned long)strlen(body));
+    if (standin_write_all(fd, head, head_len))
+        return -1;
+    return standin_write_all(fd, body, strlen(body));
+}
+
+/* a batched request is answered with one <notice> per notice it carried */
+static unsigned long standin_count_notices(const char *body, size_t body_len)
+{
+    unsigned long n = 0;
+    const char *p = body, *e = body + body_len;
+
+    if (!memmem(body, body_len, "<notices>", 9))
+        return 0;
+    while ((p = memmem(p, e - p, "<notice ", 8))) {
+        n++;
+        p += 8;
+    }
+    return n;
+}
+
+static int standin_respond(standin_t *standin, int fd, const char *req_body, size_t req_body_len)
+{
+    char item[256], head[256];
+    char *body = 0;
+    size_t body_len = 0, body_al = 0;
+    int item_len, head_len, retval = -1;
+    unsigned long batch = standin_count_notices(req_body, req_body_len), i, n = batch ? batch: 1;
+
+    for (i = 0; i <= n + 1; i++) {
+        if (i == 0 || i == n + 1) {
+            if (!batch)
+                continue;
+            item_len = snprintf(item, sizeof(item), i == 0 ?
+                "<?xml version=\"1.0\" encoding=\"UTF-8\"?><notices>": "</notices>");
+        } else {
+            unsigned long id;
+            pthread_mutex_lock(&standin->mutex);
+            id = ++standin->requests;
+            pthread_mutex_unlock(&standin->mutex);
+            item_len = snprintf(item, sizeof(item),
+                "%s"
+                "<notice>"
+                  "<error-id type=\"integer\">%lu</error-id>"
+                  "<url>http://127.0.0.1:%u/errors/%lu</url>"
+                  "<id type=\"integer\">%lu</id>"
+                "</notice>",
+                batch ? "": "<?xml version=\"1.0\" encoding=\"UTF-8\"?>",
+                id, standin->port, id, id);
+        }
+        if (body_len + item_len > body_al) {
+            size_t new_al = body_al ? body_al * 2: 1024;
+            char *new_body;
+            while (new_al < body_len + item_len)
+                new_al *= 2;
+            new_body = realloc(body, new_al);
+            if (!new_body)
+                goto out;
+            body = new_body;
+            body_al = new_al;
+        }
+        memcpy(body + body_len, item, item_len);
+        body_len += item_len;
+    }
+
+    head_len = snprintf(head, sizeof(head),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/xml; charset=utf-8\r\n"
+        "Content-Length: %lu\r\n"
+        "\r\n", (unsigned long)body_len);
+    if (standin_write_all(fd, head, head_len))
+        goto out;
+    retval = standin_write_all(fd, body, body_len);
+out:
+    free(body);
+    return retval;
+}
+
+static void *standin_conn_main(void *arg)
+{
+    standin_conn_t *conn = arg;
+    size_t al = 8192, l = 0;
+    char *buf = malloc(al);
+
+    if (!buf)
+        return 0;
+
+    for (;;) {
+        char *header_end;
+        const char *v;
+        size_t header_len, content_length = 0;
+        int gzipped;
+
+        while (!(header_end = l ? strstr(buf, "\r\n\r\n"): 0)) {
+            ssize_t n;
+            if (l + 1 >= al) {
+                char *new_buf = realloc(buf, al * 2);
+                if (!new_buf)
+                    goto out;
+                buf = new_buf;
+                al *= 2;
+            }
+            n = recv(conn->fd, buf + l, al - l - 1, 0);
+            if (n <= 0)
+                goto out;
+            l += n;
+            buf[l] = 0;
+        }
+        header_len = header_end + 4 - buf;
+        *header_end = 0;
+
+        v = standin_find_header(buf, "Content-Length");
+        if (v)
+            content_length = strtoul(v, 0, 10);
+        v = standin_find_header(buf, "Content-Encoding");
+        gzipped = v && strncasecmp(v, "gzip", 4) == 0;
+        v = standin_find_header(buf, "Expect");
+        if (v && strncasecmp(v, "100-continue", 12) == 0) {
+            static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+            if (standin_write_all(conn->fd, cont, sizeof(cont) - 1))
+                goto out;
+        }
+
+        while (l < header_len + content_length) {
+            ssize_t n;
+            if (l + 1 >= al) {
+                char *new_buf = realloc(buf, al * 2);
+                if (!new_buf)
+                    goto out;
+                buf = new_buf;
+                al *= 2;
+            }
+            n = recv(conn->fd, buf + l, al - l - 1, 0);
+            if (n <= 0)
+                goto out;
+            l += n;
+        }
+
+        {
+            char *req_body = buf + header_len, *inflated = 0;
+            size_t req_body_len = content_length;
+            standin_fault_t fault;
+            int failed;
+
+            if (gzipped) {
+                if (standin_inflate(req_body, req_body_len, &inflated, &req_body_len))
+                    goto out;
+                req_body = inflated;
+            }
+            fault = standin_inject(conn->standin, conn);
+            switch (fault) {
+            case STANDIN_FAULT_NONE:
+                failed = standin_respond(conn->standin, conn->fd, req_body, req_body_len);
+                break;
+            case STANDIN_FAULT_STALL:
+                /* holds the connection without answering until the peer or standin_stop() gives up */
+                while (recv(conn->fd, buf, al, 0) > 0);
+                failed = 1;
+                break;
+            case STANDIN_FAULT_RESET: {
+                /* a zero linger time turns close() into a reset */
+                struct linger lg = { 1, 0 };
+                setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+                pthread_mutex_lock(&conn->standin->mutex);
+                close(conn->fd);
+                conn->fd = -1;
+                pthread_mutex_unlock(&conn->standin->mutex);
+                failed = 1;
+                break;
+            }
+            default:
+                failed = standin_respond_fault(conn->standin, conn->fd, fault);
+                break;
+            }
+            free(inflated);
+            if (failed)
+                goto out;
+        }
+
+        l -= header_len + content_length;
+        memmove(buf, buf + header_len + content_length, l);
+        buf[l] = 0;
+    }
+out:
+    free(buf);
+    return 0;
+}
+
+static void *standin_accept_main(void *arg)
+{
+    standin_t *standin = arg;
+
+    for (;;) {
+        standin_conn_t *conn;
+        int one = 1;
+        int fd = accept(standin->listen_fd, 0, 0);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        conn = malloc(sizeof(standin_conn_t));
+        if (!conn) {
+            close(fd);
+            continue;
+        }
+        conn->standin = standin;
+        conn->fd = fd;
+        pthread_mutex_lock(&standin->mutex);
+        conn->seed = standin->faults.seed + (unsigned int)standin->connections++;
+        if (standin->stopping) {
+            pthread_mutex_unlock(&standin->mutex);
+            close(fd);
+            free(conn);
+            break;
+        }
+        if (pthread_create(&conn->thread, 0, standin_conn_main, conn)) {
+            pthread_mutex_unlock(&standin->mutex);
+            close(fd);
+            free(conn);
+            continue;
+        }
+        conn->next = standin->conns;
+        standin->conns = conn;
+        pthread_mutex_unlock(&standin->mutex);
+    }
+    return 0;
+}
+
+int standin_start(standin_t **retval, unsigned short port)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int one = 1;
+    standin_t *standin = malloc(sizeof(standin_t));
+
+    if (!standin)
+        return -1;
+    standin->conns = 0;
+    standin->requests = 0;
+    standin->faults_injected = 0;
+    standin->connections = 0;
+    memset(&standin->faults, 0, sizeof(standin->faults));
+    standin->stopping = 0;
+    standin->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (standin->listen_fd < 0)
+        goto fail;
+    setsockopt(standin->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(standin->listen_fd, (struct sockaddr *)&addr, sizeof(addr)))
+        goto fail_close;
+    if (listen(standin->listen_fd, 128))
+        goto fail_close;
+    if (getsockname(standin->listen_fd, (struct sockaddr *)&addr, &addr_len))
+        goto fail_close;
+    standin->port = ntohs(addr.sin_port);
+
+    if (pthread_mutex_init(&standin->mutex, 0))
+        goto fail_close;
+    if (pthread_create(&standin->accept_thread, 0, standin_accept_main, standin)) {
+        pthread_mutex_destroy(&standin->mutex);
+        goto fail_close;
+    }
+    *retval = standin;
+    return 0;
+
+fail_close:
+    close(standin->listen_fd);
+fail:
+    free(standin);
+    return -1;
+}
+
+unsigned short standin_port(const standin_t *standin)
+{
+    return standin->port;
+}
+
+unsigned long standin_requests(standin_t *standin)
+{
+    unsigned long retval;
+    pthread_mutex_lock(&standin->mutex);
+    retval = standin->requests;
+    pthread_mutex_unlock(&standin->mutex);
+    return retval;
+}
+
+unsigned long standin_faults_injected(standin_t *standin)
+{
+    unsigned long retval;
+    pthread_mutex_lock(&standin->mutex);
+    retval = standin->faults_injected;
+    pthread_mutex_unlock(&standin->mutex);
+    return retval;
+}
+
+void standin_set_faults(standin_t *standin, const standin_faults_t *faults)
+{
+    pthread_mutex_lock(&standin->mutex);
+    standin->faults = *faults;
+    pthread_mutex_unlock(&standin->mutex);
+}
+
+/*
+ * Parses a comma-separated list of key=value settings, e.g.
+ * "latency=20,jitter=10,500=0.05,stall=0.001".  Keys not mentioned keep
+ * their current values.
+ */
+int standin_parse_faults(standin_faults_t *faults, const char *spec)
+{
+    static const struct {
+        const char *key;
+        size_t offset;
+        int is_rate;
+    } keys[] = {
+        { "latency", offsetof(standin_faults_t, latency_ms), 0 },
+        { "jitter", offsetof(standin_faults_t, jitter_ms), 0 },
+        { "tail", offsetof(standin_faults_t, tail_ms), 0 },
+        { "tail-rate", offsetof(standin_faults_t, tail_rate), 1 },
+        { "stall", offsetof(standin_faults_t, stall_rate), 1 },
+        { "reset", offsetof(standin_faults_t, reset_rate), 1 },
+        { "403", offsetof(standin_faults_t, forbidden_rate), 1 },
+        { "422", offsetof(standin_faults_t, invalid_key_rate), 1 },
+        { "500", offsetof(standin_faults_t, server_error_rate), 1 },
+        { "429", offsetof(standin_faults_t, throttled_rate), 1 },
+        { "content-type", offsetof(standin_faults_t, wrong_content_type_rate), 1 },
+        { "seed", offsetof(standin_faults_t, seed), 0 }
+    };
+    const char *p = spec;
+
+    while (*p) {
+        const char *eq = strchr(p, '='), *end;
+        size_t i, key_len;
+        char *value_end;
+
+        if (!eq)
+            return -1;
+        key_len = eq - p;
+        end = strchr(eq, ',');
+        if (!end)
+            end = eq + strlen(eq);
+        for (i = 0; i < sizeof(keys) / sizeof(*keys); i++) {
+            if (strlen(keys[i].key) == key_len && strncmp(keys[i].key, p, key_len) == 0)
+                break;
+        }
+        if (i == sizeof(keys) / sizeof(*keys))
+            return -1;
+        if (keys[i].is_rate) {
+            double v = strtod(eq + 1, &value_end);
+            if (v < 0. || v > 1.)
+                return -1;
+            *(double *)((char *)faults + keys[i].offset) = v;
+        } else {
+            *(unsigned int *)((char *)faults + keys[i].offset) = (unsigned int)strtoul(eq + 1, &value_end, 10);
+        }
+        if (value_end != end)
+            return -1;
+        p = *end ? end + 1: end;
+    }
+    return 0;
+}
+
+void standin_stop(standin_t *standin)
+{
+    standin_conn_t *i, *next;
+
+    pthread_mutex_lock(&standin->mutex);
+    standin->stopping = 1;
+    pthread_mutex_unlock(&standin->mutex);
+
+    shutdown(standin->listen_fd, SHUT_RDWR);
+    pthread_join(standin->accept_thread, 0);
+    close(standin->listen_fd);
+
+    /* connections that were reset have closed their descriptors already */
+    pthread_mutex_lock(&standin->mutex);
+    for (i = standin->conns; i; i = i->next) {
+        if (i->fd >= 0)
+            shutdown(i->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&standin->mutex);
+    for (i = standin->conns; i; i = next) {
+        next = i->next;
+        pthread_join(i->thread, 0);
+        if (i->fd >= 0)
+            close(i->fd);
+        free(i);
+    }
+    pthread_mutex_destroy(&standin->mutex);
+    free(standin);
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2011 Moriyoshi Koizumi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#ifndef STANDIN_H
+#define STANDIN_H
+
+/*
+ * A minimal loopback HTTP server that answers notice submissions the way
+ * the real endpoint does.  Used by the benchmark and example programs so
+ * that they can run without network access or an API key, and, with
+ * faults injected, for load and resilience testing.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct standin_t standin_t;
+
+/*
+ * Every response is delayed by latency_ms plus a uniformly distributed
+ * 0..jitter_ms, and a tail_rate fraction of them by tail_ms on top.  The
+ * rates are probabilities per request: a stalled request is never
+ * answered, a reset one is dropped with a TCP RST, the status ones get
+ * that HTTP status, and a wrong content type is a 200 with an HTML body.
+ */
+typedef struct standin_faults_t {
+    unsigned int latency_ms;
+    unsigned int jitter_ms;
+    unsigned int tail_ms;
+    double tail_rate;
+    double stall_rate;
+    double reset_rate;
+    double forbidden_rate;
+    double invalid_key_rate;
+    double server_error_rate;
+    double throttled_rate;
+    double wrong_content_type_rate;
+    unsigned int seed;
+} standin_faults_t;
+
+int standin_start(standin_t **retval, unsigned short port);
+unsigned short standin_port(const standin_t *standin);
+unsigned long standin_requests(standin_t *standin);
+unsigned long standin_faults_injected(standin_t *standin);
+void standin_set_faults(standin_t *standin, const standin_faults_t *faults);
+int standin_parse_faults(standin_faults_t *faults, const char *spec);
+void standin_stop(standin_t *standin);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STANDIN_H */
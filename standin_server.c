@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2011 Moriyoshi Koizumi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Runs the loopback stand-in endpoint on its own, with optional fault
+ * injection, so that any client (the forwarder, a real application) can be
+ * pointed at it.  Runs until interrupted.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include "standin.h"
+
+static volatile sig_atomic_t standin_server_stopping = 0;
+
+static void standin_server_handle_signal(int sig)
+{
+    standin_server_stopping = 1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-p PORT] [-F FAULTS]\n"
+                    "FAULTS is a comma-separated list of key=value pairs:\n"
+                    "  latency=MS jitter=MS tail=MS tail-rate=P seed=N\n"
+                    "  stall=P reset=P 403=P 422=P 500=P 429=P content-type=P\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    standin_faults_t faults = { 0 };
+    unsigned short port = 0;
+    standin_t *standin;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:F:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = (unsigned short)strtoul(optarg, 0, 10);
+            break;
+        case 'F':
+            if (standin_parse_faults(&faults, optarg)) {
+                fprintf(stderr, "standin_server: invalid fault specification: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (standin_start(&standin, port)) {
+        perror("standin_server");
+        return 1;
+    }
+    standin_set_faults(standin, &faults);
+    signal(SIGINT, standin_server_handle_signal);
+    signal(SIGTERM, standin_server_handle_signal);
+    printf("listening on http://127.0.0.1:%u/notifier_api/v2/notices\n", standin_port(standin));
+    fflush(stdout);
+
+    while (!standin_server_stopping)
+        pause();
+
+    printf("%lu notices accepted, %lu faults injected\n", standin_requests(standin), standin_faults_injected(standin));
+    standin_stop(standin);
+    return 0;
+}